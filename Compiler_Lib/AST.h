@@ -38,6 +38,7 @@ namespace Compiler {
 	};
 
 	// Base AST node class
+	// Child getters return non-owning pointers.  Nodes keep ownership so a tree can be walked by more than one visitor
 	class AST
 	{
 	public:
@@ -51,11 +52,14 @@ namespace Compiler {
 	class BlockAST : public AST {
 		ASTType type = ASTType::BLOCK;
 		std::vector<std::shared_ptr<AST>> children;
+		// REGION ... ENDREGION.  Arrays made inside that don't outlive it are freed together at the end
+		bool region;
 	public:
-		BlockAST(std::vector<std::shared_ptr<AST>> children)
-			: children(std::move(children)) {}
+		BlockAST(std::vector<std::shared_ptr<AST>> children, bool region = false)
+			: children(std::move(children)), region(region) {}
 		const ASTType getType() override { return type; };
 		std::vector<std::shared_ptr<AST>> getChildren() { return children; };
+		bool isRegion() { return region; };
 
 		// Visitor hook
 		void accept(Visitor *v) override;
@@ -99,7 +103,7 @@ namespace Compiler {
 		const ASTType getType() override { return type; };
 		std::vector<std::shared_ptr<AST>> values;
 
-        std::unique_ptr<AST> getName() { return std::move(name); };
+        AST *getName() { return name.get(); };
 
         // Visitor hook
 		void accept(Visitor *v) override;
@@ -114,8 +118,8 @@ namespace Compiler {
 			: name(std::move(name)), rhs(std::move(rhs)) {}
 		const ASTType getType() override { return type; };
 
-		std::unique_ptr<AST> getName() { return std::move(name); };
-		std::unique_ptr<AST> getRhs() { return std::move(rhs); };
+		AST *getName() { return name.get(); };
+		AST *getRhs() { return rhs.get(); };
 
 		// Visitor hook
 		void accept(Visitor *v) override;
@@ -127,15 +131,24 @@ namespace Compiler {
 		std::unique_ptr<AST> name, body;
 		std::vector<std::shared_ptr<AST>> args;
 		bool isExternal;
+		// Body may be optimised with fast-math
+		bool fastMath;
+		// Callable from other object files.  Other functions are private to the program, apart from main
+		bool exported;
+		// Results are cached by argument, for pure functions
+		bool memo;
 	public:
-		FuncDefAST(std::unique_ptr<AST> name, bool isExternal, std::vector<std::shared_ptr<AST>> args, unique_ptr<AST> body)
-		: name(std::move(name)), isExternal(isExternal), args(std::move(args)), body(std::move(body)) {}
+		FuncDefAST(std::unique_ptr<AST> name, bool isExternal, std::vector<std::shared_ptr<AST>> args, unique_ptr<AST> body, bool fastMath = false, bool exported = false, bool memo = false)
+		: name(std::move(name)), isExternal(isExternal), args(std::move(args)), body(std::move(body)), fastMath(fastMath), exported(exported), memo(memo) {}
 		const ASTType getType() override { return type; };
 
-		std::unique_ptr<AST> getName() { return std::move(name); };
-		std::unique_ptr<AST> getBod() { return std::move(body); };
+		AST *getName() { return name.get(); };
+		AST *getBod() { return body.get(); };
 		std::vector<shared_ptr<AST>> getArgs() { return args; };
 		bool isExt() { return isExternal; };
+		bool isFast() { return fastMath; };
+		bool isExport() { return exported; };
+		bool isMemo() { return memo; };
 
 		// Visitor hook
 		void accept(Visitor *v) override;
@@ -151,7 +164,7 @@ namespace Compiler {
 			: name(std::move(name)), args(std::move(args)) {}
 		const ASTType getType() override { return type; };
 
-        std::unique_ptr<AST> getName() { return std::move(name); };
+        AST *getName() { return name.get(); };
         std::vector<shared_ptr<AST>> getArgs() { return args; };
 
         // Visitor hook
@@ -172,8 +185,8 @@ namespace Compiler {
 		// Visitor hook
 		void accept(Visitor *v) override;
 
-		std::unique_ptr<AST> getLhs() { return std::move(lhs); };
-		std::unique_ptr<AST> getRhs() { return std::move(rhs); };
+		AST *getLhs() { return lhs.get(); };
+		AST *getRhs() { return rhs.get(); };
 		TokenType getOp() { return op; };
 	};
 
@@ -191,7 +204,7 @@ namespace Compiler {
 		// Visitor hook
 		void accept(Visitor *v) override;
 
-		std::unique_ptr<AST> getOperand() { return std::move(operand); };
+		AST *getOperand() { return operand.get(); };
 		TokenType getOp() { return op; };
 	};
 
@@ -208,9 +221,9 @@ namespace Compiler {
 		// Visitor hook
 		void accept(Visitor *v) override;
 
-		std::unique_ptr<AST> getCond() { return std::move(condition); };
-		std::unique_ptr<AST> getThen() { return std::move(thenArm); };
-		std::unique_ptr<AST> getElse() { return std::move(elseArm); };
+		AST *getCond() { return condition.get(); };
+		AST *getThen() { return thenArm.get(); };
+		AST *getElse() { return elseArm.get(); };
 
 	};
 
@@ -227,9 +240,9 @@ namespace Compiler {
 		// Visitor hook
 		void accept(Visitor *v) override;
 
-		std::unique_ptr<AST> getCond() { return std::move(condition); };
-		std::unique_ptr<AST> getThen() { return std::move(thenBlock); };
-		std::unique_ptr<AST> getElse() { return std::move(elseBlock); };
+		AST *getCond() { return condition.get(); };
+		AST *getThen() { return thenBlock.get(); };
+		AST *getElse() { return elseBlock.get(); };
 	};
 
 	class ForAST : public AST {
@@ -237,24 +250,29 @@ namespace Compiler {
 		// Should this be an AST class?
 		std::string varName;
 		std::unique_ptr<AST> start, end, step, body;
+		// Hints from UNROLL n and VECTORIZE n.  0 leaves it to the optimiser
+		unsigned unroll, vectorize;
 
 	public:
 		ForAST(std::string varName, std::unique_ptr<AST> start,
 			std::unique_ptr<AST> end,
 			std::unique_ptr<AST> step,
-			std::unique_ptr<AST> body)
+			std::unique_ptr<AST> body,
+			unsigned unroll = 0, unsigned vectorize = 0)
 			: varName(std::move(varName)), start(std::move(start)), end(std::move(end)),
-			step(std::move(step)), body(std::move(body)) {}
+			step(std::move(step)), body(std::move(body)), unroll(unroll), vectorize(vectorize) {}
 		const ASTType getType() override { return type; };
 
 		// Visitor hook
 		void accept(Visitor *v) override;
 
 		std::string getVarName() { return varName; };
-		std::unique_ptr<AST> getStart() { return std::move(start); };
-		std::unique_ptr<AST> getEnd() { return std::move(end); };
-		std::unique_ptr<AST> getStep() { return std::move(step); };
-		std::unique_ptr<AST> getBody() { return std::move(body); };
+		AST *getStart() { return start.get(); };
+		AST *getEnd() { return end.get(); };
+		AST *getStep() { return step.get(); };
+		AST *getBody() { return body.get(); };
+		unsigned getUnroll() { return unroll; };
+		unsigned getVectorize() { return vectorize; };
 
 	};
 
@@ -0,0 +1,694 @@
+#include "analysis.h"
+#include <algorithm>
+
+namespace Compiler {
+
+    /* ---- SideEffectChecker ---- */
+
+    void SideEffectChecker::visit(FuncCallAST *node)
+    {
+        if (node->getName()->getType() != ASTType::NAME ||
+            !pureCalls.count(static_cast<NameAST *>(node->getName())->toString())) {
+            effects = true;
+            return;
+        }
+        for (const auto &arg : node->getArgs())
+            child(arg.get());
+    }
+
+    /* ---- VariableCollector ---- */
+
+    void VariableCollector::visit(AssignmentAST *node)
+    {
+        // Storing to an array element reads the array variable and the index
+        if (node->getName()->getType() == ASTType::NAME)
+            assigned.insert(static_cast<NameAST *>(node->getName())->toString());
+        else
+            child(node->getName());
+        child(node->getRhs());
+    }
+
+    void VariableCollector::visit(ForAST *node)
+    {
+        assigned.insert(node->getVarName());
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        child(node->getBody());
+    }
+
+    /* ---- CountedLoop ---- */
+
+    TokenType CountedLoop::varOp() const
+    {
+        if (varOnLeft)
+            return cond->getOp();
+        // Swap the operands: n > i is i < n
+        switch (cond->getOp()) {
+            case LESS:
+                return GREATER;
+            case GREATER:
+                return LESS;
+            case LEQ:
+                return GREQ;
+            case GREQ:
+                return LEQ;
+            default:
+                return cond->getOp();
+        }
+    }
+
+    // Whether an expression always gives the same value while the loop runs
+    static bool isInvariant(AST *node, const std::string &var, const std::set<std::string> &assigned,
+                            const std::set<std::string> &pureCalls)
+    {
+        SideEffectChecker effects;
+        effects.pureCalls = pureCalls;
+        if (effects.check(node))
+            return false;
+        VariableCollector vars;
+        vars.collect(node);
+        for (const auto &name : vars.read) {
+            if (name == var || assigned.count(name))
+                return false;
+        }
+        return true;
+    }
+
+    bool CountedLoop::match(ForAST *node, CountedLoop &loop, const std::set<std::string> &pureCalls)
+    {
+        AST *end = node->getEnd();
+        if (end->getType() != ASTType::BINARYOP)
+            return false;
+        auto cond = static_cast<BinaryOpAST *>(end);
+        switch (cond->getOp()) {
+            case LESS: case GREATER: case LEQ: case GREQ: case EQ: case NEQ:
+                break;
+            default:
+                return false;
+        }
+
+        // One side is the loop variable
+        auto isVar = [&](AST *operand) {
+            return operand->getType() == ASTType::NAME &&
+                   static_cast<NameAST *>(operand)->toString() == node->getVarName();
+        };
+        loop.cond = cond;
+        if (isVar(cond->getLhs())) {
+            loop.bound = cond->getRhs();
+            loop.varOnLeft = true;
+        } else if (isVar(cond->getRhs())) {
+            loop.bound = cond->getLhs();
+            loop.varOnLeft = false;
+        } else {
+            return false;
+        }
+
+        // The body mustn't move the variable, the bound or the step
+        VariableCollector body;
+        body.collect(node->getBody());
+        if (body.assigned.count(node->getVarName()))
+            return false;
+        if (!isInvariant(loop.bound, node->getVarName(), body.assigned, pureCalls))
+            return false;
+        return !node->getStep() || isInvariant(node->getStep(), node->getVarName(), body.assigned, pureCalls);
+    }
+
+    /* ---- LoopIndexFinder ---- */
+
+    std::set<std::string> LoopIndexFinder::find(ForAST *node)
+    {
+        LoopIndexFinder finder;
+        finder.var = node->getVarName();
+        finder.child(node->getBody());
+        if (finder.nested)
+            return {};
+        // The checks before the loop only cover the values the loop itself gives the variable
+        VariableCollector body;
+        body.collect(node->getBody());
+        if (body.assigned.count(finder.var))
+            return {};
+        std::set<std::string> arrays;
+        for (const auto &name : finder.indexed) {
+            if (name != finder.var && !body.assigned.count(name))
+                arrays.insert(name);
+        }
+        return arrays;
+    }
+
+    void LoopIndexFinder::visit(ArrayAST *node)
+    {
+        auto isVar = [&](AST *index) {
+            return index->getType() == ASTType::NAME && static_cast<NameAST *>(index)->toString() == var;
+        };
+        if (node->getName()->getType() == ASTType::NAME && node->values.size() == 1 && isVar(node->values[0].get()))
+            indexed.insert(static_cast<NameAST *>(node->getName())->toString());
+        for (const auto &val : node->values)
+            child(val.get());
+    }
+
+    /* ---- RecursionFinder ---- */
+
+    RecursionFinder::Result RecursionFinder::find(FuncDefAST *func, bool reassociateOps)
+    {
+        result = Result();
+        name = func->getName()->getType() == ASTType::NAME ? static_cast<NameAST *>(func->getName())->toString() : "";
+        arity = func->getArgs().size();
+        reassociate = reassociateOps;
+        // The body's value is the return value
+        child(func->getBod(), true);
+        return result;
+    }
+
+    void RecursionFinder::child(AST *node, bool isTail)
+    {
+        if (!node)
+            return;
+        bool old = tail;
+        tail = isTail;
+        node->accept(this);
+        tail = old;
+    }
+
+    bool RecursionFinder::isSelfCall(AST *node)
+    {
+        if (node->getType() != ASTType::FUNCCALL)
+            return false;
+        auto call = static_cast<FuncCallAST *>(node);
+        // Calls with the wrong number of arguments are reported by code generation
+        return call->getName()->getType() == ASTType::NAME &&
+               static_cast<NameAST *>(call->getName())->toString() == name && call->getArgs().size() == arity;
+    }
+
+    void RecursionFinder::visit(BlockAST *node)
+    {
+        // A block evaluates to its last statement.  A region is left after that, so nothing in it is a tail call
+        const auto &children = node->getChildren();
+        for (size_t i = 0; i < children.size(); i++)
+            child(children[i].get(), tail && !node->isRegion() && i + 1 == children.size());
+    }
+
+    void RecursionFinder::visit(FuncCallAST *node)
+    {
+        for (const auto &arg : node->getArgs())
+            child(arg.get());
+        if (!isSelfCall(node))
+            return;
+        if (tail)
+            result.tail.insert(node);
+        else
+            result.other.push_back(node);
+    }
+
+    void RecursionFinder::visit(BinaryOpAST *node)
+    {
+        AST *lhs = node->getLhs(), *rhs = node->getRhs();
+        bool accumulates = tail && reassociate && (node->getOp() == PLUS || node->getOp() == STAR);
+        // x + f(...) runs x before the call anyway.  f(...) + x runs the whole recursion before x, so x can only move
+        // in front of it if it has no side effects
+        SideEffectChecker effects;
+        FuncCallAST *call = nullptr;
+        if (accumulates && isSelfCall(rhs))
+            call = static_cast<FuncCallAST *>(rhs);
+        else if (accumulates && isSelfCall(lhs) && !effects.check(rhs))
+            call = static_cast<FuncCallAST *>(lhs);
+
+        if (!call) {
+            child(lhs);
+            child(rhs);
+            return;
+        }
+        result.accumulated[node] = call;
+        child(call == lhs ? rhs : lhs);
+        for (const auto &arg : call->getArgs())
+            child(arg.get());
+    }
+
+    void RecursionFinder::visit(TernaryOpAST *node)
+    {
+        child(node->getCond());
+        child(node->getThen(), tail);
+        child(node->getElse(), tail);
+    }
+
+    void RecursionFinder::visit(IfAST *node)
+    {
+        child(node->getCond());
+        child(node->getThen(), tail);
+        child(node->getElse(), tail);
+    }
+
+    void RecursionFinder::visit(ForAST *node)
+    {
+        // FOR evaluates to 0.0, so nothing inside it is in tail position
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        child(node->getBody());
+    }
+
+    /* ---- EscapeAnalysis ---- */
+
+    static std::string nameOf(AST *node)
+    {
+        return node->getType() == ASTType::NAME ? static_cast<NameAST *>(node)->toString() : "";
+    }
+
+    // Whether an expression is a call to array
+    static bool isArrayCall(AST *node)
+    {
+        if (node->getType() != ASTType::FUNCCALL)
+            return false;
+        auto call = static_cast<FuncCallAST *>(node);
+        return nameOf(call->getName()) == "array" && call->getArgs().size() == 1;
+    }
+
+    // Whether a call to array has a constant length small enough for the stack, and the length
+    static bool stackLength(AST *node, size_t &length)
+    {
+        AST *arg = static_cast<FuncCallAST *>(node)->getArgs()[0].get();
+        if (arg->getType() != ASTType::NUMBER)
+            return false;
+        double val = static_cast<NumberAST *>(arg)->getVal();
+        if (!(val >= 0 && val <= EscapeAnalysis::maxStackLength))
+            return false;
+        if (val != static_cast<double>(static_cast<size_t>(val)))
+            return false;
+        length = static_cast<size_t>(val);
+        return true;
+    }
+
+    void EscapeAnalysis::analyse(BlockAST *program)
+    {
+        functions.clear();
+        locals.clear();
+        regions.clear();
+
+        // array and len are only the runtime's when the program doesn't define its own
+        std::set<std::string> defined;
+        for (const auto &stmt : program->getChildren()) {
+            if (stmt->getType() == ASTType::FUNCDEF && !static_cast<FuncDefAST *>(stmt.get())->isExt())
+                defined.insert(nameOf(static_cast<FuncDefAST *>(stmt.get())->getName()));
+        }
+        builtinArray = builtinLen = false;
+        for (const auto &stmt : program->getChildren()) {
+            if (stmt->getType() != ASTType::FUNCDEF || !static_cast<FuncDefAST *>(stmt.get())->isExt())
+                continue;
+            auto def = static_cast<FuncDefAST *>(stmt.get());
+            std::string name = nameOf(def->getName());
+            if (def->getArgs().size() == 1 && !defined.count(name)) {
+                builtinArray = builtinArray || name == "array";
+                builtinLen = builtinLen || name == "len";
+            }
+        }
+
+        // Record how every variable is used
+        for (const auto &stmt : program->getChildren()) {
+            if (stmt->getType() != ASTType::FUNCDEF || static_cast<FuncDefAST *>(stmt.get())->isExt())
+                continue;
+            auto def = static_cast<FuncDefAST *>(stmt.get());
+            currentName = nameOf(def->getName());
+            current = &functions[currentName];
+            *current = Function();
+            for (const auto &arg : def->getArgs())
+                current->params.push_back(nameOf(arg.get()));
+            current->paramEscapes.assign(current->params.size(), false);
+            // The body's value is returned
+            child(def->getBod(), true);
+            current = nullptr;
+        }
+
+        // A parameter escapes if it is used directly or passed to a parameter that escapes.  Parameters only ever
+        // start escaping, so this finishes.  One that is assigned might hold something else, so it counts as escaping
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto &entry : functions) {
+                Function &func = entry.second;
+                for (size_t i = 0; i < func.params.size(); i++) {
+                    auto var = func.vars.find(func.params[i]);
+                    if (func.paramEscapes[i] || var == func.vars.end())
+                        continue;
+                    if (var->second.assignments || escapes(var->second)) {
+                        func.paramEscapes[i] = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // Arrays passed back into the same function aren't local, since a tail call jumps back to the start, where the
+        // array might be made again in the same memory
+        for (const auto &entry : functions) {
+            const Function &func = entry.second;
+            for (const auto &var : func.vars) {
+                bool recursive = std::any_of(var.second.passedTo.begin(), var.second.passedTo.end(),
+                                             [&](const std::pair<std::string, size_t> &use) {
+                                                 return use.first == entry.first;
+                                             });
+                bool param = std::find(func.params.begin(), func.params.end(), var.first) != func.params.end();
+                if (var.second.created && var.second.assignments == 1 && !param && !recursive && !escapes(var.second))
+                    locals[entry.first][var.first] = var.second.length;
+            }
+        }
+
+        // Other arrays go in the innermost region around every use of them, as long as every assignment makes one
+        // in that region rather than one inside it.  A REGION block is left and entered again on every trip round a
+        // loop, so the block has to make its array before anything uses it, or it could find the last trip's array
+        for (auto &entry : functions) {
+            Function &func = entry.second;
+            for (const auto &var : func.vars) {
+                const Variable &info = var.second;
+                bool param = std::find(func.params.begin(), func.params.end(), var.first) != func.params.end();
+                if (locals[entry.first].count(var.first) || param || !info.assignments || !info.allocated ||
+                    escapes(info) || info.assignmentDepth != info.scope.size())
+                    continue;
+                if (info.scope.empty())
+                    regions[entry.first][var.first] = nullptr;
+                else if (func.madeIn[info.scope.back()].count(var.first))
+                    regions[entry.first][var.first] = info.scope.back();
+            }
+        }
+    }
+
+    const std::map<std::string, size_t> &EscapeAnalysis::localArrays(const std::string &function) const
+    {
+        static const std::map<std::string, size_t> none;
+        auto found = locals.find(function);
+        return found != locals.end() ? found->second : none;
+    }
+
+    const std::map<std::string, BlockAST *> &EscapeAnalysis::regionArrays(const std::string &function) const
+    {
+        static const std::map<std::string, BlockAST *> none;
+        auto found = regions.find(function);
+        return found != regions.end() ? found->second : none;
+    }
+
+    void EscapeAnalysis::child(AST *node, bool valueUsed)
+    {
+        if (!node)
+            return;
+        bool old = used;
+        used = valueUsed;
+        node->accept(this);
+        used = old;
+    }
+
+    bool EscapeAnalysis::escapesThrough(const std::string &callee, size_t param) const
+    {
+        auto func = functions.find(callee);
+        if (func != functions.end())
+            return param >= func->second.paramEscapes.size() || func->second.paramEscapes[param];
+        // EXT functions could keep the array, except len
+        return !(builtinLen && callee == "len" && param == 0);
+    }
+
+    bool EscapeAnalysis::escapes(const Variable &var) const
+    {
+        if (var.escapes)
+            return true;
+        for (const auto &use : var.passedTo) {
+            if (escapesThrough(use.first, use.second))
+                return true;
+        }
+        return false;
+    }
+
+    void EscapeAnalysis::use(const std::string &name, bool made)
+    {
+        Variable &var = current->vars[name];
+        if (!var.seen) {
+            var.scope = enclosing;
+            var.seen = true;
+        } else {
+            size_t common = 0;
+            while (common < var.scope.size() && common < enclosing.size() && var.scope[common] == enclosing[common])
+                common++;
+            var.scope.resize(common);
+        }
+        for (BlockAST *region : enclosing) {
+            if (current->usedIn[region].insert(name).second && made && region == enclosing.back())
+                current->madeIn[region].insert(name);
+        }
+    }
+
+    void EscapeAnalysis::visit(BlockAST *node)
+    {
+        // Only the last statement gives the block's value
+        const auto &children = node->getChildren();
+        AST *oldStatement = statement;
+        if (node->isRegion())
+            enclosing.push_back(node);
+        for (size_t i = 0; i < children.size(); i++) {
+            if (node->isRegion())
+                statement = children[i].get();
+            child(children[i].get(), used && i + 1 == children.size());
+        }
+        if (node->isRegion())
+            enclosing.pop_back();
+        statement = oldStatement;
+    }
+
+    void EscapeAnalysis::visit(NameAST *node)
+    {
+        if (current) {
+            use(node->toString());
+            current->vars[node->toString()].escapes = true;
+        }
+    }
+
+    void EscapeAnalysis::visit(ArrayAST *node)
+    {
+        // Indexing doesn't let the array escape
+        if (current && node->getName()->getType() == ASTType::NAME)
+            use(nameOf(node->getName()));
+        for (const auto &val : node->values)
+            child(val.get());
+    }
+
+    void EscapeAnalysis::visit(AssignmentAST *node)
+    {
+        if (node->getName()->getType() != ASTType::NAME) {
+            // Storing to an element.  The index and the value are used
+            child(node->getName());
+            child(node->getRhs());
+            return;
+        }
+        bool made = !used && builtinArray && isArrayCall(node->getRhs());
+        size_t length = 0;
+        bool created = made && stackLength(node->getRhs(), length);
+        // The length is worked out before the array is made
+        if (made)
+            child(static_cast<FuncCallAST *>(node->getRhs())->getArgs()[0].get());
+        else
+            child(node->getRhs());
+        if (current) {
+            std::string name = nameOf(node->getName());
+            use(name, made && node == statement);
+            Variable &var = current->vars[name];
+            var.assignments++;
+            var.created = created;
+            var.length = length;
+            var.allocated = var.allocated && made;
+            var.assignmentDepth = std::max(var.assignmentDepth, enclosing.size());
+        }
+    }
+
+    void EscapeAnalysis::visit(FuncCallAST *node)
+    {
+        std::string callee = nameOf(node->getName());
+        const auto &args = node->getArgs();
+        for (size_t i = 0; i < args.size(); i++) {
+            if (current && args[i]->getType() == ASTType::NAME) {
+                use(nameOf(args[i].get()));
+                current->vars[nameOf(args[i].get())].passedTo.emplace_back(callee, i);
+            }
+            else
+                child(args[i].get());
+        }
+    }
+
+    void EscapeAnalysis::visit(ForAST *node)
+    {
+        // The loop variable shadows anything with its name, so nothing with that name can be a local array
+        if (current)
+            current->vars[node->getVarName()].escapes = true;
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        // FOR is always 0, so the body's value isn't used
+        child(node->getBody(), false);
+    }
+
+    /* ---- EffectAnalysis ---- */
+
+    void FunctionEffects::join(const FunctionEffects &callee)
+    {
+        memory = std::max(memory, callee.memory);
+        mayUnwind = mayUnwind || callee.mayUnwind;
+        mayNotReturn = mayNotReturn || callee.mayNotReturn;
+        // A callee recursing doesn't make the caller recursive.  That depends on whether the call graph leads back to
+        // the caller, which is worked out separately
+    }
+
+    bool FunctionEffects::operator==(const FunctionEffects &other) const
+    {
+        return memory == other.memory && mayUnwind == other.mayUnwind && mayNotReturn == other.mayNotReturn &&
+               mayRecurse == other.mayRecurse;
+    }
+
+    void EffectAnalysis::addExternal(const std::string &name, size_t args, FunctionEffects effects)
+    {
+        externals[name] = {args, effects};
+    }
+
+    void EffectAnalysis::analyse(BlockAST *program, const std::set<std::string> &stateful,
+                                 const EscapeAnalysis *escapes)
+    {
+        graph.clear();
+        results.clear();
+
+        // Build the call graph.  A definition takes over from an EXT declaration of the same name
+        for (const auto &stmt : program->getChildren()) {
+            if (stmt->getType() != ASTType::FUNCDEF)
+                continue;
+            auto def = static_cast<FuncDefAST *>(stmt.get());
+            if (def->getName()->getType() != ASTType::NAME)
+                continue;
+            std::string name = static_cast<NameAST *>(def->getName())->toString();
+            Node &node = graph[name];
+            if (def->isExt()) {
+                if (!node.defined) {
+                    auto known = externals.find(name);
+                    bool matches = known != externals.end() && known->second.first == def->getArgs().size();
+                    results[name] = matches ? known->second.second : FunctionEffects::unknown();
+                }
+                continue;
+            }
+            node = Node();
+            node.defined = true;
+            current = &node;
+            localArrays = escapes ? &escapes->localArrays(name) : nullptr;
+            child(def->getBod());
+            current = nullptr;
+            localArrays = nullptr;
+        }
+
+        // Start from what each function does itself, then take on the effects of callees until nothing changes.
+        // Effects only ever get worse, so this finishes, and recursive functions don't make themselves effectful
+        for (const auto &entry : graph) {
+            if (!entry.second.defined)
+                continue;
+            std::set<std::string> seen;
+            FunctionEffects effects;
+            effects.memory = entry.second.memory;
+            if (stateful.count(entry.first))
+                effects.memory = FunctionEffects::Effectful;
+            effects.mayRecurse = reaches(entry.first, entry.first, seen);
+            // FOR loops aren't guaranteed to finish, and neither is recursion.  A bad index exits
+            effects.mayNotReturn = entry.second.loops || effects.mayRecurse || entry.second.indexes;
+            results[entry.first] = effects;
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const auto &entry : graph) {
+                if (!entry.second.defined)
+                    continue;
+                FunctionEffects effects = results[entry.first];
+                for (const auto &callee : entry.second.callees) {
+                    auto result = results.find(callee);
+                    // Calls to unknown functions are reported by code generation
+                    effects.join(result != results.end() ? result->second : FunctionEffects::unknown());
+                }
+                if (effects != results[entry.first]) {
+                    results[entry.first] = effects;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    const FunctionEffects *EffectAnalysis::lookup(const std::string &name) const
+    {
+        auto result = results.find(name);
+        return result != results.end() ? &result->second : nullptr;
+    }
+
+    bool EffectAnalysis::reaches(const std::string &from, const std::string &target, std::set<std::string> &seen) const
+    {
+        for (const auto &callee : graph.at(from).callees) {
+            if (callee == target)
+                return true;
+            auto node = graph.find(callee);
+            if (node == graph.end())
+                continue;
+            if (!node->second.defined) {
+                // An EXT function might call back into the program, unless we know it doesn't
+                auto result = results.find(callee);
+                if (result == results.end() || result->second.mayRecurse)
+                    return true;
+                continue;
+            }
+            if (seen.insert(callee).second && reaches(callee, target, seen))
+                return true;
+        }
+        return false;
+    }
+
+    void EffectAnalysis::visit(FuncCallAST *node)
+    {
+        if (current && node->getName()->getType() == ASTType::NAME)
+            current->callees.insert(static_cast<NameAST *>(node->getName())->toString());
+        for (const auto &arg : node->getArgs())
+            child(arg.get());
+    }
+
+    bool EffectAnalysis::isLocal(AST *name) const
+    {
+        return localArrays && name->getType() == ASTType::NAME &&
+               localArrays->count(static_cast<NameAST *>(name)->toString());
+    }
+
+    void EffectAnalysis::visit(ArrayAST *node)
+    {
+        // Arrays in the function's own stack frame aren't memory anything else can see
+        if (current) {
+            if (!isLocal(node->getName()))
+                current->memory = std::max(current->memory, FunctionEffects::ReadOnly);
+            current->indexes = true;
+        }
+        for (const auto &val : node->values)
+            child(val.get());
+    }
+
+    void EffectAnalysis::visit(AssignmentAST *node)
+    {
+        if (node->getName()->getType() == ASTType::ARRAY) {
+            auto element = static_cast<ArrayAST *>(node->getName());
+            if (current) {
+                if (!isLocal(element->getName()))
+                    current->memory = FunctionEffects::Effectful;
+                current->indexes = true;
+            }
+            for (const auto &val : element->values)
+                child(val.get());
+        } else if (isLocal(node->getName())) {
+            // A stack array is made without calling array
+            return;
+        }
+        child(node->getRhs());
+    }
+
+    void EffectAnalysis::visit(ForAST *node)
+    {
+        if (current)
+            current->loops = true;
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        child(node->getBody());
+    }
+
+}  // namespace Compiler
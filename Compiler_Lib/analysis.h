@@ -0,0 +1,291 @@
+#pragma once
+#ifndef COMPILER_ANALYSIS_H
+#define COMPILER_ANALYSIS_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "AST.h"
+
+namespace Compiler {
+
+    // Finds out whether evaluating an expression could do anything other than produce a value.  Expressions without
+    // side effects can be evaluated speculatively, so && || and ?: can use selects instead of branches.
+    // Calls are assumed to have side effects since we don't know what the callee does, loops might not terminate, and
+    // indexing an array stops the program when the index is out of bounds
+    class SideEffectChecker : public Visitor {
+        bool effects = false;
+        void child(AST *node) { if (node && !effects) node->accept(this); };
+    public:
+        // Functions known to only compute a value, like the runtime's len
+        std::set<std::string> pureCalls;
+
+        bool check(AST *node) { effects = false; child(node); return effects; };
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override { };
+        void visit(ArrayAST* node) override { effects = true; };
+        void visit(AssignmentAST* node) override { effects = true; };
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override { effects = true; };
+        void visit(FuncDefAST* node) override { effects = true; };
+    };
+
+    // Collects the names of the variables a piece of code reads and the ones it assigns, FOR loop variables included
+    class VariableCollector : public Visitor {
+        void child(AST *node) { if (node) node->accept(this); };
+    public:
+        std::set<std::string> read, assigned;
+
+        void collect(AST *node) { child(node); };
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override { read.insert(node->toString()); };
+        void visit(ArrayAST* node) override { child(node->getName()); for (const auto &val : node->values) child(val.get()); };
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override { for (const auto &arg : node->getArgs()) child(arg.get()); };
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override { };
+    };
+
+    // A FOR loop which counts: the condition compares the loop variable with a bound, and nothing in the loop changes
+    // the variable, the bound or the step.  The bound and step can then be evaluated once before the loop, leaving a
+    // loop LLVM can work out the trip count of
+    struct CountedLoop {
+        // The condition, and which of its operands is the bound
+        BinaryOpAST *cond = nullptr;
+        AST *bound = nullptr;
+        // Whether the loop variable is the left operand of the condition
+        bool varOnLeft = true;
+
+        // Comparison the condition does with the loop variable on the left
+        TokenType varOp() const;
+        // Check whether a loop counts, filling in loop if it does.  The bound can call pureCalls
+        static bool match(ForAST *node, CountedLoop &loop, const std::set<std::string> &pureCalls = {});
+    };
+    // Finds the arrays a FOR loop body indexes with nothing but the loop variable, like a[i] or a[i] = x, which one
+    // test before the loop can show are always in bounds.  Arrays the body assigns to don't count, and none do if it
+    // assigns the loop variable.  Loops with a loop inside them are left alone, so no body is generated more than twice
+    class LoopIndexFinder : public Visitor {
+        std::string var;
+        std::set<std::string> indexed;
+        bool nested = false;
+        void child(AST *node) { if (node) node->accept(this); };
+    public:
+        // Arrays indexed by the loop variable, or none if the loop doesn't qualify
+        static std::set<std::string> find(ForAST *node);
+
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override { };
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override { child(node->getName()); child(node->getRhs()); };
+        void visit(FuncCallAST* node) override { for (const auto &arg : node->getArgs()) child(arg.get()); };
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override { nested = true; };
+        void visit(FuncDefAST* node) override { };
+    };
+
+    // Finds the calls a function makes to itself and sorts them by whether they can become a jump back to the start.
+    // A call in tail position, where its value is returned straight away, always can.  When reassociation is allowed
+    // so can a call that is an operand of + or * in tail position, by keeping a running sum and product
+    class RecursionFinder : public Visitor {
+    public:
+        struct Result {
+            // Calls whose value is returned directly
+            std::set<FuncCallAST *> tail;
+            // + and * in tail position with a call as one operand, and the call
+            std::map<BinaryOpAST *, FuncCallAST *> accumulated;
+            // Every other call, which still needs a stack frame
+            std::vector<FuncCallAST *> other;
+        };
+
+        Result find(FuncDefAST *func, bool reassociate);
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override { };
+        void visit(ArrayAST* node) override { for (const auto &val : node->values) child(val.get()); };
+        void visit(AssignmentAST* node) override { child(node->getName()); child(node->getRhs()); };
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override;
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override;
+        void visit(IfAST* node) override;
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override { };
+
+    private:
+        std::string name;
+        size_t arity = 0;
+        bool reassociate = false;
+        // Whether the node being visited is in tail position
+        bool tail = false;
+        Result result;
+
+        // Visit a node, in tail position or not
+        void child(AST *node, bool isTail = false);
+        bool isSelfCall(AST *node);
+    };
+
+    // Finds the arrays made with array(n) that can't outlive the function that makes them, so they can go in its stack
+    // frame or in a region freed when it returns.  An array escapes when its variable is used for anything but
+    // indexing, len, or passing to a parameter that doesn't let it escape either, which is worked out over the call
+    // graph.  Only the runtime's array and len count, declared with DEFINE EXT
+    class EscapeAnalysis : public Visitor {
+    public:
+        // Longest array that goes on the stack, in doubles
+        static const size_t maxStackLength = 512;
+
+        void analyse(BlockAST *program);
+        // Variables of a function that only ever hold the array from one `a = array(n)` with a constant n no more than
+        // maxStackLength, where the array never escapes, mapped to n
+        const std::map<std::string, size_t> &localArrays(const std::string &function) const;
+        // Variables of a function that only ever hold arrays from `a = array(n)` which never escape and aren't local,
+        // mapped to the REGION block they are freed at the end of, or nullptr for the end of the function.  Only
+        // arrays first made by a statement directly inside a REGION block, and used nowhere outside it, go in its region
+        const std::map<std::string, BlockAST *> &regionArrays(const std::string &function) const;
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override;
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen(), used); child(node->getElse(), used); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen(), used); child(node->getElse(), used); };
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override { };
+
+    private:
+        struct Variable {
+            unsigned assignments = 0;
+            // The only assignment is a = array(n) with a constant n, whose value isn't used
+            bool created = false;
+            size_t length = 0;
+            // Every assignment is a = array(n), whose value isn't used
+            bool allocated = true;
+            // Used for something other than indexing and passing to a function
+            bool escapes = false;
+            // Parameters the variable is passed to, which it escapes through if they do
+            std::vector<std::pair<std::string, size_t>> passedTo;
+            // The REGION blocks around every use, outermost first, and the most any assignment is inside
+            std::vector<BlockAST *> scope;
+            bool seen = false;
+            size_t assignmentDepth = 0;
+        };
+        struct Function {
+            std::vector<std::string> params;
+            std::map<std::string, Variable> vars;
+            // Parameters that let an array passed in them escape.  Only ever set, starting from none
+            std::vector<bool> paramEscapes;
+            // Variables used in each REGION block, and those whose first use there is a statement of the block
+            // making an array
+            std::map<BlockAST *, std::set<std::string>> usedIn, madeIn;
+        };
+        std::map<std::string, Function> functions;
+        std::map<std::string, std::map<std::string, size_t>> locals;
+        std::map<std::string, std::map<std::string, BlockAST *>> regions;
+        bool builtinArray = false, builtinLen = false;
+        // Function whose body is being visited, and whether the value of the node being visited is used
+        std::string currentName;
+        Function *current = nullptr;
+        bool used = true;
+        // REGION blocks around the node being visited, and the statement of the innermost one being visited
+        std::vector<BlockAST *> enclosing;
+        AST *statement = nullptr;
+
+        void child(AST *node, bool valueUsed = true);
+        // Record a use of a variable.  made is whether it is a statement of the innermost REGION block making an array
+        void use(const std::string &name, bool made = false);
+        bool escapesThrough(const std::string &callee, size_t param) const;
+        bool escapes(const Variable &var) const;
+    };
+
+    // What a call to a function can do, as far as the optimiser is concerned
+    struct FunctionEffects {
+        // Pure functions only compute on their arguments.  Read-only ones can also read memory
+        enum Memory { Pure, ReadOnly, Effectful } memory = Pure;
+        // Might throw.  SIMPLE code can't, but C functions we know nothing about might
+        bool mayUnwind = false;
+        // Might never return, because of a loop, recursion or an out of bounds index
+        bool mayNotReturn = false;
+        // Might be called again before it returns
+        bool mayRecurse = false;
+
+        // An EXT function we know nothing about
+        static FunctionEffects unknown() { return {Effectful, true, true, true}; };
+        // Add in the effects of a callee
+        void join(const FunctionEffects &callee);
+        bool operator==(const FunctionEffects &other) const;
+        bool operator!=(const FunctionEffects &other) const { return !(*this == other); };
+    };
+
+    // Works out the effects of every function in a program from the call graph.  A function is as bad as the worst
+    // thing it calls, so results are propagated from callees to callers until nothing changes.  EXT functions are
+    // unknown unless declared with addExternal
+    class EffectAnalysis : public Visitor {
+    public:
+        // Declare what an EXT function with this name and number of arguments does
+        void addExternal(const std::string &name, size_t args, FunctionEffects effects);
+        // Analyse a program.  Stateful functions keep state between calls, like a memo table, so they have effects
+        // even if their bodies don't.  Arrays escapes finds in a function's stack frame don't count as memory
+        void analyse(BlockAST *program, const std::set<std::string> &stateful = {},
+                     const EscapeAnalysis *escapes = nullptr);
+        // Effects of a function defined or declared by the program, or nullptr if there is no such function
+        const FunctionEffects *lookup(const std::string &name) const;
+
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override { };
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override { };
+
+    private:
+        // A function in the call graph
+        struct Node {
+            std::set<std::string> callees;
+            bool loops = false;
+            // Memory the function touches itself: reading array elements makes it read-only, storing to them
+            // effectful.  Either can stop the program on a bad index
+            FunctionEffects::Memory memory = FunctionEffects::Pure;
+            bool indexes = false;
+            // Whether the function has a body.  Otherwise it is EXT, and its effects are fixed
+            bool defined = false;
+        };
+        std::map<std::string, std::pair<size_t, FunctionEffects>> externals;
+        std::map<std::string, Node> graph;
+        std::map<std::string, FunctionEffects> results;
+        // Function whose body is being visited, and its stack arrays
+        Node *current = nullptr;
+        const std::map<std::string, size_t> *localArrays = nullptr;
+        bool isLocal(AST *name) const;
+
+        void child(AST *node) { if (node) node->accept(this); };
+        // Whether a call from a function can lead back to it
+        bool reaches(const std::string &from, const std::string &target, std::set<std::string> &seen) const;
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_ANALYSIS_H
@@ -0,0 +1,747 @@
+#include "bytecode.h"
+#include "evaluator.h"
+#include "vm.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace Compiler {
+
+    // Collects the numbers a function uses, which each get a constant register
+    class NumberCollector : public Visitor {
+        void child(AST *node) { if (node) node->accept(this); };
+    public:
+        std::vector<double> numbers;
+
+        void collect(AST *node) { child(node); };
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { numbers.push_back(node->getVal()); };
+        void visit(NameAST* node) override { };
+        void visit(ArrayAST* node) override { for (const auto &val : node->values) child(val.get()); };
+        void visit(AssignmentAST* node) override { child(node->getName()); child(node->getRhs()); };
+        void visit(FuncCallAST* node) override { for (const auto &arg : node->getArgs()) child(arg.get()); };
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override { };
+    };
+
+    void NumberCollector::visit(ForAST *node)
+    {
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        child(node->getBody());
+    }
+
+    static uint64_t bitsOf(double val)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &val, sizeof(double));
+        return bits;
+    }
+
+    // Position of a comparison in each group of comparison ops, or -1
+    static int comparison(TokenType op)
+    {
+        switch (op) {
+            case LESS:
+                return 0;
+            case GREATER:
+                return 1;
+            case EQ:
+                return 2;
+            case NEQ:
+                return 3;
+            case GREQ:
+                return 4;
+            case LEQ:
+                return 5;
+            default:
+                return -1;
+        }
+    }
+
+    static Op offset(Op first, int by)
+    {
+        return static_cast<Op>(static_cast<uint8_t>(first) + by);
+    }
+
+    // Ops which only write their result to a, so can be made to write somewhere else
+    static bool writesA(Op op)
+    {
+        return op == Op::Move || (op >= Op::Add && op <= Op::Bool) || op == Op::Load;
+    }
+
+    // Value of an expression code generation would fold to a constant, which decides how powers are generated
+    static bool constantValue(AST *node, double &val)
+    {
+        if (node->getType() == ASTType::NUMBER) {
+            val = static_cast<NumberAST *>(node)->getVal();
+            return true;
+        }
+        if (node->getType() == ASTType::UNARYOP) {
+            auto unary = static_cast<UnaryOpAST *>(node);
+            if (!constantValue(unary->getOperand(), val))
+                return false;
+            switch (unary->getOp()) {
+                case MINUS:
+                    val = 0.0 - val;
+                    return true;
+                case INC:
+                    val = val + 1.0;
+                    return true;
+                case DEC:
+                    val = val - 1.0;
+                    return true;
+                default:
+                    return false;
+            }
+        }
+        if (node->getType() == ASTType::BINARYOP) {
+            auto binary = static_cast<BinaryOpAST *>(node);
+            double lhs, rhs;
+            if (!constantValue(binary->getLhs(), lhs) || !constantValue(binary->getRhs(), rhs))
+                return false;
+            switch (binary->getOp()) {
+                case PLUS:
+                    val = lhs + rhs;
+                    return true;
+                case MINUS:
+                    val = lhs - rhs;
+                    return true;
+                case STAR:
+                    val = lhs * rhs;
+                    return true;
+                case SLASH:
+                    val = lhs / rhs;
+                    return true;
+                case MOD:
+                    val = std::fmod(lhs, rhs);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    BytecodeProgram BytecodeCompiler::compile(BlockAST *node)
+    {
+        program = BytecodeProgram();
+        functionIndex.clear();
+
+        // The runtime functions the VM provides are known.  Any other EXT function could do anything
+        for (const auto &stmt : node->getChildren()) {
+            if (stmt->getType() != ASTType::FUNCDEF || !static_cast<FuncDefAST *>(stmt.get())->isExt())
+                continue;
+            auto def = static_cast<FuncDefAST *>(stmt.get());
+            std::string name = nameOf(def->getName());
+            if (const RuntimeFunction *runtime = lookupRuntimeFunction(name, def->getArgs().size())) {
+                FunctionEffects known;
+                if (!runtime->pure)
+                    known.memory = FunctionEffects::Effectful;
+                effects.addExternal(name, runtime->args, known);
+            }
+        }
+        effects.analyse(node);
+
+        node->accept(this);
+
+        // Calls to functions that never got a body go to native code
+        for (auto &function : program.functions) {
+            for (auto &inst : function.code) {
+                if (inst.op != Op::Call || program.functions[inst.b].defined)
+                    continue;
+                if (inst.c > VM::maxNativeArgs)
+                    error("EXT function " + program.functions[inst.b].name + " has more than " +
+                          std::to_string(VM::maxNativeArgs) + " arguments.");
+                inst.op = Op::CallExt;
+            }
+        }
+        auto main = functionIndex.find("main");
+        if (main != functionIndex.end() && program.functions[main->second].defined)
+            program.main = main->second;
+        return std::move(program);
+    }
+
+    void BytecodeCompiler::error(const std::string &message)
+    {
+        throw std::runtime_error("Bytecode: " + message);
+    }
+
+    std::string BytecodeCompiler::nameOf(AST *node)
+    {
+        if (node->getType() != ASTType::NAME)
+            error("Expected a name");
+        return static_cast<NameAST *>(node)->toString();
+    }
+
+    uint16_t BytecodeCompiler::temp()
+    {
+        if (top >= UINT16_MAX)
+            error("Function " + func->name + " needs too many registers.");
+        func->frameSize = std::max(func->frameSize, top + 1);
+        return top++;
+    }
+
+    uint16_t BytecodeCompiler::constant(double val)
+    {
+        return constants.at(bitsOf(val));
+    }
+
+    bool BytecodeCompiler::isVariable(uint16_t reg) const
+    {
+        return reg < constantBase || (reg >= variableBase && reg < firstTemp) || loopVariables.count(reg);
+    }
+
+    uint16_t BytecodeCompiler::expr(AST *node, bool discardValue)
+    {
+        bool outer = discard;
+        discard = discardValue;
+        node->accept(this);
+        discard = outer;
+        return result;
+    }
+
+    uint16_t BytecodeCompiler::operand(AST *node, AST *later)
+    {
+        uint16_t val = expr(node);
+        if (!isVariable(val) || !sideEffects.check(later))
+            return val;
+        uint16_t copy = temp();
+        emit(Op::Move, copy, val);
+        return copy;
+    }
+
+    void BytecodeCompiler::move(uint16_t reg, uint16_t val)
+    {
+        if (reg == val)
+            return;
+        // A temporary worked out by the last instruction can go straight into the register, as long as nothing
+        // jumps in after that instruction
+        if (!isVariable(val) && val >= firstTemp && func->code.size() > label) {
+            Instruction &last = func->code.back();
+            if (writesA(last.op) && last.a == val) {
+                last.a = reg;
+                return;
+            }
+        }
+        emit(Op::Move, reg, val);
+    }
+
+    size_t BytecodeCompiler::emit(Op op, uint16_t a, uint16_t b, uint16_t c)
+    {
+        Instruction inst;
+        inst.op = op;
+        inst.a = a;
+        inst.b = b;
+        inst.c = c;
+        func->code.push_back(inst);
+        return func->code.size() - 1;
+    }
+
+    void BytecodeCompiler::patch(const std::vector<size_t> &jumps)
+    {
+        for (size_t jump : jumps)
+            func->code[jump].target = func->code.size();
+        label = func->code.size();
+    }
+
+    std::vector<size_t> BytecodeCompiler::branch(AST *cond, bool when)
+    {
+        unsigned mark = top;
+        if (cond->getType() == ASTType::BINARYOP) {
+            auto node = static_cast<BinaryOpAST *>(cond);
+            TokenType op = node->getOp();
+
+            // Only skip the rhs when the lhs decides the result.  Code generation evaluates a rhs without side
+            // effects either way, which can't make a difference
+            if (op == AND || op == OR) {
+                bool isAnd = op == AND;
+                if (when != isAnd) {
+                    std::vector<size_t> jumps = branch(node->getLhs(), when);
+                    std::vector<size_t> rhs = branch(node->getRhs(), when);
+                    jumps.insert(jumps.end(), rhs.begin(), rhs.end());
+                    return jumps;
+                }
+                std::vector<size_t> decided = branch(node->getLhs(), !when);
+                std::vector<size_t> jumps = branch(node->getRhs(), when);
+                patch(decided);
+                return jumps;
+            }
+
+            // Compare and branch in one instruction
+            int cmp = comparison(op);
+            if (cmp >= 0) {
+                uint16_t lhs = operand(node->getLhs(), node->getRhs());
+                uint16_t rhs = expr(node->getRhs());
+                top = mark;
+                return {emit(offset(when ? Op::JumpLt : Op::JumpNotLt, cmp), lhs, rhs)};
+            }
+        }
+        if (cond->getType() == ASTType::UNARYOP && static_cast<UnaryOpAST *>(cond)->getOp() == NOT)
+            return branch(static_cast<UnaryOpAST *>(cond)->getOperand(), !when);
+
+        uint16_t val = expr(cond);
+        top = mark;
+        return {emit(when ? Op::JumpIf : Op::JumpIfNot, val)};
+    }
+
+    void BytecodeCompiler::arm(AST *node, uint16_t dest)
+    {
+        unsigned mark = top;
+        if (discard)
+            expr(node, true);
+        else
+            move(dest, expr(node));
+        top = mark;
+    }
+
+    uint16_t BytecodeCompiler::power(uint16_t base, bool constBase, AST *exponent)
+    {
+        // Small constant whole exponents from -1 up are multiplies by repeated squaring, like code generation does
+        double val;
+        if (constantValue(exponent, val) && std::trunc(val) == val && val >= -1 && val <= maxPowMultiplies) {
+            int n = (int)val;
+            if (n == 0)
+                return constant(1.0);
+            int product = -1;
+            uint16_t square = base;
+            for (unsigned bits = std::abs(n); bits; bits >>= 1) {
+                if (bits & 1) {
+                    if (product < 0) {
+                        product = square;
+                    } else {
+                        uint16_t next = temp();
+                        emit(Op::Mul, next, product, square);
+                        product = next;
+                    }
+                }
+                if (bits > 1) {
+                    uint16_t next = temp();
+                    emit(Op::Mul, next, square, square);
+                    square = next;
+                }
+            }
+            if (n < 0) {
+                uint16_t reciprocal = temp();
+                emit(Op::Div, reciprocal, constant(1.0), product);
+                product = reciprocal;
+            }
+            return product;
+        }
+        return libmPower(base, constBase, exponent);
+    }
+
+    uint16_t BytecodeCompiler::libmPower(uint16_t base, bool constBase, AST *exponent)
+    {
+        // LLVM turns pow with a constant exponent of 2, -1 or 0.5 into x*x, 1/x or sqrt, which can round differently
+        // from pow itself, unless the base is constant too and it folds the call with pow.  sqrt(-0) is -0 and
+        // sqrt(-inf) is NaN, so those are fixed up to match pow
+        double val;
+        if (!constBase && constantValue(exponent, val) && (val == 2 || val == -1 || val == 0.5)) {
+            uint16_t dest = temp();
+            if (val == 2)
+                emit(Op::Mul, dest, base, base);
+            else if (val == -1)
+                emit(Op::Div, dest, constant(1.0), base);
+            else
+                emit(Op::PowHalf, dest, base);
+            return dest;
+        }
+        uint16_t exp = expr(exponent);
+        uint16_t dest = temp();
+        emit(Op::Pow, dest, base, exp);
+        return dest;
+    }
+
+    void BytecodeCompiler::visit(BlockAST *node)
+    {
+        // The top level is function definitions
+        if (!func) {
+            for (const auto &child : node->getChildren()) {
+                if (child->getType() != ASTType::FUNCDEF)
+                    error("Expected function definitions at the top level");
+                child->accept(this);
+            }
+            return;
+        }
+
+        // A block evaluates to its last statement.  Temporaries of the others are free once they are done
+        auto children = node->getChildren();
+        if (children.empty())
+            error("Empty block");
+        unsigned mark = top;
+        bool discardValue = discard;
+        for (size_t i = 0; i < children.size(); i++) {
+            bool last = i + 1 == children.size();
+            expr(children[i].get(), !last || discardValue);
+            if (!last)
+                top = mark;
+        }
+    }
+
+    void BytecodeCompiler::visit(NumberAST *node)
+    {
+        result = constant(node->getVal());
+    }
+
+    void BytecodeCompiler::visit(NameAST *node)
+    {
+        auto var = variables.find(node->toString());
+        if (var == variables.end())
+            error("Unknown variable name '" + node->toString() + "'");
+        result = var->second;
+    }
+
+    void BytecodeCompiler::visit(ArrayAST *node)
+    {
+        if (node->values.size() != 1)
+            error("Arrays take exactly one index");
+        unsigned mark = top;
+        uint16_t array = operand(node->getName(), node->values[0].get());
+        uint16_t index = expr(node->values[0].get());
+        top = mark;
+        result = temp();
+        emit(Op::Load, result, array, index);
+    }
+
+    void BytecodeCompiler::visit(AssignmentAST *node)
+    {
+        // a[i] = x works out x first, like code generation.  It evaluates to x
+        if (node->getName()->getType() == ASTType::ARRAY) {
+            auto element = static_cast<ArrayAST *>(node->getName());
+            if (element->values.size() != 1)
+                error("Arrays take exactly one index");
+            uint16_t val = operand(node->getRhs(), element->values[0].get());
+            uint16_t array = operand(element->getName(), element->values[0].get());
+            uint16_t index = expr(element->values[0].get());
+            emit(Op::Store, array, index, val);
+            result = val;
+            return;
+        }
+
+        // An assignment evaluates to its right hand side
+        std::string name = nameOf(node->getName());
+        uint16_t val = expr(node->getRhs());
+        auto var = variables.find(name);
+        uint16_t reg = var != variables.end() ? var->second : (variables[name] = slots.at(name));
+        move(reg, val);
+        result = reg;
+    }
+
+    void BytecodeCompiler::visit(FuncCallAST *node)
+    {
+        std::string name = nameOf(node->getName());
+        auto index = functionIndex.find(name);
+        if (index == functionIndex.end())
+            error("Reference to unknown function");
+        const BytecodeFunction &callee = program.functions[index->second];
+        auto args = node->getArgs();
+        if (callee.params != args.size())
+            error("Expected " + std::to_string(callee.params) + " arguments to function " + name + ", instead got " +
+                  std::to_string(args.size()) + ".");
+
+        // pow from libm is a call to llvm.pow, without the multiplies ^ uses
+        if (!callee.defined && name == "pow" && args.size() == 2) {
+            uint16_t base = operand(args[0].get(), args[1].get());
+            double val;
+            result = libmPower(base, constantValue(args[0].get(), val), args[1].get());
+            return;
+        }
+
+        unsigned mark = top;
+        if (tailCalls.count(node)) {
+            // Every argument is evaluated before any parameter changes.  Parameters passed on unchanged stay put
+            std::vector<uint16_t> vals;
+            for (size_t i = 0; i < args.size(); i++) {
+                bool laterEffects = false;
+                for (size_t j = i + 1; j < args.size(); j++)
+                    laterEffects = laterEffects || sideEffects.check(args[j].get());
+                uint16_t val = expr(args[i].get());
+                if ((isVariable(val) && laterEffects) || (val < callee.params && val != i)) {
+                    uint16_t copy = temp();
+                    emit(Op::Move, copy, val);
+                    val = copy;
+                }
+                vals.push_back(val);
+            }
+            for (size_t i = 0; i < vals.size(); i++)
+                move(i, vals[i]);
+            func->code[emit(Op::Jump)].target = entry;
+            top = mark;
+            result = constant(0.0);
+            return;
+        }
+
+        // Arguments go in consecutive registers, which become the start of the callee's frame
+        uint16_t base = top;
+        for (size_t i = 0; i < args.size(); i++) {
+            top = base + i;
+            uint16_t val = expr(args[i].get());
+            top = base + i;
+            move(temp(), val);
+        }
+        top = base;
+        result = temp();
+        emit(Op::Call, base, index->second, args.size());
+    }
+
+    void BytecodeCompiler::visit(BinaryOpAST *node)
+    {
+        TokenType op = node->getOp();
+        unsigned mark = top;
+
+        // Logical operators as values branch to a 1 or a 0
+        if (op == AND || op == OR) {
+            uint16_t dest = temp();
+            std::vector<size_t> isFalse = branch(node, false);
+            emit(Op::Move, dest, constant(1.0));
+            size_t done = emit(Op::Jump);
+            patch(isFalse);
+            emit(Op::Move, dest, constant(0.0));
+            patch({done});
+            result = dest;
+            return;
+        }
+
+        uint16_t lhs = operand(node->getLhs(), node->getRhs());
+        if (op == HAT) {
+            double val;
+            result = power(lhs, constantValue(node->getLhs(), val), node->getRhs());
+            return;
+        }
+        uint16_t rhs = expr(node->getRhs());
+        top = mark;
+        uint16_t dest = temp();
+
+        int cmp = comparison(op);
+        if (cmp >= 0) {
+            emit(offset(Op::Lt, cmp), dest, lhs, rhs);
+        } else {
+            switch (op) {
+                case PLUS:
+                    emit(Op::Add, dest, lhs, rhs);
+                    break;
+                case MINUS:
+                    emit(Op::Sub, dest, lhs, rhs);
+                    break;
+                case STAR:
+                    emit(Op::Mul, dest, lhs, rhs);
+                    break;
+                case SLASH:
+                    emit(Op::Div, dest, lhs, rhs);
+                    break;
+                case MOD:
+                    emit(Op::Mod, dest, lhs, rhs);
+                    break;
+                default:
+                    error("Invalid binary operator");
+            }
+        }
+        result = dest;
+    }
+
+    void BytecodeCompiler::visit(UnaryOpAST *node)
+    {
+        unsigned mark = top;
+        uint16_t val = expr(node->getOperand());
+        top = mark;
+        uint16_t dest = temp();
+        switch (node->getOp()) {
+            case NOT:
+                emit(Op::Not, dest, val);
+                break;
+            case INC:
+                emit(Op::Add, dest, val, constant(1.0));
+                break;
+            case DEC:
+                emit(Op::Sub, dest, val, constant(1.0));
+                break;
+            case MINUS:
+                // 0 - x like code generation, so -(0.0) is 0.0
+                emit(Op::Sub, dest, constant(0.0), val);
+                break;
+            default:
+                error("Invalid unary operator");
+        }
+        result = dest;
+    }
+
+    void BytecodeCompiler::visit(TernaryOpAST *node)
+    {
+        uint16_t dest = discard ? 0 : temp();
+        std::vector<size_t> isFalse = branch(node->getCond(), false);
+        arm(node->getThen(), dest);
+        size_t done = emit(Op::Jump);
+        patch(isFalse);
+        arm(node->getElse(), dest);
+        patch({done});
+        result = discard ? constant(0.0) : dest;
+    }
+
+    void BytecodeCompiler::visit(IfAST *node)
+    {
+        // Without an ELSE the IF is 0.0 when the condition is false
+        uint16_t dest = discard ? 0 : temp();
+        std::vector<size_t> isFalse = branch(node->getCond(), false);
+        arm(node->getThen(), dest);
+        if (node->getElse() || !discard) {
+            size_t done = emit(Op::Jump);
+            patch(isFalse);
+            if (node->getElse())
+                arm(node->getElse(), dest);
+            else
+                emit(Op::Move, dest, constant(0.0));
+            patch({done});
+        } else {
+            patch(isFalse);
+        }
+        result = discard ? constant(0.0) : dest;
+    }
+
+    void BytecodeCompiler::visit(ForAST *node)
+    {
+        // The loop variable shadows a variable with the same name, so it gets its own register while the loop runs
+        unsigned mark = top;
+        std::string name = node->getVarName();
+        uint16_t start = expr(node->getStart());
+        top = mark;
+        auto outer = variables.find(name);
+        bool shadows = outer != variables.end();
+        uint16_t outerReg = shadows ? outer->second : 0;
+        uint16_t var = shadows ? temp() : slots.at(name);
+        move(var, start);
+        if (shadows)
+            loopVariables.insert(var);
+
+        // A counted loop works out its bound and step once, and ends with a single add, compare and branch
+        CountedLoop counted;
+        bool isCounted = CountedLoop::match(node, counted);
+        uint16_t step = constant(1.0), bound = 0;
+        if (isCounted) {
+            if (node->getStep())
+                step = expr(node->getStep());
+            bound = expr(counted.bound);
+        }
+
+        variables[name] = var;
+        size_t body = func->code.size();
+        label = body;
+        unsigned bodyTop = top;
+        expr(node->getBody(), true);
+        top = bodyTop;
+
+        if (isCounted) {
+            func->code[emit(offset(Op::ForLt, comparison(counted.varOp())), var, step, bound)].target = body;
+        } else {
+            // The step and condition are evaluated every time round, after the body
+            if (node->getStep())
+                step = expr(node->getStep());
+            emit(Op::Add, var, var, step);
+            top = bodyTop;
+            for (size_t jump : branch(node->getEnd(), true))
+                func->code[jump].target = body;
+        }
+
+        if (shadows) {
+            variables[name] = outerReg;
+            loopVariables.erase(var);
+        } else {
+            variables.erase(name);
+        }
+        top = mark;
+        // FOR always evaluates to 0.0
+        result = constant(0.0);
+    }
+
+    void BytecodeCompiler::visit(FuncDefAST *node)
+    {
+        std::string name = nameOf(node->getName());
+        auto args = node->getArgs();
+        auto known = functionIndex.find(name);
+        unsigned index;
+        if (known != functionIndex.end()) {
+            index = known->second;
+            if (node->isExt())
+                return;
+            if (program.functions[index].defined)
+                error("Definition of function " + name + " already exists.");
+        } else {
+            index = program.functions.size();
+            functionIndex[name] = index;
+            program.functions.emplace_back();
+            program.functions[index].name = name;
+        }
+        program.functions[index].params = args.size();
+        if (node->isExt())
+            return;
+
+        if (node->isMemo()) {
+            const FunctionEffects *result = effects.lookup(name);
+            if (!result || result->memory != FunctionEffects::Pure)
+                error("MEMO function " + name + " has side effects, so its results can't be cached.");
+        }
+
+        func = &program.functions[index];
+        func->defined = true;
+        func->memo = node->isMemo();
+        func->code.clear();
+
+        // Parameters, then a register for every number the function uses, plus the 0 and 1 used for IF without
+        // ELSE, FOR and ++
+        variables.clear();
+        slots.clear();
+        loopVariables.clear();
+        constants.clear();
+        func->constants.clear();
+        for (size_t i = 0; i < args.size(); i++)
+            variables[nameOf(args[i].get())] = i;
+        constantBase = args.size();
+        NumberCollector numbers;
+        numbers.numbers = {0.0, 1.0};
+        numbers.collect(node->getBod());
+        for (double val : numbers.numbers) {
+            if (constants.count(bitsOf(val)))
+                continue;
+            constants[bitsOf(val)] = constantBase + func->constants.size();
+            func->constants.push_back(val);
+        }
+
+        // Then a register for each variable
+        variableBase = constantBase + func->constants.size();
+        VariableCollector assigned;
+        assigned.collect(node->getBod());
+        top = variableBase;
+        for (const auto &var : assigned.assigned) {
+            if (!variables.count(var))
+                slots[var] = top++;
+        }
+        memoKeys = top;
+        if (func->memo)
+            top += args.size();
+        firstTemp = top;
+        func->frameSize = top;
+        if (top >= UINT16_MAX)
+            error("Function " + name + " needs too many registers.");
+
+        // Self calls in tail position jump back to the start, after the memo lookup
+        tailCalls = recursionFinder.find(node, false).tail;
+        label = 0;
+        if (func->memo)
+            emit(Op::MemoGet, memoKeys);
+        entry = func->code.size();
+        label = entry;
+
+        uint16_t val = expr(node->getBod());
+        if (func->memo)
+            emit(Op::MemoPut, val, memoKeys);
+        emit(Op::Return, val);
+        func = nullptr;
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,143 @@
+#pragma once
+#ifndef COMPILER_BYTECODE_H
+#define COMPILER_BYTECODE_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "AST.h"
+#include "analysis.h"
+
+namespace Compiler {
+
+    // Every instruction the VM runs.  Comparisons are unordered like the generated code, so they are true for NaN.
+    // Jump<cmp> branches when the comparison is true and JumpNot<cmp> when it is false.  For<cmp> is the end of a
+    // counted loop: it adds the step to the variable and branches back to the body while the comparison holds.
+    // Load is a = b[c] and Store is a[b] = c, where a and b hold arrays
+    #define BYTECODE_OPS(X) \
+        X(Move) \
+        X(Add) X(Sub) X(Mul) X(Div) X(Mod) X(Pow) X(PowHalf) \
+        X(Lt) X(Gt) X(Eq) X(Ne) X(Ge) X(Le) \
+        X(Not) X(Bool) \
+        X(Jump) X(JumpIf) X(JumpIfNot) \
+        X(JumpLt) X(JumpGt) X(JumpEq) X(JumpNe) X(JumpGe) X(JumpLe) \
+        X(JumpNotLt) X(JumpNotGt) X(JumpNotEq) X(JumpNotNe) X(JumpNotGe) X(JumpNotLe) \
+        X(ForLt) X(ForGt) X(ForEq) X(ForNe) X(ForGe) X(ForLe) \
+        X(Load) X(Store) \
+        X(Call) X(CallExt) X(Return) \
+        X(MemoGet) X(MemoPut)
+
+    enum class Op : uint8_t {
+    #define BYTECODE_ENUM(name) name,
+        BYTECODE_OPS(BYTECODE_ENUM)
+    #undef BYTECODE_ENUM
+    };
+
+    // Operands a, b and c are registers unless the op says otherwise.  Results go in a
+    struct Instruction {
+        Op op;
+        uint16_t a = 0, b = 0, c = 0;
+        // Index of the instruction a jump goes to
+        int32_t target = 0;
+    };
+
+    // A compiled function.  Its frame starts with the parameters, then the constants, which are copied in on every
+    // call so every operand is a register, then variables and temporaries
+    struct BytecodeFunction {
+        std::string name;
+        unsigned params = 0;
+        std::vector<double> constants;
+        unsigned frameSize = 0;
+        std::vector<Instruction> code;
+        // Whether the function has a body.  Otherwise it is an EXT function, bound when the VM loads the program
+        bool defined = false;
+        bool memo = false;
+    };
+
+    struct BytecodeProgram {
+        std::vector<BytecodeFunction> functions;
+        // Index of main
+        int main = -1;
+    };
+
+    // Compiles a program into register bytecode for the VM.  Variables live in fixed registers and expressions are
+    // evaluated into temporaries above them, so most operations are a single instruction.  Comparisons feeding a
+    // branch and the end of counted loops become single compare-and-branch instructions.  The program behaves
+    // exactly like the generated code: && || and ?: only skip work that has no side effects, and small constant
+    // powers are the same chain of multiplies
+    class BytecodeCompiler : public Visitor {
+    public:
+        BytecodeProgram compile(BlockAST *program);
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override;
+        void visit(NameAST* node) override;
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override;
+        void visit(UnaryOpAST* node) override;
+        void visit(TernaryOpAST* node) override;
+        void visit(IfAST* node) override;
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override;
+
+    private:
+        BytecodeProgram program;
+        std::map<std::string, unsigned> functionIndex;
+        // Only used to check MEMO functions are pure
+        EffectAnalysis effects;
+        SideEffectChecker sideEffects;
+        RecursionFinder recursionFinder;
+
+        // Function being compiled, and where its registers are.  Parameters come first, then constants, then
+        // variables, then temporaries
+        BytecodeFunction *func = nullptr;
+        uint16_t constantBase = 0, variableBase = 0, firstTemp = 0;
+        // Registers of the variables in scope, and the register every variable assigned in the function gets
+        std::map<std::string, uint16_t> variables, slots;
+        // Registers of FOR variables which shadow another variable.  They are allocated like temporaries
+        std::set<uint16_t> loopVariables;
+        // Constant registers, by the bits of the value
+        std::map<uint64_t, uint16_t> constants;
+        // Self calls in tail position, which jump back to entry instead
+        std::set<FuncCallAST *> tailCalls;
+        size_t entry = 0;
+        // For MEMO functions, the registers the arguments are kept in while the body runs
+        uint16_t memoKeys = 0;
+        // Next free temporary
+        unsigned top = 0;
+        // Register holding the value of the last expression
+        uint16_t result = 0;
+        // Whether the value of the expression being compiled is thrown away
+        bool discard = false;
+        // Instructions before this can't be changed, because something jumps past them
+        size_t label = 0;
+
+        [[noreturn]] void error(const std::string &message);
+        std::string nameOf(AST *node);
+        uint16_t temp();
+        uint16_t constant(double val);
+        bool isVariable(uint16_t reg) const;
+        // Compile an expression and return the register holding its value
+        uint16_t expr(AST *node, bool discardValue = false);
+        // Compile an operand which something evaluated after it could change, copying it if it is a variable
+        uint16_t operand(AST *node, AST *later);
+        // Copy a value into a register.  The instruction that worked it out writes there directly when it can
+        void move(uint16_t reg, uint16_t val);
+        size_t emit(Op op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0);
+        // Point jumps at the next instruction
+        void patch(const std::vector<size_t> &jumps);
+        // Compile a condition as jumps taken when it is true, or when it is false
+        std::vector<size_t> branch(AST *cond, bool when);
+        // Compile an arm of an IF or ?: into its result register
+        void arm(AST *node, uint16_t dest);
+        uint16_t power(uint16_t base, bool constBase, AST *exponent);
+        // Generate a call to llvm.pow the way LLVM rewrites it
+        uint16_t libmPower(uint16_t base, bool constBase, AST *exponent);
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_BYTECODE_H
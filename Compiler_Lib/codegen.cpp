@@ -2,27 +2,46 @@
 #include "AST.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/TypeBasedAliasAnalysis.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/ThinLTOBitcodeWriter.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Transforms/Vectorize.h"
+#include "objcache.h"
 #include <map>
 
 namespace Compiler {
@@ -39,9 +58,9 @@ namespace Compiler {
     void Codegen::visit(BlockAST *node)
     {
         // Recursively generate code for children
-        // Append BasicBlocks to function blocklist.  The blocks MUST end with a branch to the next block
+        // Statements are emitted straight into the current insertion block.  Only control flow creates new blocks, and
+        // it always leaves the builder in the block where execution continues, so the next statement carries on there.
         // REMEMBER: ALL BASIC BLOCKS MUST BE TERMINATED WITH A RETURN OR BRANCH! The LLVM verifier will fail otherwise
-        // Also, create the blocks you think you'll need early on!
 
         // Get the function we are inserting into
         BasicBlock *currentBlock = builder.GetInsertBlock();
@@ -50,6 +69,17 @@ namespace Compiler {
         // The structure of the program (just function definitions at the top level) should be verified at some point,
         // //probably earlier on.
         if (!currentBlock) {
+            addKnownExternals();
+            escapes.analyse(node);
+            effects.analyse(node, {}, &escapes);
+            // Memo tables are state kept between calls, so cached functions and their callers aren't pure any more
+            memoFunctions = chooseMemoFunctions(node);
+            if (!memoFunctions.empty())
+                effects.analyse(node, memoFunctions, &escapes);
+            EvalBudget budget;
+            budget.steps = options.constEvalSteps;
+            budget.functionSteps = 4 * options.constEvalSteps;
+            evaluator.addProgram(node, options.vecLib == TargetLibraryInfoImpl::NoLibrary, budget);
             for (const auto &child : node->getChildren()) {
                 if(child->getType() != ASTType::FUNCDEF) {
                     logErrorV("Expected function definitions at the top level");
@@ -59,22 +89,11 @@ namespace Compiler {
             return;
         }
 
-        // If there is a parent, we gt to this point and assume we are in a function
-        Function *parentFunc = currentBlock->getParent();
+        // A REGION block frees the arrays made in it once its value is worked out
+        Value *mark = node->isRegion() && hasRegion(node) ? enterRegion() : nullptr;
 
-        // Generate code recursively
+        // Generate code recursively.  The block evaluates to its last statement
         for (const auto &child : node->getChildren()) {
-            BasicBlock *lastBlock = &parentFunc->back();
-            // Create block at the end of the parent
-            BasicBlock *nextBlock = BasicBlock::Create(context, "block", parentFunc);
-            // Create branch to nextBlock from lastBlock
-            builder.SetInsertPoint(lastBlock);
-            builder.CreateBr(nextBlock);
-            // Move builder to nextBlock - GetInsertBlock for recursive generation of blocks that might change their
-            // parents?
-            builder.SetInsertPoint(nextBlock);
-
-            // emit code for child
             child->accept(this);
             Value * line = retVal;
             if (!line) {
@@ -83,7 +102,8 @@ namespace Compiler {
                 return;
             }
         }
-        // Create some sort of exit branch?
+        if (mark)
+            leaveRegion(mark);
     }
 
     void Codegen::visit(NumberAST *node)
@@ -97,49 +117,77 @@ namespace Compiler {
     void Codegen::visit(NameAST *node)
     {
         // Look variable up
-        Value *val = namedValues[node->toString()];
+        AllocaInst *val = namedValues[node->toString()];
         if (!val){
             std::string errStr = "Unknown variable name '" + node->toString() + "'";
             logErrorV(errStr.c_str());
         }
-        // Load the value from memory
-        retVal = builder.CreateLoad(val, node->toString());
+        // Load the value from memory.  Variables that only hold whole numbers are i64
+        retVal = builder.CreateLoad(val->getAllocatedType(), val, node->toString());
     }
 
     void Codegen::visit(ArrayAST *node)
     {
-
+        Value *element = arrayElement(node);
+        retVal = arrayAccess(builder.CreateLoad(Type::getDoubleTy(context), element, "elem"), false);
     }
 
     void Codegen::visit(AssignmentAST *node)
     {
+        // Arrays that never leave the function go in its stack frame instead of calling array, or in a region
+        bool made = false;
+        if (localArrays && node->getName()->getType() == ASTType::NAME) {
+            std::string name = static_cast<NameAST *>(node->getName())->toString();
+            auto local = localArrays->find(name);
+            if (local != localArrays->end()) {
+                retVal = stackArray(local->first, local->second);
+                made = true;
+            } else if (regionArrays->count(name)) {
+                static_cast<FuncCallAST *>(node->getRhs())->getArgs()[0]->accept(this);
+                FunctionCallee regionArray = module->getOrInsertFunction(
+                        "simple_region_array", Type::getDoubleTy(context), Type::getDoubleTy(context));
+                if (auto *regionFunc = dyn_cast<Function>(regionArray.getCallee()))
+                    regionFunc->setDoesNotThrow();
+                retVal = builder.CreateCall(regionArray, {toDouble(retVal)}, "array");
+                made = true;
+            }
+        }
         // Generate Value* for RHS
-        node->getRhs()->accept(this);
-        Value *val = retVal;
-        if (!val) {
+        if (!made)
+            node->getRhs()->accept(this);
+        if (!retVal) {
             logErrorV("There must be an expression on RHS.");
             retVal = nullptr;
             return;
         }
+        Value *val = retVal;
+
+        // a[i] = x stores to the element, after the value has been worked out
+        if (node->getName()->getType() == ASTType::ARRAY) {
+            Value *element = arrayElement(static_cast<ArrayAST *>(node->getName()));
+            val = toDouble(val);
+            arrayAccess(builder.CreateStore(val, element), false);
+            retVal = val;
+            return;
+        }
 
         // Look up name
         node->getName()->accept(&nameGetter);
         std::string name = nameGetter.getLastName();
-        Value *var = namedValues[name];
+        AllocaInst *var = namedValues[name];
         // If var cannot be found, define.  If it can, redefine.
         if (!var) {
             // Add new variables to values table
             // Get parent function/scope
             Function *parentFunc = builder.GetInsertBlock()->getParent();
-            // Create alloca for variable
-            AllocaInst *alloca = CreateEntryBlockAlloca(parentFunc, name);
-            // Store and place in name table
-            builder.CreateStore(val, alloca);
-            namedValues[name] = alloca;
-        } else {
-            // store in memory
-            builder.CreateStore(val, var);
+            // Create alloca for variable.  It is an i64 if every value stored in it is a whole number
+            Type *type = typeInfo.isIntVar(node) ? Type::getInt64Ty(context) : Type::getDoubleTy(context);
+            var = CreateEntryBlockAlloca(parentFunc, name, type);
+            namedValues[name] = var;
         }
+        // store in memory
+        val = var->getAllocatedType()->isIntegerTy() ? toInt(val) : toDouble(val);
+        builder.CreateStore(val, var);
         // allocation expression evaluates to the RHS value
         retVal = val;
     }
@@ -163,20 +211,69 @@ namespace Compiler {
             logErrorV(err.c_str());
         }
 
+        // The length of an array is a field of its header, or a constant for arrays on the stack
+        if (inlineLen && name == "len" && args.size() == 1) {
+            retVal = arrayParts(args[0].get()).length;
+            return;
+        }
+
         // Recursively generate code for each argument
         std::vector<Value *> argValues;
         for(unsigned i = 0, e = args.size(); i != e; ++i) {
             args[i]->accept(this);
-            argValues.push_back(retVal);
+            argValues.push_back(toDouble(retVal));
+        }
+
+        // Calls to pure functions with constant arguments are run now, and give a constant
+        if (evaluatesCalls() && !mathBuiltins.count(name)) {
+            std::vector<double> constArgs;
+            for (Value *arg : argValues) {
+                if (auto *constArg = dyn_cast<ConstantFP>(arg))
+                    constArgs.push_back(constArg->getValueAPF().convertToDouble());
+            }
+            double result;
+            if (constArgs.size() == argValues.size() && evaluator.evaluate(name, constArgs, result)) {
+                retVal = ConstantFP::get(context, APFloat(result));
+                return;
+            }
+        }
+
+        // Calls in tail position to the function being generated jump back to its start instead
+        if (recursion.tail.count(node)) {
+            retVal = tailCall(argValues);
+            return;
+        }
+
+        // Math functions from libm become intrinsics
+        auto builtin = mathBuiltins.find(name);
+        if (builtin != mathBuiltins.end()) {
+            Function *intrinsic = Intrinsic::getDeclaration(module.get(), builtin->second, {Type::getDoubleTy(context)});
+            retVal = builder.CreateCall(intrinsic, argValues, "calltmp");
+            return;
         }
 
-        Value *val = builder.CreateCall(calleeFunc, argValues, "calltmp");
+        CallInst *val = builder.CreateCall(calleeFunc, argValues, "calltmp");
+        // Calling conventions have to match or the call is undefined
+        val->setCallingConv(calleeFunc->getCallingConv());
         retVal = val;
 
     }
 
     void Codegen::visit(BinaryOpAST *node)
     {
+        // Logical operators may not evaluate their rhs at all
+        if (node->getOp() == AND || node->getOp() == OR) {
+            retVal = logicalOp(node);
+            return;
+        }
+
+        // + or * of a tail call and something else keeps a running sum or product, then jumps back to the start
+        auto accumulated = recursion.accumulated.find(node);
+        if (accumulated != recursion.accumulated.end()) {
+            retVal = accumulateTailCall(node, accumulated->second);
+            return;
+        }
+
         // Get lhs and rhs
         node->getLhs()->accept(this);
         Value *lhs = retVal;
@@ -186,79 +283,107 @@ namespace Compiler {
         if (!lhs || !rhs)
             logErrorV("Missing an operand for binary operator");
 
-        Value *val;
+        retVal = binaryOp(node, lhs, rhs);
+    }
+
+    Value *Codegen::accumulateTailCall(BinaryOpAST *node, FuncCallAST *call)
+    {
+        // Keep the original evaluation order.  The operand is only moved after the arguments when it has no side effects
+        AST *operandTree = call == node->getLhs() ? node->getRhs() : node->getLhs();
+        Value *operand = nullptr;
+        if (operandTree == node->getLhs()) {
+            operandTree->accept(this);
+            operand = toDouble(retVal);
+        }
+        std::vector<Value *> args;
+        for (const auto &arg : call->getArgs()) {
+            arg->accept(this);
+            args.push_back(toDouble(retVal));
+        }
+        if (!operand) {
+            operandTree->accept(this);
+            operand = toDouble(retVal);
+        }
+        return tailCall(args, node->getOp(), operand);
+    }
+
+    Value *Codegen::tailCall(const std::vector<Value *> &args, TokenType op, Value *operand)
+    {
+        // The result is accMul * (operand op f(args)) + accAdd, which is the same as f(args) with the operand folded
+        // into the accumulators
+        Type *doubleTy = Type::getDoubleTy(context);
+        if (operand) {
+            Value *mul = builder.CreateLoad(doubleTy, accMul, "accmul");
+            if (op == PLUS) {
+                Value *add = builder.CreateLoad(doubleTy, accAdd, "accadd");
+                builder.CreateStore(builder.CreateFAdd(add, builder.CreateFMul(mul, operand)), accAdd);
+            } else {
+                builder.CreateStore(builder.CreateFMul(mul, operand), accMul);
+            }
+        }
+
+        // Every argument is evaluated before any parameter changes
+        for (size_t i = 0; i < args.size(); i++)
+            builder.CreateStore(args[i], paramAllocas[i]);
+        builder.CreateBr(tailHeader);
+
+        // Nothing after the jump runs.  Carry on in an unreachable block so an enclosing IF or ?: can still branch to
+        // its merge block, which simplifycfg cleans up
+        Function *func = builder.GetInsertBlock()->getParent();
+        builder.SetInsertPoint(BasicBlock::Create(context, "aftertail", func));
+        return UndefValue::get(doubleTy);
+    }
+
+    void Codegen::warn(const std::string &message)
+    {
+        errs() << "Code generation warning: " << message << "\n";
+    }
+
+    Value *Codegen::binaryOp(BinaryOpAST *node, Value *lhs, Value *rhs)
+    {
+        // Use integer instructions when type inference has shown the operands and result are always exact integers
+        if (Value *val = intBinaryOp(node, lhs, rhs))
+            return val;
+
+        // Otherwise operators work on doubles.  Comparison results stay as i1 until something needs a double
+        lhs = toDouble(lhs);
+        rhs = toDouble(rhs);
 
         switch (node->getOp()) {
             /* ---- Arithmetic ---- */
             case PLUS:
-                val = builder.CreateFAdd(lhs, rhs, "addtmp");
-                retVal = val;
-                break;
+                if (Value *val = fuseMulAdd(lhs, rhs, false))
+                    return val;
+                return builder.CreateFAdd(lhs, rhs, "addtmp");
             case MINUS:
-                val = builder.CreateFSub(lhs, rhs, "subtmp");
-                retVal = val;
-                break;
+                if (Value *val = fuseMulAdd(lhs, rhs, true))
+                    return val;
+                return builder.CreateFSub(lhs, rhs, "subtmp");
             case STAR:
-                val = builder.CreateFMul(lhs, rhs, "multmp");
-                retVal = val;
-                break;
+                return builder.CreateFMul(lhs, rhs, "multmp");
             case SLASH:
-                val = builder.CreateFDiv(lhs, rhs, "divtmp");
-                retVal = val;
-                break;
-            //TODO(James) powers?
+                return builder.CreateFDiv(lhs, rhs, "divtmp");
+            case HAT:
+                return powOp(lhs, rhs);
             case MOD:
-                val = builder.CreateFRem(lhs, rhs, "remtmp");
-                retVal = val;
-                break;
+                return builder.CreateFRem(lhs, rhs, "remtmp");
             /* ---- Comparison ---- */
             case LESS:
                 // Returns 1 bit int
-                lhs = builder.CreateFCmpULT(lhs, rhs, "cmptmp");
-                // Convert integer into unsigned float
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
+                return builder.CreateFCmpULT(lhs, rhs, "cmptmp");
             case GREATER:
-                lhs = builder.CreateFCmpUGT(lhs, rhs, "cmptmp");
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
+                return builder.CreateFCmpUGT(lhs, rhs, "cmptmp");
             case EQ:
-                lhs = builder.CreateFCmpUEQ(lhs, rhs, "cmptmp");
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
+                return builder.CreateFCmpUEQ(lhs, rhs, "cmptmp");
             case NEQ:
-                lhs = builder.CreateFCmpUNE(lhs, rhs, "cmptmp");
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
+                return builder.CreateFCmpUNE(lhs, rhs, "cmptmp");
             case GREQ:
-                lhs = builder.CreateFCmpUGE(lhs, rhs, "cmptmp");
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
+                return builder.CreateFCmpUGE(lhs, rhs, "cmptmp");
             case LEQ:
-                lhs = builder.CreateFCmpULE(lhs, rhs, "cmptmp");
-                val = builder.CreateUIToFP(lhs, Type::getDoubleTy(context));
-                retVal = val;
-                break;
-            /* ---- Logical ---- */
-
-            case AND:
-                // Evaluate LHS and RHS as i1.
-                // create a branch if equal for the i1 results
-                // nah just do it in the language itself
-
-                break;
-
-            
+                return builder.CreateFCmpULE(lhs, rhs, "cmptmp");
             //TODO(James) implement all binary operators
             default:
-                logErrorV("Invalid binary operator");
-                retVal = nullptr;
-                break;
+                return logErrorV("Invalid binary operator");
         }
     }
 
@@ -271,6 +396,31 @@ namespace Compiler {
         if (!operand)
             logErrorV("Missing the operand for the unary operator");
 
+        // Logical not gives an i1 like the comparisons
+        if (node->getOp() == NOT) {
+            retVal = builder.CreateNot(toBool(operand), "nottmp");
+            return;
+        }
+
+        // Integer operand and result
+        if (operand->getType()->isIntegerTy(64) && typeInfo.isInt(node)) {
+            Value *one = ConstantInt::get(Type::getInt64Ty(context), 1);
+            switch (node->getOp()) {
+                case INC:
+                    retVal = builder.CreateNSWAdd(operand, one);
+                    return;
+                case DEC:
+                    retVal = builder.CreateNSWSub(operand, one);
+                    return;
+                case MINUS:
+                    retVal = builder.CreateNSWNeg(operand);
+                    return;
+                default:
+                    break;
+            }
+        }
+        operand = toDouble(operand);
+
         Value *val;
         // One, zero for incrementing and decrementing
         Value *one = ConstantFP::get(context, APFloat(1.0));
@@ -302,7 +452,104 @@ namespace Compiler {
 
     void Codegen::visit(TernaryOpAST *node)
     {
-        // TODO(James) Same as If/else but with single expressions?
+        node->getCond()->accept(this);
+        if (!retVal)
+            logErrorV("No condition");
+        Value *conditionVal = toBool(retVal, "terncond");
+
+        // If neither arm has side effects evaluate both and pick one with a select.  No branches means loops using ?:
+        // stay as a single block that can be vectorised
+        if (!sideEffects.check(node->getThen()) && !sideEffects.check(node->getElse())) {
+            node->getThen()->accept(this);
+            Value *thenVal = retVal;
+            node->getElse()->accept(this);
+            Value *elseVal = retVal;
+            if (!thenVal || !elseVal)
+                logErrorV("Missing an arm of the ternary operator");
+            // Keep i1 if both arms are booleans
+            if (thenVal->getType() != elseVal->getType()) {
+                thenVal = toDouble(thenVal);
+                elseVal = toDouble(elseVal);
+            }
+            retVal = builder.CreateSelect(conditionVal, thenVal, elseVal, "terntmp");
+            return;
+        }
+
+        // Otherwise only one arm can run, same as an IF/ELSE
+        Function *parentFunc = builder.GetInsertBlock()->getParent();
+        BasicBlock *thenBlock = BasicBlock::Create(context, "ternthen", parentFunc);
+        BasicBlock *elseBlock = BasicBlock::Create(context, "ternelse");
+        BasicBlock *mergeBlock = BasicBlock::Create(context, "terncont");
+        builder.CreateCondBr(conditionVal, thenBlock, elseBlock);
+
+        builder.SetInsertPoint(thenBlock);
+        node->getThen()->accept(this);
+        if (!retVal)
+            logErrorV("Missing an arm of the ternary operator");
+        Value *thenVal = toDouble(retVal);
+        builder.CreateBr(mergeBlock);
+        thenBlock = builder.GetInsertBlock();
+
+        parentFunc->getBasicBlockList().push_back(elseBlock);
+        builder.SetInsertPoint(elseBlock);
+        node->getElse()->accept(this);
+        if (!retVal)
+            logErrorV("Missing an arm of the ternary operator");
+        Value *elseVal = toDouble(retVal);
+        builder.CreateBr(mergeBlock);
+        elseBlock = builder.GetInsertBlock();
+
+        parentFunc->getBasicBlockList().push_back(mergeBlock);
+        builder.SetInsertPoint(mergeBlock);
+        PHINode *phi = builder.CreatePHI(Type::getDoubleTy(context), 2, "terntmp");
+        phi->addIncoming(thenVal, thenBlock);
+        phi->addIncoming(elseVal, elseBlock);
+        retVal = phi;
+    }
+
+    Value *Codegen::logicalOp(BinaryOpAST *node)
+    {
+        bool isAnd = node->getOp() == AND;
+
+        node->getLhs()->accept(this);
+        if (!retVal)
+            logErrorV("Missing an operand for binary operator");
+        Value *lhs = toBool(retVal, "lhsbool");
+
+        // A side effect free rhs can just be evaluated.  Logical and/or are selects, so the rhs still can't change
+        // the result when the lhs has already decided it
+        if (!sideEffects.check(node->getRhs())) {
+            node->getRhs()->accept(this);
+            if (!retVal)
+                logErrorV("Missing an operand for binary operator");
+            Value *rhs = toBool(retVal, "rhsbool");
+            return isAnd ? builder.CreateLogicalAnd(lhs, rhs, "andtmp") : builder.CreateLogicalOr(lhs, rhs, "ortmp");
+        }
+
+        // Otherwise branch around the rhs when the lhs decides the result.  && is false and || is true in that case
+        BasicBlock *lhsBlock = builder.GetInsertBlock();
+        Function *parentFunc = lhsBlock->getParent();
+        BasicBlock *rhsBlock = BasicBlock::Create(context, isAnd ? "andrhs" : "orrhs", parentFunc);
+        BasicBlock *mergeBlock = BasicBlock::Create(context, isAnd ? "andcont" : "orcont");
+        if (isAnd)
+            builder.CreateCondBr(lhs, rhsBlock, mergeBlock);
+        else
+            builder.CreateCondBr(lhs, mergeBlock, rhsBlock);
+
+        builder.SetInsertPoint(rhsBlock);
+        node->getRhs()->accept(this);
+        if (!retVal)
+            logErrorV("Missing an operand for binary operator");
+        Value *rhs = toBool(retVal, "rhsbool");
+        builder.CreateBr(mergeBlock);
+        rhsBlock = builder.GetInsertBlock();
+
+        parentFunc->getBasicBlockList().push_back(mergeBlock);
+        builder.SetInsertPoint(mergeBlock);
+        PHINode *phi = builder.CreatePHI(Type::getInt1Ty(context), 2, isAnd ? "andtmp" : "ortmp");
+        phi->addIncoming(ConstantInt::getBool(context, !isAnd), lhsBlock);
+        phi->addIncoming(rhs, rhsBlock);
+        return phi;
     }
 
     void Codegen::visit(IfAST *node)
@@ -317,8 +564,8 @@ namespace Compiler {
             return;
         }
 
-        // convert condition to bool.  NE 0.0
-        conditionVal = builder.CreateFCmpONE(conditionVal, ConstantFP::get(context, APFloat(0.0)), "ifcond");
+        // convert condition to bool.  Comparisons are already i1, anything else is NE 0.0
+        conditionVal = toBool(conditionVal, "ifcond");
 
         Function *parentFunc = builder.GetInsertBlock()->getParent();
 
@@ -334,32 +581,33 @@ namespace Compiler {
         builder.SetInsertPoint(thenBlock);
 
         node->getThen()->accept(this);
-        Value *thenVal = retVal;
-        if (!thenVal) {
+        if (!retVal) {
             logErrorV("No then value");
             retVal = nullptr;
             return;
         }
+        // The value of the IF is a double, so convert before leaving the arm
+        Value *thenVal = toDouble(retVal);
         // In LLVM IR all basic blocks must be terminated with a branch/return.  All control flow must be explicit
         builder.CreateBr(mergeBlock);
 
         thenBlock = builder.GetInsertBlock();
 
         // Emit else block
-        // If there is no else block, do not add anything to PHI node
+        // If there is no else block the IF evaluates to 0.0 when the condition is false.  The PHI needs an entry for
+        // every predecessor either way
         auto elseTree = node->getElse();
-        Value *elseVal;
+        Value *elseVal = ConstantFP::get(context, APFloat(0.0));
         parentFunc->getBasicBlockList().push_back(elseBlock);
         builder.SetInsertPoint(elseBlock);
         if (elseTree) {
             elseTree->accept(this);
-            elseVal = retVal;
-            if (!elseVal) {
+            if (!retVal) {
                 logErrorV("No then value");
                 retVal = nullptr;
                 return;
             }
-
+            elseVal = toDouble(retVal);
         }
         builder.CreateBr(mergeBlock);
         elseBlock = builder.GetInsertBlock();
@@ -370,8 +618,7 @@ namespace Compiler {
         PHINode *phi = builder.CreatePHI(Type::getDoubleTy(context), 2, "iftmp");
 
         phi->addIncoming(thenVal, thenBlock);
-        if (elseTree)
-            phi->addIncoming(elseVal, elseBlock);
+        phi->addIncoming(elseVal, elseBlock);
         //return phi as value computed by expression
         retVal = phi;
 
@@ -391,83 +638,440 @@ namespace Compiler {
         // Set up basic blocks for loop
         Function *parentFunc = builder.GetInsertBlock()->getParent();
 
-        // Create alloca for variable in entry block
-        AllocaInst *alloca = CreateEntryBlockAlloca(parentFunc, node->getVarName());
+        // Create alloca for variable in entry block.  Counters that are always whole numbers are i64
+        bool intVar = typeInfo.isIntVar(node);
+        AllocaInst *alloca = CreateEntryBlockAlloca(parentFunc, node->getVarName(),
+                                                    intVar ? Type::getInt64Ty(context) : Type::getDoubleTy(context));
 
         // Store start value in alloca
-        builder.CreateStore(startVal, alloca);
+        builder.CreateStore(intVar ? toInt(startVal) : toDouble(startVal), alloca);
+
+        // Emit step value.  If not specified, use 1.0
+        auto genStep = [&]() -> Value * {
+            if (!node->getStep())
+                return ConstantFP::get(context, APFloat(1.0));
+            node->getStep()->accept(this);
+            if (!retVal)
+                logErrorV("Expected a step value");
+            return retVal;
+        };
+
+        // A counted loop compares the variable with a bound that doesn't change, so the bound and step are evaluated
+        // once here instead of every time round.  The body always runs once, so the loop is already in the rotated
+        // form with the test at the bottom and needs no guard
+        CountedLoop counted;
+        std::set<std::string> pureCalls;
+        if (inlineLen)
+            pureCalls.insert("len");
+        bool isCounted = CountedLoop::match(node, counted, pureCalls);
+        Value *stepVal = nullptr, *boundVal = nullptr;
+        if (isCounted) {
+            stepVal = genStep();
+            counted.bound->accept(this);
+            boundVal = retVal;
+            if (!boundVal)
+                logErrorV("Expected an end condition");
+        }
 
-        //BasicBlock *preheaderBlock = builder.GetInsertBlock();
-        BasicBlock *loopBlock = BasicBlock::Create(context, "loop", parentFunc);
+        // The loop itself, leaving the builder after it
+        auto emitLoop = [&]() {
+            BasicBlock *loopBlock = BasicBlock::Create(context, "loop", parentFunc);
+
+            // finish with explicit fall through to loop block
+            builder.CreateBr(loopBlock);
+
+            // Begin insertion into loop block
+            builder.SetInsertPoint(loopBlock);
+
+            // Emit code for loop body
+            AllocaInst *oldLoopVarVal = namedValues[node->getVarName()];
+            namedValues[node->getVarName()] = alloca;
+
+            // Emit code for loop body
+            node->getBody()->accept(this);
+            if (!retVal)
+                logErrorV("No loop body generated");
+
+            Value *loopStep = isCounted ? stepVal : genStep();
+            // Reload increment and restore alloca. handles case where loop body modifies the variable
+            Value *curVar = builder.CreateLoad(alloca->getAllocatedType(), alloca, node->getVarName());
+            Value *nextVar = intVar ? builder.CreateNSWAdd(curVar, toInt(loopStep), "nextvar")
+                                    : builder.CreateFAdd(curVar, toDouble(loopStep), "nextvar");
+            builder.CreateStore(nextVar, alloca);
+
+            // End condition.  A counted loop compares the new value with the bound directly
+            Value *endCondition;
+            if (isCounted) {
+                endCondition = counted.varOnLeft ? binaryOp(counted.cond, nextVar, boundVal)
+                                                 : binaryOp(counted.cond, boundVal, nextVar);
+            } else {
+                node->getEnd()->accept(this);
+                endCondition = retVal;
+            }
+            if (!endCondition)
+                logErrorV("Expected an end condition");
+
+            // Convert condition to bool
+            endCondition = toBool(endCondition, "loopcond");
+
+            // Create post loop block and insert
+            BasicBlock *afterBlock = BasicBlock::Create(context, "afterloop", parentFunc);
+
+            // Insert conditional into end of block
+            addLoopHints(builder.CreateCondBr(endCondition, loopBlock, afterBlock), node);
+
+            // Insert any new code in the post loop block
+            builder.SetInsertPoint(afterBlock);
+
+            // Restore unshadowed variable
+            if (oldLoopVarVal)
+                namedValues[node->getVarName()] = oldLoopVarVal;
+            else
+                namedValues.erase(node->getVarName());
+        };
+
+        // A counted loop going up to a bound can check every a[i] in its body once, before it starts: the first
+        // value, and the bound, which the later ones stay below.  The loop is generated twice, without checks for
+        // when that passes, and with them for when it doesn't, where the program stops at the bad index as usual
+        std::set<std::string> indexed;
+        if (isCounted && intVar && (counted.varOp() == LESS || counted.varOp() == LEQ))
+            indexed = LoopIndexFinder::find(node);
+        if (indexed.empty()) {
+            emitLoop();
+        } else {
+            Value *first = toInt(startVal), *step = toInt(stepVal);
+            Value *inBounds = builder.CreateAnd(builder.CreateICmpSGE(first, builder.getInt64(0)),
+                                                builder.CreateICmpSGT(step, builder.getInt64(0)), "checkable");
+            for (const auto &name : indexed) {
+                NameAST array(name);
+                Value *length = arrayParts(&array).length;
+                // i < bound needs bound <= length, and i <= bound needs bound < length
+                Value *boundInside;
+                if (boundVal->getType()->isIntegerTy(64))
+                    boundInside = counted.varOp() == LESS ? builder.CreateICmpSLE(boundVal, length)
+                                                          : builder.CreateICmpSLT(boundVal, length);
+                else
+                    boundInside = counted.varOp() == LESS
+                                  ? builder.CreateFCmpOLE(toDouble(boundVal), toDouble(length))
+                                  : builder.CreateFCmpOLT(toDouble(boundVal), toDouble(length));
+                inBounds = builder.CreateAnd(inBounds, builder.CreateICmpSLT(first, length), "checkable");
+                inBounds = builder.CreateAnd(inBounds, boundInside, "checkable");
+            }
+            BasicBlock *uncheckedBlock = BasicBlock::Create(context, "unchecked", parentFunc);
+            BasicBlock *checkedBlock = BasicBlock::Create(context, "checked", parentFunc);
+            BasicBlock *doneBlock = BasicBlock::Create(context, "loopdone", parentFunc);
+            builder.CreateCondBr(inBounds, uncheckedBlock, checkedBlock,
+                                 MDBuilder(context).createBranchWeights(1 << 20, 1));
+
+            builder.SetInsertPoint(uncheckedBlock);
+            std::string oldVar = uncheckedVar;
+            std::set<std::string> oldArrays = uncheckedArrays;
+            uncheckedVar = node->getVarName();
+            uncheckedArrays = indexed;
+            emitLoop();
+            uncheckedVar = oldVar;
+            uncheckedArrays = oldArrays;
+            builder.CreateBr(doneBlock);
+
+            builder.SetInsertPoint(checkedBlock);
+            emitLoop();
+            builder.CreateBr(doneBlock);
+            builder.SetInsertPoint(doneBlock);
+        }
 
-        // finish with explicit fall through to loop block
-        builder.CreateBr(loopBlock);
+        // For should always return 0.0
+        retVal = Constant::getNullValue(Type::getDoubleTy(context));
+    }
 
-        // Begin insertion into loop block
-        builder.SetInsertPoint(loopBlock);
+    void Codegen::addLoopHints(BranchInst *latch, ForAST *node)
+    {
+        auto hint = [&](const char *name, unsigned val) -> Metadata * {
+            return MDNode::get(context, {MDString::get(context, name),
+                                         ConstantAsMetadata::get(builder.getInt32(val))});
+        };
+
+        // The first operand of loop metadata refers to itself, which keeps it distinct from other loops
+        SmallVector<Metadata *, 4> ops = {nullptr};
+        if (node->getUnroll() == 1)
+            ops.push_back(MDNode::get(context, MDString::get(context, "llvm.loop.unroll.disable")));
+        else if (node->getUnroll())
+            ops.push_back(hint("llvm.loop.unroll.count", node->getUnroll()));
+        if (node->getVectorize()) {
+            ops.push_back(hint("llvm.loop.vectorize.width", node->getVectorize()));
+            ops.push_back(MDNode::get(context, {MDString::get(context, "llvm.loop.vectorize.enable"),
+                                                ConstantAsMetadata::get(builder.getInt1(node->getVectorize() > 1))}));
+        }
+        if (ops.size() == 1)
+            return;
 
-        // Emit code for loop body
-        AllocaInst *oldLoopVarVal = namedValues[node->getVarName()];
-        namedValues[node->getVarName()] = alloca;
+        MDNode *loopID = MDNode::getDistinct(context, ops);
+        loopID->replaceOperandWith(0, loopID);
+        latch->setMetadata(LLVMContext::MD_loop, loopID);
+    }
 
-        // Emit code for loop body
-        node->getBody()->accept(this);
-        if (!retVal) {
-            logErrorV("No loop body generated");
-            retVal = nullptr;
-            return;
+    // A libm function with an equivalent LLVM intrinsic
+    struct MathBuiltin {
+        const char *name;
+        Intrinsic::ID id;
+        unsigned args;
+        // Whether the libm version can set errno, in which case it is only replaced when errno doesn't matter
+        bool setsErrno;
+    };
+
+    static const MathBuiltin mathBuiltinTable[] = {
+        {"sqrt", Intrinsic::sqrt, 1, true},
+        {"sin", Intrinsic::sin, 1, true},
+        {"cos", Intrinsic::cos, 1, true},
+        {"exp", Intrinsic::exp, 1, true},
+        {"exp2", Intrinsic::exp2, 1, true},
+        {"log", Intrinsic::log, 1, true},
+        {"log2", Intrinsic::log2, 1, true},
+        {"log10", Intrinsic::log10, 1, true},
+        {"pow", Intrinsic::pow, 2, true},
+        {"fma", Intrinsic::fma, 3, true},
+        {"fabs", Intrinsic::fabs, 1, false},
+        {"floor", Intrinsic::floor, 1, false},
+        {"ceil", Intrinsic::ceil, 1, false},
+        {"trunc", Intrinsic::trunc, 1, false},
+        {"round", Intrinsic::round, 1, false},
+        {"rint", Intrinsic::rint, 1, false},
+        {"nearbyint", Intrinsic::nearbyint, 1, false},
+        {"copysign", Intrinsic::copysign, 2, false},
+        {"fmin", Intrinsic::minnum, 2, false},
+        {"fmax", Intrinsic::maxnum, 2, false},
+    };
+
+    // Find the builtin for an EXT declaration, if the name and number of arguments match
+    static const MathBuiltin *lookupMathBuiltin(const std::string &name, size_t args)
+    {
+        for (const auto &builtin : mathBuiltinTable) {
+            if (name == builtin.name && args == builtin.args)
+                return &builtin;
         }
+        return nullptr;
+    }
 
-        // Emit step value
-        Value *stepVal = nullptr;
-        // getStep() removes from AST.  Is this what I wanted to do..?
-        auto step = node->getStep();
-        if (step) {
-            step->accept(this);
-            stepVal = retVal;
-            if (!stepVal) {
-                logErrorV("Expected a step value");
-                retVal = nullptr;
-                return;
-            }
-        } else {
-            // If not specified, use 1.0
-            stepVal = ConstantFP::get(context, APFloat(1.0));
-        }
-        // Reload increment and restore alloca. handles case where loop body modifies the variable
-        Value *curVar = builder.CreateLoad(alloca, node->getVarName());
-        Value *nextVar = builder.CreateFAdd(curVar, stepVal, "nextvar");
-        builder.CreateStore(nextVar, alloca);
-
-        // End condition
-        node->getEnd()->accept(this);
-        Value *endCondition = retVal;
-        if (!endCondition) {
-            logErrorV("Expected an end condition");
-            retVal = nullptr;
+    void Codegen::addKnownExternals()
+    {
+        // Math functions only compute on their arguments, unless they have to set errno
+        for (const auto &builtin : mathBuiltinTable) {
+            FunctionEffects math;
+            if (builtin.setsErrno && options.mathErrno)
+                math.memory = FunctionEffects::Effectful;
+            effects.addExternal(builtin.name, builtin.args, math);
+        }
+        // Printing and reading from the standard library linked in with -l
+        FunctionEffects io;
+        io.memory = FunctionEffects::Effectful;
+        effects.addExternal("printd", 1, io);
+        effects.addExternal("putchard", 1, io);
+        // Opening SIMPLE_INPUT, mapping a file or allocating can fail and exit.  The length of an array never changes,
+        // so len only reads
+        FunctionEffects exits = io;
+        exits.mayNotReturn = true;
+        effects.addExternal("readd", 0, exits);
+        effects.addExternal("eof", 0, exits);
+        effects.addExternal("mapin", 1, exits);
+        effects.addExternal("mapout", 2, exits);
+        effects.addExternal("array", 1, exits);
+        FunctionEffects length;
+        length.memory = FunctionEffects::ReadOnly;
+        effects.addExternal("len", 1, length);
+    }
+
+    void Codegen::addEffectAttributes(Function *func, const std::string &name)
+    {
+        const FunctionEffects *result = effects.lookup(name);
+        if (!result)
             return;
+        if (result->memory == FunctionEffects::Pure)
+            func->setDoesNotAccessMemory();
+        else if (result->memory == FunctionEffects::ReadOnly)
+            func->setOnlyReadsMemory();
+        if (!result->mayUnwind)
+            func->setDoesNotThrow();
+        if (!result->mayNotReturn)
+            func->addFnAttr(Attribute::WillReturn);
+        if (!result->mayRecurse)
+            func->setDoesNotRecurse();
+    }
+
+    bool Codegen::evaluatesCalls() const
+    {
+        // With fast-math or contraction the rounding of the generated code depends on what the optimiser does
+        return options.constEval && !options.fastMath && options.fpContract == CodegenOptions::ContractOff;
+    }
+
+    std::set<std::string> Codegen::chooseMemoFunctions(BlockAST *program)
+    {
+        std::set<std::string> chosen;
+        for (const auto &child : program->getChildren()) {
+            if (child->getType() != ASTType::FUNCDEF)
+                continue;
+            auto def = static_cast<FuncDefAST *>(child.get());
+            if (def->isExt())
+                continue;
+            def->getName()->accept(&nameGetter);
+            std::string name = nameGetter.getLastName();
+            const FunctionEffects *result = effects.lookup(name);
+            bool pure = result && result->memory == FunctionEffects::Pure;
+            if (def->isMemo()) {
+                if (!pure) {
+                    std::string err = "MEMO function " + name + " has side effects, so its results can't be cached.";
+                    logErrorV(err.c_str());
+                }
+                chosen.insert(name);
+            } else if (options.memoize && pure && result->mayRecurse) {
+                // Tail calls already become loops, so only recursion which needs a stack frame is worth caching
+                bool reassociate = options.fastMath || def->isFast();
+                if (!recursionFinder.find(def, reassociate).other.empty())
+                    chosen.insert(name);
+            }
         }
+        return chosen;
+    }
 
-        // Convert condition to bool
-        endCondition = builder.CreateFCmpONE(endCondition, ConstantFP::get(context, APFloat(0.0)), "loopcond");
+    // Element of a memo table
+    static Value *memoElement(IRBuilder<> &builder, GlobalVariable *table, Value *index)
+    {
+        return builder.CreateInBoundsGEP(table->getValueType(), table, {builder.getInt64(0), index});
+    }
 
-        // Create post loop block and insert
-        BasicBlock *afterBlock = BasicBlock::Create(context, "afterloop", parentFunc);
+    // Add one to a memo counter
+    static void memoCount(IRBuilder<> &builder, GlobalVariable *counter)
+    {
+        Value *count = builder.CreateLoad(builder.getInt64Ty(), counter);
+        builder.CreateStore(builder.CreateAdd(count, builder.getInt64(1)), counter);
+    }
 
-        // Insert conditional into end of block
-        builder.CreateCondBr(endCondition, loopBlock, afterBlock);
+    void Codegen::memoLookup(Function *func, const std::string &name)
+    {
+        Type *i64 = builder.getInt64Ty();
+        Type *i8 = builder.getInt8Ty();
+        Type *dbl = builder.getDoubleTy();
+        uint64_t capacity = PowerOf2Ceil(std::max(options.memoSize, 1u));
+        uint64_t arity = func->arg_size();
+
+        // The tables have one slot past the end, which takes results there is no room for when they aren't kept.
+        // Probing never reaches it, and storing doesn't need a branch
+        auto table = [&](const std::string &suffix, Type *type, uint64_t size) {
+            auto *array = ArrayType::get(type, size);
+            return new GlobalVariable(*module, array, false, GlobalValue::InternalLinkage,
+                                      ConstantAggregateZero::get(array), name + ".memo." + suffix);
+        };
+        if (arity)
+            memo.keys = table("keys", i64, (capacity + 1) * arity);
+        memo.values = table("values", dbl, capacity + 1);
+        memo.used = table("used", i8, capacity + 1);
+        if (options.memoStats) {
+            memo.hits = new GlobalVariable(*module, i64, false, GlobalValue::InternalLinkage,
+                                           builder.getInt64(0), name + ".memo.hits");
+            memo.misses = new GlobalVariable(*module, i64, false, GlobalValue::InternalLinkage,
+                                             builder.getInt64(0), name + ".memo.misses");
+        }
 
-        // Insert any new code in the post loop block
-        builder.SetInsertPoint(afterBlock);
+        // Hash the bits of the arguments, so -0.0 and NaNs are told apart and compared like any other value
+        const uint64_t golden = 0x9e3779b97f4a7c15ULL;
+        Value *hash = builder.getInt64(golden);
+        for (auto &arg : func->args()) {
+            Value *bits = builder.CreateBitCast(&arg, i64, "argbits");
+            memo.keyBits.push_back(bits);
+            hash = builder.CreateMul(builder.CreateXor(hash, bits), builder.getInt64(golden));
+        }
+        // Mix the high bits into the low ones, since whole numbers only differ in the top bits of a double
+        hash = builder.CreateXor(hash, builder.CreateLShr(hash, 33));
+        hash = builder.CreateMul(hash, builder.getInt64(0xff51afd7ed558ccdULL));
+        hash = builder.CreateXor(hash, builder.CreateLShr(hash, 33));
+        Value *mask = builder.getInt64(capacity - 1);
+        Value *home = builder.CreateAnd(hash, mask, "home");
+
+        // Linear probing over a few slots from home.  An empty slot means the arguments aren't cached
+        BasicBlock *entry = builder.GetInsertBlock();
+        BasicBlock *probe = BasicBlock::Create(context, "memo.probe", func);
+        BasicBlock *compare = BasicBlock::Create(context, "memo.compare", func);
+        BasicBlock *next = BasicBlock::Create(context, "memo.next", func);
+        BasicBlock *full = BasicBlock::Create(context, "memo.full", func);
+        BasicBlock *hit = BasicBlock::Create(context, "memo.hit", func);
+        BasicBlock *miss = BasicBlock::Create(context, "memo.miss", func);
+        builder.CreateBr(probe);
+
+        builder.SetInsertPoint(probe);
+        PHINode *probes = builder.CreatePHI(i64, 2, "probes");
+        probes->addIncoming(builder.getInt64(0), entry);
+        Value *slot = builder.CreateAnd(builder.CreateAdd(home, probes), mask, "slot");
+        Value *used = builder.CreateLoad(i8, memoElement(builder, memo.used, slot), "used");
+        builder.CreateCondBr(builder.CreateICmpNE(used, builder.getInt8(0)), compare, miss);
+
+        builder.SetInsertPoint(compare);
+        Value *same = builder.getTrue();
+        for (uint64_t i = 0; i < arity; i++) {
+            Value *index = builder.CreateAdd(builder.CreateMul(slot, builder.getInt64(arity)), builder.getInt64(i));
+            Value *key = builder.CreateLoad(i64, memoElement(builder, memo.keys, index), "key");
+            same = builder.CreateAnd(same, builder.CreateICmpEQ(key, memo.keyBits[i]));
+        }
+        builder.CreateCondBr(same, hit, next);
+
+        builder.SetInsertPoint(next);
+        Value *nextProbes = builder.CreateAdd(probes, builder.getInt64(1));
+        probes->addIncoming(nextProbes, next);
+        uint64_t maxProbes = std::min<uint64_t>(capacity, 8);
+        builder.CreateCondBr(builder.CreateICmpULT(nextProbes, builder.getInt64(maxProbes)), probe, full);
+
+        builder.SetInsertPoint(full);
+        builder.CreateBr(miss);
+
+        builder.SetInsertPoint(hit);
+        if (memo.hits)
+            memoCount(builder, memo.hits);
+        builder.CreateRet(builder.CreateLoad(dbl, memoElement(builder, memo.values, slot), "cached"));
+
+        // Every slot probed is taken: either evict the result in the home slot or throw this one away
+        builder.SetInsertPoint(miss);
+        PHINode *target = builder.CreatePHI(i64, 2, "memo.slot");
+        target->addIncoming(slot, probe);
+        target->addIncoming(options.memoEvict == CodegenOptions::EvictReplace ? home : builder.getInt64(capacity),
+                            full);
+        memo.slot = target;
+        if (memo.misses)
+            memoCount(builder, memo.misses);
+    }
 
-        // Restore unshadowed variable
-        if (oldLoopVarVal)
-            namedValues[node->getVarName()] = oldLoopVarVal;
-        else
-            namedValues.erase(node->getVarName());
+    void Codegen::memoStore(Value *result)
+    {
+        // Recursive calls may have used the slot since the lookup, but they only ever write whole entries
+        uint64_t arity = memo.keyBits.size();
+        for (uint64_t i = 0; i < arity; i++) {
+            Value *index = builder.CreateAdd(builder.CreateMul(memo.slot, builder.getInt64(arity)),
+                                             builder.getInt64(i));
+            builder.CreateStore(memo.keyBits[i], memoElement(builder, memo.keys, index));
+        }
+        builder.CreateStore(result, memoElement(builder, memo.values, memo.slot));
+        builder.CreateStore(builder.getInt8(1), memoElement(builder, memo.used, memo.slot));
+    }
 
-        // For should always return 0.0
-        retVal = Constant::getNullValue(Type::getDoubleTy(context));
+    void Codegen::memoReport(const std::string &name)
+    {
+        // Written to stderr so it doesn't mix with the program's output
+        Type *i32 = builder.getInt32Ty();
+        Type *i64 = builder.getInt64Ty();
+        Type *dbl = builder.getDoubleTy();
+        FunctionCallee dprintf = module->getOrInsertFunction(
+                "dprintf", FunctionType::get(i32, {i32, builder.getInt8PtrTy()}, true));
+        Function *report = Function::Create(FunctionType::get(builder.getVoidTy(), false),
+                                            Function::InternalLinkage, name + ".memo.report", module.get());
+        builder.SetInsertPoint(BasicBlock::Create(context, "entry", report));
+
+        Value *hits = builder.CreateLoad(i64, memo.hits, "hits");
+        Value *misses = builder.CreateLoad(i64, memo.misses, "misses");
+        Value *calls = builder.CreateAdd(hits, misses, "calls");
+        calls = builder.CreateSelect(builder.CreateICmpEQ(calls, builder.getInt64(0)), builder.getInt64(1), calls);
+        Value *rate = builder.CreateFDiv(builder.CreateFMul(builder.CreateUIToFP(hits, dbl),
+                                                            ConstantFP::get(dbl, 100.0)),
+                                         builder.CreateUIToFP(calls, dbl), "rate");
+        Value *format = builder.CreateGlobalStringPtr("memo " + name + ": %lu hits, %lu misses, %.1f%% hit rate\n");
+        builder.CreateCall(dprintf, {builder.getInt32(2), format, hits, misses, rate});
+        builder.CreateRetVoid();
+        appendToGlobalDtors(*module, report, 65535);
     }
 
     void Codegen::visit(FuncDefAST *node)
@@ -494,11 +1098,29 @@ namespace Compiler {
             std::string argName = nameGetter.getLastName();
             arg.setName(argName);
         }
+        // Let the optimiser know what calls to it can do
+        addEffectAttributes(func, name);
         // If the function was an external definition, return here.
         if (node->isExt()) {
+            // Calls to standard math functions can be generated as intrinsics
+            const MathBuiltin *builtin = lookupMathBuiltin(name, args.size());
+            if (builtin && (!builtin->setsErrno || !options.mathErrno))
+                mathBuiltins[name] = builtin->id;
+            if (name == "len" && args.size() == 1) {
+                inlineLen = true;
+                // The runtime never makes an array longer than SIMPLE_MAX_LENGTH, 2^52
+                NumRange length = NumRange::constant(0);
+                length.hi = 4503599627370496.0;
+                typeInfo.addKnownCall(name, 1, length);
+            }
             retFunc = func;
             return;
         }
+        mathBuiltins.erase(name);
+        if (name == "len" && args.size() == 1) {
+            inlineLen = false;
+            typeInfo.addKnownCall(name, 1, NumRange::top());
+        }
 
 
         // ---- FUNCTION WITH BODY ----
@@ -510,26 +1132,110 @@ namespace Compiler {
             return;
         }
 
-        if(!thisFunc->empty()) {
+        if(!thisFunc->empty() || fragmentNames.count(name)) {
             std::string err = "Definition of function " + name  + " already exists.";
             logErrorV(err.c_str());
             retFunc = nullptr;
             return;
         }
 
+        // Functions only this program calls get internal linkage and the fast calling convention, so the optimiser
+        // can change their signatures, propagate constants into them and delete them once inlined.  main, EXPORT
+        // functions and functions declared EXT before their definition stay callable from C.  Incremental fragments
+        // call each other across object files, so they all stay external
+        if (thisFunc == func && name != "main" && !node->isExport() && !fragmentCache) {
+            thisFunc->setLinkage(Function::InternalLinkage);
+            thisFunc->setCallingConv(CallingConv::Fast);
+        }
+
+        // Reuse the object for this function from an earlier compilation if nothing it depends on has changed
+        std::string key;
+        if (fragmentCache) {
+            fragmentNames.insert(name);
+            key = fragmentKey(node);
+            auto cached = fragmentCache->lookup(key);
+            if (cached) {
+                fragments.push_back(std::move(cached));
+                retFunc = thisFunc;
+                return;
+            }
+        }
+
+        // Floating point semantics for the body.  The builder puts the flags on every instruction it creates, and the
+        // attributes let the backend make the same assumptions
+        FastMathFlags flags;
+        if (options.fastMath || node->isFast()) {
+            flags.setFast();
+            thisFunc->addFnAttr("unsafe-fp-math", "true");
+            thisFunc->addFnAttr("no-nans-fp-math", "true");
+            thisFunc->addFnAttr("no-infs-fp-math", "true");
+            thisFunc->addFnAttr("no-signed-zeros-fp-math", "true");
+            thisFunc->addFnAttr("approx-func-fp-math", "true");
+        }
+        if (options.fpContract == CodegenOptions::ContractFast)
+            flags.setAllowContract();
+        builder.setFastMathFlags(flags);
+
+        // Find the variables and expressions that can be integers
+        typeInfo.analyse(node, options.fastMath || node->isFast());
+        evaluator.beginFunction();
+        localArrays = &escapes.localArrays(name);
+        regionArrays = &escapes.regionArrays(name);
+        stackArrays.clear();
+
         // Create new basic block
         BasicBlock *base = BasicBlock::Create(context, "entry", thisFunc);
         builder.SetInsertPoint(base);
 
         // Record function args in the named values (new scope)
         namedValues.clear();
+        paramAllocas.clear();
         for (auto &arg : thisFunc->args()){
             // Create alloca for variable
-            AllocaInst *alloca = CreateEntryBlockAlloca(thisFunc, arg.getName());
+            AllocaInst *alloca = CreateEntryBlockAlloca(thisFunc, std::string(arg.getName()));
             // Store initial value in alloca
             builder.CreateStore(&arg, alloca);
             // add arguments to symbol table
-            namedValues[arg.getName()] = alloca;
+            namedValues[std::string(arg.getName())] = alloca;
+            paramAllocas.push_back(alloca);
+        }
+
+        // Cached functions return early when they have seen the arguments before
+        memo = MemoTable();
+        if (memoFunctions.count(name))
+            memoLookup(thisFunc, name);
+
+        // The function's region is left when it returns.  Tail calls jump back in after it is entered, so arrays
+        // passed to them stay alive
+        regionMark = hasRegion(nullptr) ? enterRegion() : nullptr;
+
+        // Self calls that can become jumps back to the start.  Accumulating through + and * reassociates, so it is
+        // only done with fast-math
+        bool reassociate = options.fastMath || node->isFast();
+        recursion = recursionFinder.find(node, reassociate);
+        accAdd = accMul = nullptr;
+        tailHeader = nullptr;
+        if (!recursion.tail.empty() || !recursion.accumulated.empty()) {
+            if (!recursion.accumulated.empty()) {
+                accAdd = CreateEntryBlockAlloca(thisFunc, "accadd");
+                builder.CreateStore(ConstantFP::get(context, APFloat(0.0)), accAdd);
+                accMul = CreateEntryBlockAlloca(thisFunc, "accmul");
+                builder.CreateStore(ConstantFP::get(context, APFloat(1.0)), accMul);
+            }
+            tailHeader = BasicBlock::Create(context, "tailrecurse", thisFunc);
+            builder.CreateBr(tailHeader);
+            builder.SetInsertPoint(tailHeader);
+        }
+        if (options.warnRecursion && !recursion.other.empty()) {
+            auto withReassociation = reassociate ? recursion : recursionFinder.find(node, true);
+            for (auto call : recursion.other) {
+                bool accumulable = false;
+                for (const auto &entry : withReassociation.accumulated)
+                    accumulable = accumulable || entry.second == call;
+                warn("recursive call to " + name + (accumulable ?
+                     " could become a loop in a FAST function, since it is an operand of + or * in tail position" :
+                     " is not in tail position, so each call uses a stack frame"));
+            }
         }
 
         // Finish function
@@ -543,29 +1249,581 @@ namespace Compiler {
             retFunc = nullptr;
         }
 
+        returnVal = toDouble(returnVal);
+        if (accAdd) {
+            Value *mul = builder.CreateLoad(Type::getDoubleTy(context), accMul, "accmul");
+            Value *add = builder.CreateLoad(Type::getDoubleTy(context), accAdd, "accadd");
+            returnVal = builder.CreateFAdd(builder.CreateFMul(mul, returnVal), add, "accret");
+        }
+        if (memo.slot)
+            memoStore(returnVal);
+        if (regionMark)
+            leaveRegion(regionMark);
         builder.CreateRet(returnVal);
 
         // Validate code - Important, LLVM can pick up lots of useful errors here.
         verifyFunction(*thisFunc);
 
-        // Optimise function
-        fpm->run(*thisFunc);
+        if (memo.hits)
+            memoReport(name);
+
+        // Optimisation happens per partition in emitObjCode, or per fragment when compiling incrementally
         //thisFunc->viewCFG();
+        if (fragmentCache)
+            emitFragment(thisFunc, key);
 
         retFunc = thisFunc;
     }
 
-    AllocaInst *Codegen::CreateEntryBlockAlloca(Function *func, const std::string &varName)
+    Value *Codegen::fuseMulAdd(Value *lhs, Value *rhs, bool subtract)
+    {
+        if (options.fpContract != CodegenOptions::ContractOn)
+            return nullptr;
+
+        // Only a multiply that was just made for this expression can be fused.  One with uses is a value that
+        // something else has seen, so it has to stay rounded
+        auto isMul = [](Value *val) {
+            auto *inst = dyn_cast<BinaryOperator>(val);
+            return inst && inst->getOpcode() == Instruction::FMul && inst->use_empty();
+        };
+        auto *mul = cast_or_null<BinaryOperator>(isMul(lhs) ? lhs : isMul(rhs) ? rhs : nullptr);
+        if (!mul)
+            return nullptr;
+
+        // a*b + c, a*b - c = a*b + -c and c - a*b = -a*b + c
+        Value *a = mul->getOperand(0), *b = mul->getOperand(1);
+        Value *c = mul == lhs ? rhs : lhs;
+        if (subtract) {
+            if (mul == lhs)
+                c = builder.CreateFNeg(c, "negtmp");
+            else
+                a = builder.CreateFNeg(a, "negtmp");
+        }
+        mul->eraseFromParent();
+
+        Function *fmuladd = Intrinsic::getDeclaration(module.get(), Intrinsic::fmuladd, {Type::getDoubleTy(context)});
+        return builder.CreateCall(fmuladd, {a, b, c}, "fmatmp");
+    }
+
+    Value *Codegen::powOp(Value *base, Value *exponent)
+    {
+        if (auto *constExp = dyn_cast<ConstantFP>(exponent)) {
+            const APFloat &expVal = constExp->getValueAPF();
+            FastMathFlags flags = builder.getFastMathFlags();
+
+            // Small integer exponents become a chain of multiplies by repeated squaring, and negative ones take the
+            // reciprocal of that.  x^0 is 1 for every x, including NaN, just like pow.  Below -1 the power can
+            // overflow when pow's result doesn't, so those stay as pow unless approximate functions are allowed
+            if (expVal.isInteger() && std::abs(expVal.convertToDouble()) <= maxPowMultiplies &&
+                (expVal.convertToDouble() >= -1 || flags.approxFunc())) {
+                int n = (int)expVal.convertToDouble();
+                Value *one = ConstantFP::get(context, APFloat(1.0));
+                if (n == 0)
+                    return one;
+
+                Value *result = nullptr;
+                Value *square = base;
+                for (unsigned bits = std::abs(n); bits; bits >>= 1) {
+                    if (bits & 1)
+                        result = result ? builder.CreateFMul(result, square, "powtmp") : square;
+                    if (bits > 1)
+                        square = builder.CreateFMul(square, square, "sqtmp");
+                }
+                if (n < 0)
+                    result = builder.CreateFDiv(one, result, "powtmp");
+                return result;
+            }
+
+            // x^0.5 is sqrt(x) except that pow gives +0 for -0 and +inf for -inf.  Only use sqrt if we have been told
+            // those cases don't matter
+            if (expVal.isExactlyValue(0.5) && flags.noSignedZeros() && flags.noInfs()) {
+                Function *sqrtFunc = Intrinsic::getDeclaration(module.get(), Intrinsic::sqrt, {base->getType()});
+                return builder.CreateCall(sqrtFunc, {base}, "sqrttmp");
+            }
+        }
+
+        Function *powFunc = Intrinsic::getDeclaration(module.get(), Intrinsic::pow, {base->getType()});
+        return builder.CreateCall(powFunc, {base, exponent}, "powtmp");
+    }
+
+    Value *Codegen::intBinaryOp(BinaryOpAST *node, Value *lhs, Value *rhs)
+    {
+        // Only worth it if one side is already an integer, and only correct if both sides are always exact integers
+        if (!lhs->getType()->isIntegerTy(64) && !rhs->getType()->isIntegerTy(64))
+            return nullptr;
+        if (!typeInfo.isInt(node->getLhs()) || !typeInfo.isInt(node->getRhs()))
+            return nullptr;
+
+        // Arithmetic results also have to be exact.  Their range is inside +-2^53, so the nsw flags hold
+        bool exact = typeInfo.isInt(node);
+        Value *l = toInt(lhs), *r = toInt(rhs);
+        switch (node->getOp()) {
+            case PLUS:
+                return exact ? builder.CreateNSWAdd(l, r, "addtmp") : nullptr;
+            case MINUS:
+                return exact ? builder.CreateNSWSub(l, r, "subtmp") : nullptr;
+            case STAR:
+                return exact ? builder.CreateNSWMul(l, r, "multmp") : nullptr;
+            case MOD: {
+                // fmod by zero is NaN, and a negative dividend can give -0, neither of which srem can do
+                NumRange divisor = typeInfo.getRange(node->getRhs());
+                if (!exact || divisor.mayBeZero() || typeInfo.getRange(node->getLhs()).lo < 0)
+                    return nullptr;
+                return builder.CreateSRem(l, r, "remtmp");
+            }
+            // Integers are never NaN, so the unordered comparisons are the same as signed ones
+            case LESS:
+                return builder.CreateICmpSLT(l, r, "cmptmp");
+            case GREATER:
+                return builder.CreateICmpSGT(l, r, "cmptmp");
+            case EQ:
+                return builder.CreateICmpEQ(l, r, "cmptmp");
+            case NEQ:
+                return builder.CreateICmpNE(l, r, "cmptmp");
+            case GREQ:
+                return builder.CreateICmpSGE(l, r, "cmptmp");
+            case LEQ:
+                return builder.CreateICmpSLE(l, r, "cmptmp");
+            default:
+                return nullptr;
+        }
+    }
+
+    Value *Codegen::toDouble(Value *val)
+    {
+        if (val->getType()->isIntegerTy(1))
+            return builder.CreateUIToFP(val, Type::getDoubleTy(context), "booltmp");
+        if (val->getType()->isIntegerTy())
+            return builder.CreateSIToFP(val, Type::getDoubleTy(context), "inttmp");
+        return val;
+    }
+
+    Value *Codegen::toBool(Value *val, const Twine &name)
+    {
+        if (val->getType()->isIntegerTy(1))
+            return val;
+        if (val->getType()->isIntegerTy())
+            return builder.CreateICmpNE(val, ConstantInt::get(val->getType(), 0), name);
+        return builder.CreateFCmpONE(val, ConstantFP::get(context, APFloat(0.0)), name);
+    }
+
+    Value *Codegen::toInt(Value *val)
+    {
+        if (val->getType()->isIntegerTy(1))
+            return builder.CreateZExt(val, Type::getInt64Ty(context), "booltmp");
+        if (val->getType()->isIntegerTy())
+            return val;
+        return builder.CreateFPToSI(val, Type::getInt64Ty(context), "inttmp");
+    }
+
+    StructType *Codegen::arrayType()
+    {
+        // struct SimpleArray { double *data; int64_t length; } in runtime.h
+        if (StructType *type = StructType::getTypeByName(context, "simple.array"))
+            return type;
+        return StructType::create(context, {Type::getDoublePtrTy(context), Type::getInt64Ty(context)}, "simple.array");
+    }
+
+    Instruction *Codegen::arrayAccess(Instruction *access, bool header)
+    {
+        // An element is never part of a header, and a header is only reused for elements after its array has gone, so
+        // the two types can't alias.  Anything untagged, like the runtime's own accesses, still aliases both
+        MDBuilder md(context);
+        MDNode *root = md.createTBAARoot("SIMPLE TBAA");
+        MDNode *type = md.createTBAAScalarTypeNode(header ? "array header" : "array element", root);
+        access->setMetadata(LLVMContext::MD_tbaa, md.createTBAAStructTagNode(type, type, 0));
+        return access;
+    }
+
+    Value *Codegen::arrayHeader(Value *handle)
+    {
+        Value *address = builder.CreateFPToUI(toDouble(handle), Type::getInt64Ty(context), "arrayaddr");
+        return builder.CreateIntToPtr(address, arrayType()->getPointerTo(), "array");
+    }
+
+    Value *Codegen::arrayLength(Value *header)
+    {
+        Value *field = builder.CreateStructGEP(arrayType(), header, 1, "lengthptr");
+        return arrayAccess(builder.CreateLoad(Type::getInt64Ty(context), field, "length"), true);
+    }
+
+    // The name in a NAME node, or nothing for any other node
+    static std::string nameOf(AST *node)
+    {
+        return node->getType() == ASTType::NAME ? static_cast<NameAST *>(node)->toString() : "";
+    }
+
+    Codegen::ArrayParts Codegen::arrayParts(AST *array)
+    {
+        // Stack arrays are used directly
+        if (array->getType() == ASTType::NAME) {
+            auto stack = stackArrays.find(static_cast<NameAST *>(array)->toString());
+            if (stack != stackArrays.end()) {
+                Value *data = builder.CreateConstInBoundsGEP2_32(stack->second.data->getAllocatedType(),
+                                                                 stack->second.data, 0, 0, "data");
+                return {data, builder.getInt64(stack->second.length)};
+            }
+        }
+        array->accept(this);
+        Value *header = arrayHeader(retVal);
+        Value *dataField = builder.CreateStructGEP(arrayType(), header, 0, "dataptr");
+        Value *data = arrayAccess(builder.CreateLoad(Type::getDoublePtrTy(context), dataField, "data"), true);
+        return {data, arrayLength(header)};
+    }
+
+    Value *Codegen::stackArray(const std::string &name, size_t length)
+    {
+        Function *parentFunc = builder.GetInsertBlock()->getParent();
+        StackArray &stack = stackArrays[name];
+        if (!stack.data) {
+            stack.length = length;
+            stack.data = CreateEntryBlockAlloca(parentFunc, name + ".data",
+                                                ArrayType::get(Type::getDoubleTy(context), length));
+            stack.data->setAlignment(Align(16));
+            stack.header = CreateEntryBlockAlloca(parentFunc, name + ".header", arrayType());
+        }
+        // Every a = array(n) gives an array of zeros, even when it runs again in a loop
+        Value *data = builder.CreateConstInBoundsGEP2_32(stack.data->getAllocatedType(), stack.data, 0, 0, "data");
+        builder.CreateMemSet(data, builder.getInt8(0), length * sizeof(double), Align(16));
+        arrayAccess(builder.CreateStore(data, builder.CreateStructGEP(arrayType(), stack.header, 0)), true);
+        arrayAccess(builder.CreateStore(builder.getInt64(length), builder.CreateStructGEP(arrayType(), stack.header, 1)),
+                    true);
+        // The header's address is the handle, for passing to other functions
+        Value *address = builder.CreatePtrToInt(stack.header, Type::getInt64Ty(context), "arrayaddr");
+        return builder.CreateUIToFP(address, Type::getDoubleTy(context), "array");
+    }
+
+    bool Codegen::hasRegion(BlockAST *region)
+    {
+        for (const auto &var : *regionArrays) {
+            if (var.second == region)
+                return true;
+        }
+        return false;
+    }
+
+    Value *Codegen::enterRegion()
+    {
+        FunctionCallee enter = module->getOrInsertFunction("simple_region_enter", Type::getInt8PtrTy(context));
+        if (auto *enterFunc = dyn_cast<Function>(enter.getCallee()))
+            enterFunc->setDoesNotThrow();
+        return builder.CreateCall(enter, {}, "regionmark");
+    }
+
+    void Codegen::leaveRegion(Value *mark)
+    {
+        FunctionCallee leave = module->getOrInsertFunction("simple_region_leave", Type::getVoidTy(context),
+                                                           Type::getInt8PtrTy(context));
+        if (auto *leaveFunc = dyn_cast<Function>(leave.getCallee()))
+            leaveFunc->setDoesNotThrow();
+        builder.CreateCall(leave, {mark});
+    }
+
+    Value *Codegen::arrayElement(ArrayAST *node)
+    {
+        if (node->values.size() != 1)
+            logErrorV("Arrays take exactly one index");
+        ArrayParts array = arrayParts(node->getName());
+        Value *data = array.data, *length = array.length;
+        node->values[0]->accept(this);
+        Value *index = retVal;
+
+        // Loops that check every index up front use the loop variable as it is
+        if (index->getType()->isIntegerTy(64) && uncheckedArrays.count(nameOf(node->getName())) &&
+            nameOf(node->values[0].get()) == uncheckedVar)
+            return builder.CreateInBoundsGEP(Type::getDoubleTy(context), data, index, "elemptr");
+
+        // Proven integers only need the range check.  Doubles also have to be whole numbers, which converting to an
+        // integer and back finds out.  fptosi gives poison for NaNs and huge values, so it is frozen first
+        Value *inRange;
+        Value *offset;
+        if (index->getType()->isIntegerTy(64)) {
+            offset = index;
+            inRange = builder.CreateICmpULT(offset, length, "inrange");
+        } else {
+            index = toDouble(index);
+            offset = builder.CreateFreeze(builder.CreateFPToSI(index, Type::getInt64Ty(context)), "index");
+            Value *exact = builder.CreateFCmpOEQ(builder.CreateSIToFP(offset, Type::getDoubleTy(context)), index,
+                                                 "whole");
+            inRange = builder.CreateAnd(exact, builder.CreateICmpULT(offset, length), "inrange");
+        }
+
+        Function *parentFunc = builder.GetInsertBlock()->getParent();
+        BasicBlock *failBB = BasicBlock::Create(context, "badindex", parentFunc);
+        BasicBlock *okBB = BasicBlock::Create(context, "index", parentFunc);
+        builder.CreateCondBr(inRange, okBB, failBB, MDBuilder(context).createBranchWeights(1 << 20, 1));
+
+        // Report the index and stop
+        builder.SetInsertPoint(failBB);
+        FunctionCallee indexError = module->getOrInsertFunction(
+                "simple_index_error", Type::getVoidTy(context), Type::getDoubleTy(context), Type::getDoubleTy(context));
+        if (auto *errorFunc = dyn_cast<Function>(indexError.getCallee())) {
+            errorFunc->setDoesNotReturn();
+            errorFunc->setDoesNotThrow();
+            errorFunc->addFnAttr(Attribute::Cold);
+        }
+        builder.CreateCall(indexError, {toDouble(index), builder.CreateSIToFP(length, Type::getDoubleTy(context))});
+        builder.CreateUnreachable();
+
+        builder.SetInsertPoint(okBB);
+        return builder.CreateInBoundsGEP(Type::getDoubleTy(context), data, offset, "elemptr");
+    }
+
+    AllocaInst *Codegen::CreateEntryBlockAlloca(Function *func, const std::string &varName, Type *type)
     {
         // Create temporary builder pointing to the entry of the function, then create an alloca with the correct name
         // and return
         IRBuilder<> tempBuilder(&func->getEntryBlock(), func->getEntryBlock().begin());
-        return tempBuilder.CreateAlloca(Type::getDoubleTy(context), 0, varName);
+        return tempBuilder.CreateAlloca(type ? type : Type::getDoubleTy(context), 0, varName);
     }
 
-    int Codegen::emitObjCode(std::string filename)
+    // Functions per partition when the partition count is picked automatically
+    static const unsigned functionsPerPartition = 256;
+    // Upper limit on the automatic partition count
+    static const unsigned maxPartitions = 32;
+
+    unsigned Codegen::partitionCount()
     {
-        filename = filename + ".o";
+        // Only depends on the module so the output doesn't change with the number of threads
+        unsigned defined = 0;
+        for (auto &func : *module) {
+            if (!func.isDeclaration())
+                defined++;
+        }
+        // Partitions past one per function would be empty
+        if (options.partitions)
+            return std::max(1u, std::min(options.partitions, defined));
+        return std::max(1u, std::min(maxPartitions, defined / functionsPerPartition));
+    }
+
+    // Optimise across functions, before the module is split into partitions.  Internal functions can have constants
+    // propagated into them and unused arguments removed, and small ones are inlined into their callers
+    static void optimiseProgram(Module &mod, TargetMachine &targetMachine)
+    {
+        legacy::PassManager pm;
+        pm.add(new TargetLibraryInfoWrapperPass(TargetLibraryInfoImpl(Triple(mod.getTargetTriple()))));
+        pm.add(createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+        // The interprocedural passes work on registers, not allocas
+        pm.add(createPromoteMemoryToRegisterPass());
+        pm.add(createIPSCCPPass());
+        pm.add(createFunctionSpecializationPass());
+        pm.add(createGlobalOptimizerPass());
+        pm.add(createDeadArgEliminationPass());
+        pm.add(createInstructionCombiningPass());
+        pm.add(createCFGSimplificationPass());
+        pm.add(createFunctionInliningPass(2, 0, false));
+        // Drop internal functions which have been inlined everywhere
+        pm.add(createGlobalDCEPass());
+        pm.run(mod);
+    }
+
+    // Run the function optimisation pipeline over every function in a module
+    static void optimiseModule(Module &mod, TargetMachine &targetMachine, const CodegenOptions &options)
+    {
+        legacy::FunctionPassManager fpm(&mod);
+        // Tell the vectorisers about the target and which math functions have vector versions
+        TargetLibraryInfoImpl libraryInfo(Triple(mod.getTargetTriple()));
+        libraryInfo.addVectorizableFunctionsFromVecLib(options.vecLib);
+        fpm.add(new TargetLibraryInfoWrapperPass(libraryInfo));
+        fpm.add(createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+        // Use the TBAA types of array accesses, so element stores don't stop header loads being hoisted
+        fpm.add(createTypeBasedAAWrapperPass());
+        // Promote allocas to registers (speed)
+        fpm.add(createPromoteMemoryToRegisterPass());
+        // simple peephole optimizations
+        fpm.add(createInstructionCombiningPass());
+        // re-associate expressions
+        fpm.add(createReassociatePass());
+        // eliminate common sub-expressions
+        fpm.add(createGVNPass());
+        // simplify control flow graph
+        fpm.add(createCFGSimplificationPass());
+        // Hoist invariant code out of loops and turn their counters into canonical integer induction variables, so
+        // the trip count of counted loops is known
+        fpm.add(createLoopRotatePass());
+        fpm.add(createLICMPass());
+        fpm.add(createIndVarSimplifyPass());
+        // Record the vector library versions of math calls, then vectorise loops and straight line code
+        fpm.add(createInjectTLIMappingsLegacyPass());
+        fpm.add(createLoopVectorizePass());
+        fpm.add(createSLPVectorizerPass());
+        // Clean up after the vectorisers
+        fpm.add(createInstructionCombiningPass());
+        // Unroll what is left, fully if the trip count is small and constant
+        fpm.add(createLoopUnrollPass());
+        fpm.add(createInstructionCombiningPass());
+        fpm.add(createCFGSimplificationPass());
+
+        fpm.doInitialization();
+        for (auto &func : mod) {
+            if (!func.isDeclaration())
+                fpm.run(func);
+        }
+        fpm.doFinalization();
+    }
+
+    // Create a target machine for the host.  Each thread needs its own
+    static std::unique_ptr<TargetMachine> createHostMachine(const Target *target, const std::string &targetTriple,
+                                                            const CodegenOptions &options)
+    {
+        auto Features = "";
+
+        TargetOptions opt;
+        // Whether the backend may fuse multiplies and adds that weren't already fused in the IR
+        if (options.fastMath || options.fpContract == CodegenOptions::ContractFast)
+            opt.AllowFPOpFusion = FPOpFusion::Fast;
+        else if (options.fpContract == CodegenOptions::ContractOn)
+            opt.AllowFPOpFusion = FPOpFusion::Standard;
+        else
+            opt.AllowFPOpFusion = FPOpFusion::Strict;
+        auto RM = Optional<Reloc::Model>();
+        return std::unique_ptr<TargetMachine>(target->createTargetMachine(targetTriple, options.cpu, Features, opt,
+                                                                          RM));
+    }
+
+    // Optimise a module and emit its object code into a buffer
+    static bool emitToBuffer(Module &mod, TargetMachine &targetMachine, const CodegenOptions &options,
+                             SmallVectorImpl<char> &buffer)
+    {
+        optimiseModule(mod, targetMachine, options);
+
+        raw_svector_ostream dest(buffer);
+        // Pass emits object code
+        legacy::PassManager pass;
+        if (targetMachine.addPassesToEmitFile(pass, dest, nullptr, CGFT_ObjectFile))
+            return false;
+
+        pass.run(mod);
+        return true;
+    }
+
+    std::string Codegen::fragmentKey(FuncDefAST *node)
+    {
+        // The function's own tree plus the signature of everything it calls.  Callees must be declared before use, so
+        // they are all in the module by now
+        fingerprinter.print(node);
+        std::string desc = fingerprinter.getText();
+        std::set<std::string> callees = fingerprinter.getCallees();
+        for (const auto &callee : callees) {
+            desc += "\n" + callee + ":";
+            Function *calleeFunc = module->getFunction(callee);
+            if (!calleeFunc)
+                continue;
+            raw_string_ostream sig(desc);
+            calleeFunc->getFunctionType()->print(sig);
+            sig << " cc" << calleeFunc->getCallingConv() << " "
+                << calleeFunc->getAttributes().getAsString(AttributeList::FunctionIndex);
+        }
+        // Its own attributes come from the effects of everything it calls, even indirectly
+        node->getName()->accept(&nameGetter);
+        if (Function *func = module->getFunction(nameGetter.getLastName()))
+            desc += "\nself:" + func->getAttributes().getAsString(AttributeList::FunctionIndex);
+        // Where its arrays live depends on what the functions they are passed to do with them
+        desc += "\narrays:";
+        for (const auto &local : escapes.localArrays(nameGetter.getLastName()))
+            desc += " " + local.first + "=" + std::to_string(local.second);
+        for (const auto &region : escapes.regionArrays(nameGetter.getLastName()))
+            desc += " " + region.first + (region.second ? "@block" : "@function");
+        // Calls with constant arguments may have been evaluated, so the object also depends on the bodies of the pure
+        // functions it calls, and of everything they call
+        if (evaluatesCalls()) {
+            std::vector<std::string> pending(callees.begin(), callees.end());
+            std::set<std::string> seen;
+            while (!pending.empty()) {
+                std::string callee = pending.back();
+                pending.pop_back();
+                FuncDefAST *def = evaluator.lookup(callee);
+                const FunctionEffects *result = effects.lookup(callee);
+                if (!def || !result || result->memory != FunctionEffects::Pure || !seen.insert(callee).second)
+                    continue;
+                fingerprinter.print(def);
+                desc += "\n" + callee + "=" + fingerprinter.getText();
+                for (const auto &next : fingerprinter.getCallees())
+                    pending.push_back(next);
+            }
+        }
+        return ObjCache::fragmentKey(desc, options);
+    }
+
+    // Collect the globals an instruction operand refers to, looking through constant expressions
+    static void collectGlobals(Value *val, SmallPtrSetImpl<GlobalValue *> &globals)
+    {
+        if (auto *global = dyn_cast<GlobalValue>(val)) {
+            globals.insert(global);
+        } else if (auto *constant = dyn_cast<Constant>(val)) {
+            for (auto &op : constant->operands())
+                collectGlobals(op, globals);
+        }
+    }
+
+    void Codegen::emitFragment(Function *func, const std::string &key)
+    {
+        // Copy the function into a module of its own, with declarations for everything it uses.  Cloning the whole
+        // module would make every fragment cost as much as the program
+        auto fragment = std::make_unique<Module>(func->getName(), context);
+        TargetMachine *machine = getTargetMachine();
+        fragment->setTargetTriple(module->getTargetTriple());
+        fragment->setDataLayout(module->getDataLayout());
+
+        SmallPtrSet<GlobalValue *, 16> globals;
+        for (auto &block : *func) {
+            for (auto &inst : block) {
+                for (auto &op : inst.operands())
+                    collectGlobals(op, globals);
+            }
+        }
+
+        ValueToValueMapTy vmap;
+        for (auto *global : globals) {
+            if (global == func)
+                continue;
+            if (auto *callee = dyn_cast<Function>(global)) {
+                Function *decl = Function::Create(callee->getFunctionType(), Function::ExternalLinkage,
+                                                  callee->getName(), fragment.get());
+                decl->copyAttributesFrom(callee);
+                decl->setLinkage(Function::ExternalLinkage);
+                vmap[callee] = decl;
+            } else if (auto *var = dyn_cast<GlobalVariable>(global)) {
+                // Module local data has to travel with the function.  Anything else is linked by name
+                auto *copy = new GlobalVariable(*fragment, var->getValueType(), var->isConstant(), var->getLinkage(),
+                                                var->hasLocalLinkage() ? var->getInitializer() : nullptr,
+                                                var->getName());
+                copy->copyAttributesFrom(var);
+                if (!var->hasLocalLinkage())
+                    copy->setLinkage(GlobalValue::ExternalLinkage);
+                vmap[var] = copy;
+            }
+        }
+
+        Function *copy = Function::Create(func->getFunctionType(), func->getLinkage(), func->getName(),
+                                          fragment.get());
+        vmap[func] = copy;
+        auto copyArg = copy->arg_begin();
+        for (auto &arg : func->args()) {
+            copyArg->setName(arg.getName());
+            vmap[&arg] = &*copyArg++;
+        }
+        SmallVector<ReturnInst *, 4> returns;
+        CloneFunctionInto(copy, func, vmap, CloneFunctionChangeType::DifferentModule, returns);
+
+        // The main module only needs the declaration from now on
+        builder.ClearInsertionPoint();
+        func->deleteBody();
+
+        SmallVector<char, 0> object;
+        if (!emitToBuffer(*fragment, *machine, options, object))
+            logErrorV("TargetMachine can't emit a file of this type");
+
+        StringRef data(object.data(), object.size());
+        fragmentCache->store(key, data);
+        fragments.push_back(MemoryBuffer::getMemBufferCopy(data));
+    }
+
+    TargetMachine *Codegen::getTargetMachine()
+    {
+        if (targetMachine)
+            return targetMachine.get();
+
         // Initialise all targets
         InitializeAllTargetInfos();
         InitializeAllTargets();
@@ -583,41 +1841,221 @@ namespace Compiler {
         // Print error and exit if requested target couldn't be found
         if (!target) {
             errs() << error;
-            return 1;
+            return nullptr;
         }
-        // Basic generic CPU
-        auto CPU = "generic";
-        auto Features = "";
 
-        TargetOptions opt;
-        auto RM = Optional<Reloc::Model>();
-        auto targetMachine = target->createTargetMachine(targetTriple, CPU, Features, opt, RM);
+        targetMachine = createHostMachine(target, targetTriple, options);
 
         // Configure the module for optimization
         module->setDataLayout(targetMachine->createDataLayout());
+        return targetMachine.get();
+    }
 
-        // Emit object code
-        std::error_code ec;
-        raw_fd_ostream dest(filename, ec, sys::fs::F_None);
+    // Write objects out and combine them into a single relocatable object
+    static int combineObjects(const std::string &filename, const std::vector<std::unique_ptr<MemoryBuffer>> &objects)
+    {
+        // The parts go in temporary files, which are removed however this returns.  Inputs go in a response file
+        // since there is one per function when compiling incrementally
+        std::vector<std::unique_ptr<FileRemover>> removers;
+        auto temporary = [&](StringRef suffix, SmallVectorImpl<char> &path, int &fd) {
+            std::error_code ec = sys::fs::createTemporaryFile("simple-part", suffix, fd, path);
+            if (ec)
+                errs() << "Could not create temporary file: " << ec.message();
+            else
+                removers.push_back(std::make_unique<FileRemover>(path));
+            return !ec;
+        };
+
+        SmallString<128> listName;
+        int listFd;
+        if (!temporary("parts", listName, listFd))
+            return 1;
+        raw_fd_ostream list(listFd, true);
+        for (const auto &object : objects) {
+            SmallString<128> partName;
+            int partFd;
+            if (!temporary("o", partName, partFd))
+                return 1;
+            raw_fd_ostream dest(partFd, true);
+            dest << object->getBuffer();
+            dest.close();
+            if (dest.has_error()) {
+                errs() << "Could not write file: " << dest.error().message();
+                dest.clear_error();
+                return 1;
+            }
+            // ld reads the response file like a shell would, so quote the name and escape what is special in quotes
+            list << '"';
+            for (char c : partName) {
+                if (c == '"' || c == '\\')
+                    list << '\\';
+                list << c;
+            }
+            list << "\"\n";
+        }
+        list.close();
+        if (list.has_error()) {
+            errs() << "Could not write file: " << list.error().message();
+            list.clear_error();
+            return 1;
+        }
 
+        // Run ld directly rather than through a shell, so the output name is passed as it is
+        ErrorOr<std::string> ld = sys::findProgramByName("ld");
+        if (!ld) {
+            errs() << "Could not find ld to combine partitions";
+            return 1;
+        }
+        std::string response = "@" + listName.str().str();
+        std::string message;
+        int res = sys::ExecuteAndWait(*ld, {"ld", "-r", "-o", filename, response}, None, {}, 0, 0, &message);
+        if (res != 0) {
+            errs() << "Could not combine partitions into " << filename;
+            if (!message.empty())
+                errs() << ": " << message;
+            return 1;
+        }
+        return 0;
+    }
+
+    bool Codegen::linkRuntimeBitcode()
+    {
+        auto buffer = MemoryBuffer::getFile(options.runtimeBitcode);
+        if (!buffer) {
+            errs() << "Could not read runtime bitcode " << options.runtimeBitcode << ": " << buffer.getError().message();
+            return false;
+        }
+        auto runtime = parseBitcodeFile(**buffer, context);
+        if (!runtime) {
+            errs() << "Could not read runtime bitcode " << options.runtimeBitcode << ": " << toString(runtime.takeError());
+            return false;
+        }
+
+        // Compile the runtime for the same target as the program, so its functions can be inlined anywhere
+        (*runtime)->setTargetTriple(module->getTargetTriple());
+        (*runtime)->setDataLayout(module->getDataLayout());
+        for (auto &func : **runtime) {
+            func.removeFnAttr("target-cpu");
+            func.removeFnAttr("target-features");
+            func.removeFnAttr("tune-cpu");
+        }
+
+        // Only what the program uses is linked.  The program is the whole executable, so the runtime's functions can
+        // be internal like the program's own, and are deleted once they have been inlined everywhere
+        if (llvm::Linker::linkModules(*module, std::move(*runtime), llvm::Linker::LinkOnlyNeeded,
+                                [](Module &mod, const StringSet<> &linked) {
+                                    internalizeModule(mod, [&](const GlobalValue &value) {
+                                        return !linked.count(value.getName());
+                                    });
+                                })) {
+            errs() << "Could not link runtime bitcode " << options.runtimeBitcode;
+            return false;
+        }
+        return true;
+    }
+
+    int Codegen::emitBitcode(std::string filename)
+    {
+        filename = filename + ".bc";
+
+        TargetMachine *machine = getTargetMachine();
+        if (!machine)
+            return 1;
+
+        // Optimise across the program's own functions, and leave the rest to the ThinLTO backend once the program
+        // has been linked with whatever calls it
+        optimiseProgram(*module, *machine);
+
+        std::error_code ec;
+        raw_fd_ostream dest(filename, ec, sys::fs::OF_None);
         if (ec) {
             errs() << "Could not open file: " << ec.message();
             return 1;
         }
-        // Pass emits object code
-        legacy::PassManager pass;
-        auto fileType = TargetMachine::CGFT_ObjectFile;
+        legacy::PassManager pm;
+        pm.add(createWriteThinLTOBitcodePass(dest));
+        pm.run(*module);
+        return 0;
+    }
+
+    int Codegen::emitObjCode(std::string filename)
+    {
+        filename = filename + ".o";
+
+        TargetMachine *machine = getTargetMachine();
+        if (!machine)
+            return 1;
 
-        if (targetMachine->addPassesToEmitFile(pass, dest, nullptr, fileType)) {
-            errs() << "TargetMachine can't emit a file of this type";
+        // Incremental builds already have an object for every function
+        if (fragmentCache && !fragments.empty())
+            return combineObjects(filename, fragments);
+
+        if (options.lto == CodegenOptions::LTOFull && !linkRuntimeBitcode())
             return 1;
+        optimiseProgram(*module, *machine);
+
+        unsigned partitions = partitionCount();
+        if (partitions == 1) {
+            SmallVector<char, 0> buffer;
+            if (!emitToBuffer(*module, *machine, options, buffer)) {
+                errs() << "TargetMachine can't emit a file of this type";
+                return 1;
+            }
+
+            // Emit object code
+            std::error_code ec;
+            raw_fd_ostream dest(filename, ec, sys::fs::OF_None);
+            if (ec) {
+                errs() << "Could not open file: " << ec.message();
+                return 1;
+            }
+            dest << buffer;
+            return 0;
         }
 
-        pass.run(*module);
-        dest.flush();
+        // Split the module into partitions.  Contexts can't be shared between threads, so each partition is
+        // serialised to bitcode here and read back into a fresh context on its worker thread
+        std::vector<SmallVector<char, 0>> bitcode;
+        SplitModule(*module, partitions, [&](std::unique_ptr<Module> part) {
+            bitcode.emplace_back();
+            raw_svector_ostream out(bitcode.back());
+            WriteBitcodeToFile(*part, out);
+        });
+
+        // Optimise and emit each partition on the thread pool.  Results are kept in partition order
+        const Target *target = &machine->getTarget();
+        std::string targetTriple = module->getTargetTriple();
+        std::vector<SmallVector<char, 0>> objects(bitcode.size());
+        std::vector<std::string> errors(bitcode.size());
+        {
+            ThreadPool pool(hardware_concurrency(options.threads));
+            for (size_t i = 0; i < bitcode.size(); i++) {
+                pool.async([&, i]() {
+                    LLVMContext partContext;
+                    auto part = parseBitcodeFile(MemoryBufferRef(StringRef(bitcode[i].data(), bitcode[i].size()),
+                                                                 "partition"), partContext);
+                    if (!part) {
+                        errors[i] = toString(part.takeError());
+                        return;
+                    }
+                    auto partMachine = createHostMachine(target, targetTriple, options);
+                    if (!emitToBuffer(**part, *partMachine, options, objects[i]))
+                        errors[i] = "TargetMachine can't emit a file of this type";
+                });
+            }
+            pool.wait();
+        }
 
-        return 0;
+        std::vector<std::unique_ptr<MemoryBuffer>> buffers;
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (!errors[i].empty()) {
+                errs() << errors[i];
+                return 1;
+            }
+            buffers.push_back(MemoryBuffer::getMemBufferCopy(StringRef(objects[i].data(), objects[i].size())));
+        }
 
+        return combineObjects(filename, buffers);
     }
 
 } // namespace Compiler
\ No newline at end of file
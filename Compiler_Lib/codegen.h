@@ -3,19 +3,26 @@
 #define COMPILER_CODEGEN_H
 
 #include "AST.h"
+#include "analysis.h"
+#include "evaluator.h"
+#include "fingerprint.h"
+#include "typeinfer.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
@@ -23,6 +30,7 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils.h"
 #include <map>
+#include <set>
 
 
 namespace Compiler {
@@ -30,6 +38,8 @@ namespace Compiler {
     using std::shared_ptr;
     using namespace llvm;
 
+    class ObjCache;
+
     // Class to get names since they are hidden in another AST class.
     // I have no idea whether this is the correct way of doing things, but I do like a visitor
     // TODO(James) ok all names should be strings, this class is ridiculous
@@ -52,6 +62,56 @@ namespace Compiler {
         void visit(FuncDefAST* node) override { node->getName()->accept(this); };
     };
 
+    // Options controlling how the module is optimised and emitted
+    struct CodegenOptions {
+        // Number of threads used to optimise and emit partitions.  0 means use every hardware thread
+        unsigned threads = 1;
+        // Number of partitions to split the module into.  0 picks a count from the size of the module.
+        // This never depends on the thread count, so the object file is identical however many threads are used
+        unsigned partitions = 0;
+        // CPU to generate code for
+        std::string cpu = "generic";
+        // Whether math functions have to set errno.  SIMPLE programs can't read errno, so by default calls to libm
+        // functions become LLVM intrinsics which can be folded and vectorised
+        bool mathErrno = false;
+        // Vector math library that vectorised loops call for math functions
+        TargetLibraryInfoImpl::VectorLibrary vecLib = TargetLibraryInfoImpl::NoLibrary;
+        // Allow every fast-math optimisation in every function.  FAST functions get them either way
+        bool fastMath = false;
+        // When a multiply and add may be fused.  On only fuses within a single expression, like C
+        enum FPContract { ContractOff, ContractOn, ContractFast } fpContract = ContractOff;
+        // Warn about recursive calls that can't be turned into loops.  Doesn't change the object
+        bool warnRecursion = false;
+        // Cache the results of pure functions whose recursive calls need a stack frame, as if they were MEMO
+        bool memoize = false;
+        // Results each MEMO function's cache holds, rounded up to a power of two
+        unsigned memoSize = 4096;
+        // When every slot a result could go in is taken, replace the one it hashes to or don't cache the result
+        enum MemoEvict { EvictReplace, EvictKeep } memoEvict = EvictReplace;
+        // Count cache hits and misses and print them to stderr when the program exits
+        bool memoStats = false;
+        // Run calls to pure functions with constant arguments at compile time.  Not done with fast-math or
+        // contraction, since the generated code's rounding then depends on the optimiser
+        bool constEval = true;
+        // Expressions evaluated per call before giving up
+        unsigned long constEvalSteps = 1000000;
+        // Full LTO links the runtime's bitcode into the program before optimisation, so its functions can be inlined
+        // and specialised.  Thin emits bitcode with a ThinLTO summary instead of an object, for linking with C++
+        enum LTO { LTONone, LTOFull, LTOThin } lto = LTONone;
+        // The runtime's bitcode, for full LTO
+        std::string runtimeBitcode;
+
+        // Describe every option that changes the generated object, for cache keys
+        std::string describe() const {
+            return "partitions=" + std::to_string(partitions) + ";cpu=" + cpu + ";errno=" +
+                   std::to_string(mathErrno) + ";veclib=" + std::to_string(vecLib) + ";fast=" + std::to_string(fastMath) + ";contract=" +
+                   std::to_string(fpContract) + ";memoize=" + std::to_string(memoize) + ";memosize=" +
+                   std::to_string(memoSize) + ";memoevict=" + std::to_string(memoEvict) + ";memostats=" +
+                   std::to_string(memoStats) + ";consteval=" + std::to_string(constEval) + ";constevalsteps=" +
+                   std::to_string(constEvalSteps) + ";lto=" + std::to_string(lto);
+        }
+    };
+
     class Codegen : public Visitor {
         // Owns lots of core LLVM data. Needs to be passed into APIs
         LLVMContext context;
@@ -61,34 +121,145 @@ namespace Compiler {
         unique_ptr<Module> module;
         // keeps track of values in the current scope. A symbol table
         std::map<std::string, AllocaInst*> namedValues;
-        // Pass manager to optimize functions
-        std::unique_ptr<legacy::FunctionPassManager> fpm;
+        // Optimisation and emission settings
+        CodegenOptions options;
         // Since we cannot return, store values and functions which the code generation functions should return in here
         Value * retVal;
         Function * retFunc;
         // Visitor to extract names
         NameGetter nameGetter;
-        // Helper function to create an alloca instruction in the entry block of a function
-        AllocaInst *CreateEntryBlockAlloca(Function *func, const std::string &varName);
+        // Visitor to decide whether expressions can be evaluated speculatively
+        SideEffectChecker sideEffects;
+        // Effects of every function in the program, which become attributes so the optimiser can move, share and
+        // delete calls.  Standard math functions and the printing functions linked in with -l are known
+        EffectAnalysis effects;
+        void addKnownExternals();
+        void addEffectAttributes(Function *func, const std::string &name);
+        // Functions whose results are cached: MEMO ones, plus pure recursive ones with -fmemoize.  Each has a hash
+        // table keyed on the bits of its arguments, checked on entry.  A miss runs the body and stores the result
+        std::set<std::string> memoFunctions;
+        std::set<std::string> chooseMemoFunctions(BlockAST *program);
+        struct MemoTable {
+            GlobalVariable *keys = nullptr, *values = nullptr, *used = nullptr, *hits = nullptr, *misses = nullptr;
+            std::vector<Value *> keyBits;
+            // Slot the result of a miss goes in.  nullptr if the current function isn't cached
+            Value *slot = nullptr;
+        };
+        MemoTable memo;
+        // Look the arguments up on entry, returning on a hit and leaving the builder where the body goes on a miss
+        void memoLookup(Function *func, const std::string &name);
+        void memoStore(Value *result);
+        // Print the function's hit rate when the program exits
+        void memoReport(const std::string &name);
+        // Interpreter for calls to pure functions with constant arguments
+        ConstantEvaluator evaluator{effects};
+        bool evaluatesCalls() const;
+        // Generate a binary operator once its operands have been generated
+        Value *binaryOp(BinaryOpAST *node, Value *lhs, Value *rhs);
+        // Generate && and ||.  The right hand side is only branched around when it has side effects
+        Value *logicalOp(BinaryOpAST *node);
+        // EXT declared math functions which calls are generated as intrinsics for
+        std::map<std::string, Intrinsic::ID> mathBuiltins;
+        // With -ffp-contract=on, turn a*b+c into fmuladd when the multiply is part of the same expression.  Returns
+        // nullptr if it can't
+        Value *fuseMulAdd(Value *lhs, Value *rhs, bool subtract);
+        // Generate base ^ exponent.  Small constant exponents are strength reduced to multiplies
+        Value *powOp(Value *base, Value *exponent);
+        // Self recursion in the current function.  Tail calls store their arguments in the parameters and jump back
+        // to tailHeader, so deep recursion runs in constant stack
+        RecursionFinder recursionFinder;
+        RecursionFinder::Result recursion;
+        BasicBlock *tailHeader = nullptr;
+        std::vector<AllocaInst *> paramAllocas;
+        // Running sum and product for tail calls under + and *.  The function returns accMul * value + accAdd
+        AllocaInst *accAdd = nullptr, *accMul = nullptr;
+        // Jump back to the start of the function with new arguments.  With an operand, it is first folded into the
+        // accumulators with op.  Returns a placeholder value, since nothing after the jump runs
+        Value *tailCall(const std::vector<Value *> &args, TokenType op = PLUS, Value *operand = nullptr);
+        Value *accumulateTailCall(BinaryOpAST *node, FuncCallAST *call);
+        void warn(const std::string &message);
+        // Which variables and expressions in the current function are always exact integers
+        TypeInference typeInfo;
+        // Attach UNROLL and VECTORIZE hints to the branch back to the top of a loop
+        void addLoopHints(BranchInst *latch, ForAST *node);
+        // Generate a binary operator with integer instructions if type inference allows it.  Returns nullptr if not
+        Value *intBinaryOp(BinaryOpAST *node, Value *lhs, Value *rhs);
+        // Expressions keep their natural type, so comparisons stay as i1 when they feed a branch and proven integers
+        // stay as i64.  These convert a value when a particular type is needed: doubles for passing, returning and
+        // arithmetic, i1 for conditions, and i64 for integer variables.  toInt is only exact for proven integers
+        Value *toDouble(Value *val);
+        Value *toBool(Value *val, const Twine &name = "");
+        Value *toInt(Value *val);
+        // Arrays are held in doubles as the address of the runtime's SimpleArray header.  Regions reuse the memory of
+        // headers, so its fields are loaded like any other memory, but arrayAccess tags header and element accesses
+        // with different TBAA types, which lets a loop that stores to elements keep the header's loads out of it.
+        // arrayElement checks the index is a whole number in range, stopping the program through simple_index_error
+        // if it isn't, and gives the element's address
+        StructType *arrayType();
+        Instruction *arrayAccess(Instruction *access, bool header);
+        Value *arrayHeader(Value *handle);
+        Value *arrayLength(Value *header);
+        Value *arrayElement(ArrayAST *node);
+        // The data pointer and i64 length of the array an expression gives
+        struct ArrayParts {
+            Value *data, *length;
+        };
+        ArrayParts arrayParts(AST *array);
+        // Whether len is the runtime's, declared with DEFINE EXT len(a), so calls to it can just load the length
+        bool inlineLen = false;
+        // Arrays that never leave the function that makes them live in its stack frame, with a constant length
+        EscapeAnalysis escapes;
+        struct StackArray {
+            AllocaInst *header = nullptr, *data = nullptr;
+            size_t length = 0;
+        };
+        std::map<std::string, StackArray> stackArrays;
+        const std::map<std::string, size_t> *localArrays = nullptr;
+        // Make the stack array for an `a = array(n)` the escape analysis found, zeroed.  Returns the handle
+        Value *stackArray(const std::string &name, size_t length);
+        // Other arrays that can't escape are made in a region, the function's own or a REGION block's, which is freed
+        // all at once when it is left.  regionMark is where the function's region starts, if it has one
+        const std::map<std::string, BlockAST *> *regionArrays = nullptr;
+        Value *regionMark = nullptr;
+        bool hasRegion(BlockAST *region);
+        Value *enterRegion();
+        void leaveRegion(Value *mark);
+        // Inside the copy of a loop whose indices were all checked up front, a[i] needs no check for these arrays
+        std::string uncheckedVar;
+        std::set<std::string> uncheckedArrays;
+        // Helper function to create an alloca instruction in the entry block of a function.  Doubles by default
+        AllocaInst *CreateEntryBlockAlloca(Function *func, const std::string &varName, Type *type = nullptr);
+        // Work out how many partitions to split the module into for emission
+        unsigned partitionCount();
+        // Host target machine, created on first use.  Also sets the module's triple and data layout
+        std::unique_ptr<TargetMachine> targetMachine;
+        TargetMachine *getTargetMachine();
+
+        // Incremental compilation.  Each function is emitted as its own object fragment, cached under a fingerprint of
+        // its tree and the signatures of its callees.  Unchanged functions reuse the cached fragment
+        ObjCache *fragmentCache = nullptr;
+        // Fragments in definition order
+        std::vector<std::unique_ptr<MemoryBuffer>> fragments;
+        std::set<std::string> fragmentNames;
+        Fingerprinter fingerprinter;
+        std::string fragmentKey(FuncDefAST *node);
+        void emitFragment(Function *func, const std::string &key);
+        // Link the runtime's bitcode into the module for full LTO
+        bool linkRuntimeBitcode();
 
     public:
         // Initialize builder, module with context.  also init pointers to nullptr
-        Codegen() : builder(context), module(std::make_unique<Module>("JIT", context)), fpm(std::make_unique<legacy::FunctionPassManager>(module.get())), retVal(nullptr), retFunc(nullptr) {
-            // Promote allocas to registers (speed)
-            fpm->add(createPromoteMemoryToRegisterPass());
-            // simple peephole optimizations
-            fpm->add(createInstructionCombiningPass());
-            // re-associate expressions
-            fpm->add(createReassociatePass());
-            // eliminate common sub-expressions
-            fpm->add(createGVNPass());
-            // simplify control flow graph
-            fpm->add(createCFGSimplificationPass());
-            // init pass manager
-            fpm->doInitialization();
-        }
+        // Optimisation is deferred to emitObjCode so it can run on each partition in parallel
+        Codegen(CodegenOptions options = CodegenOptions())
+            : builder(context), module(std::make_unique<Module>("JIT", context)), options(options), retVal(nullptr),
+              retFunc(nullptr) {}
+
+        // Compile each function separately, reusing cached fragments for functions that haven't changed
+        void enableIncremental(ObjCache *cache) { fragmentCache = cache; };
 
         int emitObjCode(std::string filename);
+        // Write the program as bitcode with a ThinLTO summary, for -flto=thin
+        int emitBitcode(std::string filename);
 
         Value *logErrorV(const char *str);
         void visit(BlockAST* node) override;
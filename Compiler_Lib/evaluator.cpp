@@ -0,0 +1,450 @@
+#include "evaluator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Compiler {
+
+
+    // Thrown to abandon an evaluation
+    struct GiveUp {};
+
+    // A math function code generation turns into an LLVM intrinsic, and what it computes
+    struct MathFunction {
+        const char *name;
+        unsigned args;
+        // Whether every libm gives the correctly rounded result, so the generated code can't get anything else
+        bool exact;
+        double (*eval)(const double *args);
+    };
+
+    static const MathFunction mathFunctions[] = {
+        {"sqrt", 1, true, [](const double *a) { return std::sqrt(a[0]); }},
+        {"sin", 1, false, [](const double *a) { return std::sin(a[0]); }},
+        {"cos", 1, false, [](const double *a) { return std::cos(a[0]); }},
+        {"exp", 1, false, [](const double *a) { return std::exp(a[0]); }},
+        {"exp2", 1, false, [](const double *a) { return std::exp2(a[0]); }},
+        {"log", 1, false, [](const double *a) { return std::log(a[0]); }},
+        {"log2", 1, false, [](const double *a) { return std::log2(a[0]); }},
+        {"log10", 1, false, [](const double *a) { return std::log10(a[0]); }},
+        {"fma", 3, true, [](const double *a) { return std::fma(a[0], a[1], a[2]); }},
+        {"fabs", 1, true, [](const double *a) { return std::fabs(a[0]); }},
+        {"floor", 1, true, [](const double *a) { return std::floor(a[0]); }},
+        {"ceil", 1, true, [](const double *a) { return std::ceil(a[0]); }},
+        {"trunc", 1, true, [](const double *a) { return std::trunc(a[0]); }},
+        {"round", 1, true, [](const double *a) { return std::round(a[0]); }},
+        {"rint", 1, true, [](const double *a) { return std::rint(a[0]); }},
+        {"nearbyint", 1, true, [](const double *a) { return std::nearbyint(a[0]); }},
+        {"copysign", 2, true, [](const double *a) { return std::copysign(a[0], a[1]); }},
+        {"fmin", 2, true, [](const double *a) { return std::fmin(a[0], a[1]); }},
+        {"fmax", 2, true, [](const double *a) { return std::fmax(a[0], a[1]); }},
+    };
+
+    // Conditions are an ordered comparison with zero, so NaN is false
+    static bool isTrue(double val)
+    {
+        return val < 0 || val > 0;
+    }
+
+    void ConstantEvaluator::addProgram(BlockAST *program, bool inexactMath, const EvalBudget &budget)
+    {
+        this->inexactMath = inexactMath;
+        this->budget = budget;
+        definitions.clear();
+        externals.clear();
+        calls.clear();
+        results.clear();
+        for (const auto &stmt : program->getChildren()) {
+            if (stmt->getType() != ASTType::FUNCDEF)
+                continue;
+            auto def = static_cast<FuncDefAST *>(stmt.get());
+            if (def->getName()->getType() != ASTType::NAME)
+                continue;
+            std::string name = static_cast<NameAST *>(def->getName())->toString();
+            if (def->isExt())
+                externals[name] = def->getArgs().size();
+            else
+                definitions[name] = def;
+        }
+    }
+
+    FuncDefAST *ConstantEvaluator::lookup(const std::string &name) const
+    {
+        auto def = definitions.find(name);
+        return def != definitions.end() ? def->second : nullptr;
+    }
+
+    bool ConstantEvaluator::evaluate(const std::string &name, const std::vector<double> &args, double &result)
+    {
+        unsigned long limit = std::min(budget.steps, budget.functionSteps - functionStepsUsed);
+        auto known = calls.find({name, bits(args)});
+        if (known != calls.end()) {
+            // Charged what evaluating it again would cost, so what happens doesn't depend on what came before
+            const Outcome &outcome = known->second;
+            functionStepsUsed += std::min(limit, outcome.steps);
+            result = outcome.value;
+            return outcome.done && outcome.steps <= limit;
+        }
+
+        results.clear();
+        steps = 0;
+        stepLimit = limit;
+        depth = 0;
+        bool done = true;
+        try {
+            result = call(name, args);
+        } catch (const GiveUp &) {
+            done = false;
+        }
+        vars = nullptr;
+        unsigned long used = std::min(steps, limit);
+        functionStepsUsed += used;
+        // A call that failed with less than the whole budget might succeed in another function
+        if (done || limit == budget.steps)
+            calls[{name, bits(args)}] = {done, done ? result : 0, used};
+        return done;
+    }
+
+    double ConstantEvaluator::call(const std::string &name, const std::vector<double> &args)
+    {
+        const FunctionEffects *result = effects.lookup(name);
+        FuncDefAST *def = lookup(name);
+        if (!def || !result || result->memory != FunctionEffects::Pure || def->isFast() ||
+            def->getArgs().size() != args.size())
+            giveUp();
+        auto known = results.find({name, bits(args)});
+        if (known != results.end()) {
+            if (!known->second.first)
+                giveUp();
+            return known->second.second;
+        }
+        if (++depth > budget.depth)
+            giveUp();
+
+        std::map<std::string, double> frame;
+        auto params = def->getArgs();
+        for (size_t i = 0; i < params.size(); i++) {
+            if (params[i]->getType() != ASTType::NAME)
+                giveUp();
+            frame[static_cast<NameAST *>(params[i].get())->toString()] = args[i];
+        }
+        std::map<std::string, double> *callerVars = vars;
+        vars = &frame;
+        eval(def->getBod());
+        vars = callerVars;
+        depth--;
+
+        results[{name, bits(args)}] = {true, value};
+        return value;
+    }
+
+    void ConstantEvaluator::eval(AST *node)
+    {
+        if (!node || ++steps > stepLimit)
+            giveUp();
+        node->accept(this);
+    }
+
+    void ConstantEvaluator::giveUp()
+    {
+        throw GiveUp();
+    }
+
+    std::vector<uint64_t> ConstantEvaluator::bits(const std::vector<double> &args)
+    {
+        // Keyed on the bits, so -0.0 and NaN are arguments like any other
+        std::vector<uint64_t> key(args.size());
+        for (size_t i = 0; i < args.size(); i++)
+            std::memcpy(&key[i], &args[i], sizeof(double));
+        return key;
+    }
+
+    void ConstantEvaluator::power(double base, bool constBase, double exponent, bool constExponent)
+    {
+        // Code generation turns small constant exponents from -1 up into multiplies by repeated squaring
+        if (constExponent && std::trunc(exponent) == exponent && exponent >= -1 && exponent <= maxPowMultiplies) {
+            int n = (int)exponent;
+            constant = constBase || n == 0;
+            if (n == 0) {
+                value = 1.0;
+                return;
+            }
+            double result = 0, square = base;
+            bool first = true;
+            for (unsigned bits = std::abs(n); bits; bits >>= 1) {
+                if (bits & 1) {
+                    result = first ? square : result * square;
+                    first = false;
+                }
+                if (bits > 1)
+                    square = square * square;
+            }
+            value = n < 0 ? 1.0 / result : result;
+            return;
+        }
+        libmPower(base, exponent);
+    }
+
+    void ConstantEvaluator::libmPower(double base, double exponent)
+    {
+        // LLVM rewrites llvm.pow as x*x, 1/x, sqrt or exp2 when it can see these values, and those can round
+        // differently
+        int baseExponent;
+        bool powerOfTwo = base > 0 && std::frexp(base, &baseExponent) == 0.5;
+        if (!inexactMath || exponent == 2 || exponent == -1 || std::abs(exponent) == 0.5 || powerOfTwo)
+            giveUp();
+        value = std::pow(base, exponent);
+        constant = false;
+    }
+
+    void ConstantEvaluator::visit(BlockAST *node)
+    {
+        // A block evaluates to its last statement
+        if (node->getChildren().empty())
+            giveUp();
+        for (const auto &stmt : node->getChildren())
+            eval(stmt.get());
+    }
+
+    void ConstantEvaluator::visit(NumberAST *node)
+    {
+        value = node->getVal();
+        constant = true;
+    }
+
+    void ConstantEvaluator::visit(NameAST *node)
+    {
+        auto var = vars->find(node->toString());
+        if (var == vars->end())
+            giveUp();
+        value = var->second;
+        constant = false;
+    }
+
+    void ConstantEvaluator::visit(ArrayAST *node)
+    {
+        giveUp();
+    }
+
+    void ConstantEvaluator::visit(AssignmentAST *node)
+    {
+        // An assignment evaluates to its right hand side
+        if (node->getName()->getType() != ASTType::NAME)
+            giveUp();
+        eval(node->getRhs());
+        (*vars)[static_cast<NameAST *>(node->getName())->toString()] = value;
+    }
+
+    void ConstantEvaluator::visit(FuncCallAST *node)
+    {
+        if (node->getName()->getType() != ASTType::NAME)
+            giveUp();
+        std::string name = static_cast<NameAST *>(node->getName())->toString();
+        std::vector<double> args;
+        std::vector<bool> constArgs;
+        for (const auto &arg : node->getArgs()) {
+            eval(arg.get());
+            args.push_back(value);
+            constArgs.push_back(constant);
+        }
+
+        // Math functions, which are intrinsics unless the program defines its own
+        auto ext = externals.find(name);
+        if (!lookup(name) && ext != externals.end() && ext->second == args.size()) {
+            const FunctionEffects *result = effects.lookup(name);
+            if (!result || result->memory != FunctionEffects::Pure)
+                giveUp();
+            if (name == "pow" && args.size() == 2) {
+                libmPower(args[0], args[1]);
+                return;
+            }
+            for (const auto &math : mathFunctions) {
+                if (name != math.name || args.size() != math.args)
+                    continue;
+                if (!math.exact && !inexactMath)
+                    giveUp();
+                // Whether fmin and fmax give -0.0 or +0.0 for a pair of zeroes is up to the implementation
+                if ((name == "fmin" || name == "fmax") && args[0] == 0 && args[1] == 0 &&
+                    std::signbit(args[0]) != std::signbit(args[1]))
+                    giveUp();
+                value = math.eval(args.data());
+                constant = false;
+                return;
+            }
+            giveUp();
+        }
+
+        // Code generation evaluates calls with constant arguments too, so their results are constants
+        value = call(name, args);
+        constant = true;
+        for (bool arg : constArgs)
+            constant = constant && arg;
+    }
+
+    void ConstantEvaluator::visit(BinaryOpAST *node)
+    {
+        TokenType op = node->getOp();
+        SideEffectChecker sideEffects;
+
+        // && and || only skip their rhs if it has side effects.  Otherwise both sides are evaluated and selected
+        // between, which gives a constant if both sides are
+        if (op == AND || op == OR) {
+            eval(node->getLhs());
+            bool lhs = isTrue(value), constLhs = constant;
+            if (sideEffects.check(node->getRhs())) {
+                if (lhs == (op == AND)) {
+                    eval(node->getRhs());
+                    lhs = isTrue(value);
+                }
+                value = lhs;
+                constant = false;
+                return;
+            }
+            eval(node->getRhs());
+            bool rhs = isTrue(value);
+            value = op == AND ? lhs && rhs : lhs || rhs;
+            constant = constLhs && constant;
+            return;
+        }
+
+        eval(node->getLhs());
+        double lhs = value;
+        bool constLhs = constant;
+        eval(node->getRhs());
+        double rhs = value;
+        bool constRhs = constant;
+        constant = constLhs && constRhs;
+
+        // Comparisons are unordered, so they are true if either side is NaN
+        switch (op) {
+            case PLUS:
+                value = lhs + rhs;
+                break;
+            case MINUS:
+                value = lhs - rhs;
+                break;
+            case STAR:
+                value = lhs * rhs;
+                break;
+            case SLASH:
+                value = lhs / rhs;
+                break;
+            case MOD:
+                value = std::fmod(lhs, rhs);
+                break;
+            case HAT:
+                power(lhs, constLhs, rhs, constRhs);
+                break;
+            case LESS:
+                value = !(lhs >= rhs);
+                break;
+            case GREATER:
+                value = !(lhs <= rhs);
+                break;
+            case EQ:
+                value = !(lhs < rhs || lhs > rhs);
+                break;
+            case NEQ:
+                value = lhs != rhs;
+                break;
+            case GREQ:
+                value = !(lhs < rhs);
+                break;
+            case LEQ:
+                value = !(lhs > rhs);
+                break;
+            default:
+                giveUp();
+        }
+    }
+
+    void ConstantEvaluator::visit(UnaryOpAST *node)
+    {
+        eval(node->getOperand());
+        switch (node->getOp()) {
+            case NOT:
+                value = !isTrue(value);
+                break;
+            case INC:
+                value = value + 1.0;
+                break;
+            case DEC:
+                value = value - 1.0;
+                break;
+            case MINUS:
+                // Generated as 0 - x, so -(0.0) is 0.0
+                value = 0.0 - value;
+                break;
+            default:
+                giveUp();
+        }
+    }
+
+    void ConstantEvaluator::visit(TernaryOpAST *node)
+    {
+        eval(node->getCond());
+        bool cond = isTrue(value), constCond = constant;
+
+        // Arms without side effects are both evaluated and selected between, like code generation does
+        SideEffectChecker sideEffects;
+        if (!sideEffects.check(node->getThen()) && !sideEffects.check(node->getElse())) {
+            eval(node->getThen());
+            double thenVal = value;
+            bool constThen = constant;
+            eval(node->getElse());
+            value = cond ? thenVal : value;
+            constant = constCond && constThen && constant;
+            return;
+        }
+        eval(cond ? node->getThen() : node->getElse());
+        constant = false;
+    }
+
+    void ConstantEvaluator::visit(IfAST *node)
+    {
+        // Without an ELSE the IF is 0.0 when the condition is false
+        eval(node->getCond());
+        if (isTrue(value))
+            eval(node->getThen());
+        else if (node->getElse())
+            eval(node->getElse());
+        else
+            value = 0.0;
+        constant = false;
+    }
+
+    void ConstantEvaluator::visit(ForAST *node)
+    {
+        // The body runs before the condition is first checked
+        eval(node->getStart());
+        std::string var = node->getVarName();
+        auto outer = vars->find(var);
+        bool shadows = outer != vars->end();
+        double outerVal = shadows ? outer->second : 0;
+
+        (*vars)[var] = value;
+        do {
+            eval(node->getBody());
+            double step = 1.0;
+            if (node->getStep()) {
+                eval(node->getStep());
+                step = value;
+            }
+            (*vars)[var] = (*vars)[var] + step;
+            eval(node->getEnd());
+        } while (isTrue(value));
+
+        if (shadows)
+            (*vars)[var] = outerVal;
+        else
+            vars->erase(var);
+        value = 0.0;
+        constant = true;
+    }
+
+    void ConstantEvaluator::visit(FuncDefAST *node)
+    {
+        giveUp();
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,100 @@
+#pragma once
+#ifndef COMPILER_EVALUATOR_H
+#define COMPILER_EVALUATOR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "AST.h"
+#include "analysis.h"
+
+namespace Compiler {
+
+    // Largest constant exponent code generation turns into multiplies.  Squaring means this is at most 10 of them
+    static const int maxPowMultiplies = 32;
+
+    // Limits on compile time evaluation.  Both are counts rather than times, so whether a call is evaluated only depends
+    // on the program and the options, and the object file is the same on a busy machine
+    struct EvalBudget {
+        // Expressions evaluated for a single call, including everything it calls
+        unsigned long steps = 1000000;
+        // Expressions evaluated for all the calls in one function being generated
+        unsigned long functionSteps = 4000000;
+        // Nested calls, which use the compiler's own stack
+        unsigned depth = 200;
+    };
+
+    // Runs calls to pure SIMPLE functions at compile time, so calls with constant arguments can become constants.
+    // Every operation gives exactly the double the generated code would: comparisons are true for NaN, conditions are
+    // false for NaN, and small powers with a constant exponent are the same chain of multiplies.  Anything whose
+    // result could depend on how the optimiser treats it, like FAST functions or pow with an exponent LLVM rewrites,
+    // makes the evaluator give up
+    class ConstantEvaluator : public Visitor {
+    public:
+        explicit ConstantEvaluator(const EffectAnalysis &effects) : effects(effects) {};
+
+        // Find the functions in a program.  inexactMath allows math functions like sin whose results can differ
+        // from the generated code's, which they can when loops call a vector math library instead
+        void addProgram(BlockAST *program, bool inexactMath, const EvalBudget &budget);
+        // Start on the calls in another function, with a fresh budget
+        void beginFunction() { functionStepsUsed = 0; };
+        // Evaluate a call to a function.  Returns false if it can't be done exactly within the budget
+        bool evaluate(const std::string &name, const std::vector<double> &args, double &result);
+        // Definition of a function with a body, or nullptr
+        FuncDefAST *lookup(const std::string &name) const;
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override;
+        void visit(NameAST* node) override;
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override;
+        void visit(UnaryOpAST* node) override;
+        void visit(TernaryOpAST* node) override;
+        void visit(IfAST* node) override;
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override;
+
+    private:
+        const EffectAnalysis &effects;
+        // Functions with bodies, and EXT declarations
+        std::map<std::string, FuncDefAST *> definitions;
+        std::map<std::string, size_t> externals;
+        bool inexactMath = false;
+        EvalBudget budget;
+        // Results of the calls code generation asked for, and the steps they took.  Failures are remembered too, so a
+        // call that is too expensive is only tried once
+        struct Outcome {
+            bool done;
+            double value;
+            unsigned long steps;
+        };
+        std::map<std::pair<std::string, std::vector<uint64_t>>, Outcome> calls;
+        unsigned long functionStepsUsed = 0;
+        // Results of the calls made while evaluating one of those.  Starting each one afresh means the steps it takes
+        // don't depend on which calls were evaluated before it, which incremental builds can skip
+        std::map<std::pair<std::string, std::vector<uint64_t>>, std::pair<bool, double>> results;
+
+        // Variables of the function being run
+        std::map<std::string, double> *vars = nullptr;
+        unsigned long steps = 0, stepLimit = 0;
+        unsigned depth = 0;
+        // Value of the last expression, and whether code generation would have made it a constant.  That decides
+        // whether a power is generated as multiplies
+        double value = 0;
+        bool constant = false;
+
+        void eval(AST *node);
+        double call(const std::string &name, const std::vector<double> &args);
+        // Set value to base ^ exponent the way code generation would work it out
+        void power(double base, bool constBase, double exponent, bool constExponent);
+        // Set value to what a call to llvm.pow gives
+        void libmPower(double base, double exponent);
+        void giveUp();
+        static std::vector<uint64_t> bits(const std::vector<double> &args);
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_EVALUATOR_H
@@ -0,0 +1,144 @@
+#include "fingerprint.h"
+#include <cstdint>
+#include <cstring>
+
+namespace Compiler {
+
+    void Fingerprinter::print(AST *tree)
+    {
+        text.clear();
+        callees.clear();
+        child(tree);
+    }
+
+    // Length prefixed so names can't run into the next token
+    void Fingerprinter::name(const std::string &str)
+    {
+        text += std::to_string(str.size()) + ":" + str;
+    }
+
+    // Optional children are printed as '-'
+    void Fingerprinter::child(AST *node)
+    {
+        if (node)
+            node->accept(this);
+        else
+            text += "-";
+    }
+
+    void Fingerprinter::visit(BlockAST *node)
+    {
+        auto children = node->getChildren();
+        text += (node->isRegion() ? "R" : "B") + std::to_string(children.size()) + "{";
+        for (const auto &stmt : children)
+            child(stmt.get());
+        text += "}";
+    }
+
+    void Fingerprinter::visit(NumberAST *node)
+    {
+        // Use the bit pattern so every distinct double prints differently
+        double val = node->getVal();
+        uint64_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        text += "N" + std::to_string(bits) + ";";
+    }
+
+    void Fingerprinter::visit(NameAST *node)
+    {
+        text += "V";
+        name(node->toString());
+    }
+
+    void Fingerprinter::visit(ArrayAST *node)
+    {
+        text += "A(";
+        child(node->getName());
+        text += std::to_string(node->values.size());
+        for (const auto &val : node->values)
+            child(val.get());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(AssignmentAST *node)
+    {
+        text += "=(";
+        child(node->getName());
+        child(node->getRhs());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(FuncCallAST *node)
+    {
+        auto args = node->getArgs();
+        text += "C(";
+        child(node->getName());
+        if (node->getName()->getType() == ASTType::NAME)
+            callees.insert(static_cast<NameAST *>(node->getName())->toString());
+        text += std::to_string(args.size());
+        for (const auto &arg : args)
+            child(arg.get());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(BinaryOpAST *node)
+    {
+        text += "O" + std::to_string(node->getOp()) + "(";
+        child(node->getLhs());
+        child(node->getRhs());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(UnaryOpAST *node)
+    {
+        text += "U" + std::to_string(node->getOp()) + "(";
+        child(node->getOperand());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(TernaryOpAST *node)
+    {
+        text += "?(";
+        child(node->getCond());
+        child(node->getThen());
+        child(node->getElse());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(IfAST *node)
+    {
+        text += "I(";
+        child(node->getCond());
+        child(node->getThen());
+        child(node->getElse());
+        text += ")";
+    }
+
+    void Fingerprinter::visit(ForAST *node)
+    {
+        text += "L";
+        name(node->getVarName());
+        text += "(";
+        child(node->getStart());
+        child(node->getEnd());
+        child(node->getStep());
+        child(node->getBody());
+        text += "U" + std::to_string(node->getUnroll()) + "V" + std::to_string(node->getVectorize()) + ")";
+    }
+
+    void Fingerprinter::visit(FuncDefAST *node)
+    {
+        auto args = node->getArgs();
+        text += node->isExt() ? "X" : "D";
+        text += node->isFast() ? "F" : "";
+        text += node->isExport() ? "E" : "";
+        text += node->isMemo() ? "M(" : "(";
+        child(node->getName());
+        text += std::to_string(args.size());
+        for (const auto &arg : args)
+            child(arg.get());
+        child(node->getBod());
+        text += ")";
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef COMPILER_FINGERPRINT_H
+#define COMPILER_FINGERPRINT_H
+
+#include <set>
+#include <string>
+#include "AST.h"
+
+namespace Compiler {
+
+    // Serialises a tree into a canonical string.  Layout, comments and anything else the parser throws away don't
+    // appear, so two functions with the same string always generate the same code.  Names of called functions are
+    // collected so their signatures can be folded into the fingerprint too.
+    class Fingerprinter : public Visitor {
+        std::string text;
+        std::set<std::string> callees;
+
+        void name(const std::string &str);
+        void child(AST *node);
+    public:
+        // Serialise a tree, replacing anything from a previous call
+        void print(AST *tree);
+        const std::string &getText() { return text; };
+        const std::set<std::string> &getCallees() { return callees; };
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override;
+        void visit(NameAST* node) override;
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override;
+        void visit(UnaryOpAST* node) override;
+        void visit(TernaryOpAST* node) override;
+        void visit(IfAST* node) override;
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override;
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_FINGERPRINT_H
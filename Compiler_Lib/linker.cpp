@@ -0,0 +1,654 @@
+#include "linker.h"
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/Object/Archive.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#ifdef __linux__
+#include <dlfcn.h>
+#endif
+
+namespace Compiler {
+
+    // Where the executable is loaded, the same as the system linker uses for non-PIE executables
+    static const uint64_t imageBase = 0x400000;
+    static const uint64_t pageSize = 0x1000;
+    static const char interpreter[] = "/lib64/ld-linux-x86-64.so.2";
+
+    // Header, interpreter, read-only, code, data, dynamic and stack
+    static const unsigned programHeaders = 7;
+
+    // The entry point does what crt1.o does: pass main, argc, argv and the dynamic linker's exit hook to
+    // __libc_start_main, which runs constructors, calls main and exits with its result.  The two 32 bit fields are the
+    // offsets of main and of __libc_start_main's GOT entry
+    static const uint8_t startCode[] = {
+        0x31, 0xed,                          // xor %ebp, %ebp
+        0x49, 0x89, 0xd1,                    // mov %rdx, %r9
+        0x5e,                                // pop %rsi
+        0x48, 0x89, 0xe2,                    // mov %rsp, %rdx
+        0x48, 0x83, 0xe4, 0xf0,              // and $-16, %rsp
+        0x50,                                // push %rax
+        0x54,                                // push %rsp
+        0x45, 0x31, 0xc0,                    // xor %r8d, %r8d
+        0x31, 0xc9,                          // xor %ecx, %ecx
+        0x48, 0x8d, 0x3d, 0, 0, 0, 0,        // lea main(%rip), %rdi
+        0xff, 0x15, 0, 0, 0, 0,              // call *__libc_start_main@GOT(%rip)
+        0xf4,                                // hlt
+    };
+    static const size_t startMain = 23, startLibcMain = 29;
+
+    // Each PLT entry jumps through the import's GOT entry, which the dynamic linker fills in at load time
+    static const uint8_t pltCode[] = {
+        0xff, 0x25, 0, 0, 0, 0,              // jmp *symbol@GOT(%rip)
+        0x66, 0x90,                          // nop
+    };
+    static const size_t pltEntrySize = sizeof(pltCode);
+
+    static uint64_t alignTo(uint64_t value, uint64_t align)
+    {
+        return align > 1 ? (value + align - 1) / align * align : value;
+    }
+
+    template<typename T>
+    static T check(Expected<T> value, StringRef file)
+    {
+        if (!value)
+            throw std::runtime_error("Linker: " + file.str() + ": " + toString(value.takeError()));
+        return std::move(*value);
+    }
+
+    template<typename T>
+    static void write(std::vector<char> &image, uint64_t offset, const T &value)
+    {
+        std::memcpy(image.data() + offset, &value, sizeof(T));
+    }
+
+    bool Linker::unsupported(const std::string &why)
+    {
+        if (reason.empty())
+            reason = why;
+        return false;
+    }
+
+    Linker::Symbol &Linker::symbol(StringRef name)
+    {
+        Symbol &sym = symbols[name.str()];
+        sym.name = name.str();
+        return sym;
+    }
+
+    void Linker::addObject(MemoryBufferRef object)
+    {
+        load(object);
+    }
+
+    void Linker::addArchive(MemoryBufferRef archive)
+    {
+        auto parsed = check(object::Archive::create(archive), archive.getBufferIdentifier());
+        Error err = Error::success();
+        for (const auto &child : parsed->children(err))
+            members.push_back(check(child.getMemoryBufferRef(), archive.getBufferIdentifier()));
+        if (err)
+            throw std::runtime_error("Linker: " + archive.getBufferIdentifier().str() + ": " + toString(std::move(err)));
+    }
+
+    void Linker::addLibrary(const std::string &soname)
+    {
+        libraries.push_back(soname);
+    }
+
+    void Linker::load(MemoryBufferRef object)
+    {
+        StringRef name = object.getBufferIdentifier();
+        ELFFile elf = check(ELFFile::create(object.getBuffer()), name);
+        if (elf.getHeader().e_machine != ELF::EM_X86_64 || elf.getHeader().e_type != ELF::ET_REL) {
+            unsupported(name.str() + " isn't an x86-64 relocatable object");
+            return;
+        }
+
+        size_t file = inputs.size();
+        inputs.push_back({name.str(), std::move(elf)});
+        Input &input = inputs.back();
+        auto headers = check(input.elf.sections(), name);
+        input.sections.assign(headers.size(), -1);
+
+        for (size_t i = 0; i < headers.size(); i++) {
+            const Shdr &header = headers[i];
+            if (header.sh_type == ELF::SHT_SYMTAB)
+                input.symtab = &header;
+            if (!(header.sh_flags & ELF::SHF_ALLOC))
+                continue;
+            StringRef sectionName = check(input.elf.getSectionName(header), name);
+            if (header.sh_flags & ELF::SHF_TLS) {
+                unsupported(name.str() + " has thread local storage");
+                continue;
+            }
+
+            // Unwind tables are only needed by exceptions, which SIMPLE doesn't have
+            Kind kind;
+            if (header.sh_type == ELF::SHT_NOTE || header.sh_type == ELF::SHT_X86_64_UNWIND ||
+                sectionName.startswith(".eh_frame"))
+                continue;
+            else if (header.sh_type == ELF::SHT_INIT_ARRAY || sectionName.startswith(".ctors"))
+                kind = Kind::InitArray;
+            else if (header.sh_type == ELF::SHT_FINI_ARRAY || sectionName.startswith(".dtors"))
+                kind = Kind::FiniArray;
+            else if (header.sh_type == ELF::SHT_NOBITS)
+                kind = Kind::Bss;
+            else if (header.sh_type != ELF::SHT_PROGBITS) {
+                unsupported(name.str() + " has a " + sectionName.str() + " section");
+                continue;
+            } else if (header.sh_flags & ELF::SHF_EXECINSTR)
+                kind = Kind::Text;
+            else if (header.sh_flags & ELF::SHF_WRITE)
+                kind = Kind::Data;
+            else
+                kind = Kind::ReadOnly;
+
+            input.sections[i] = static_cast<int>(sections.size());
+            sections.push_back({file, &header, sectionName, kind, header.sh_size, header.sh_addralign});
+        }
+
+        if (!input.symtab)
+            return;
+        auto syms = check(input.elf.symbols(input.symtab), name);
+        StringRef strtab = check(input.elf.getStringTableForSymtab(*input.symtab), name);
+        input.globals.assign(syms.size(), nullptr);
+        for (size_t i = 1; i < syms.size(); i++) {
+            const auto &sym = syms[i];
+            if (sym.getBinding() == ELF::STB_LOCAL)
+                continue;
+            Symbol &global = symbol(check(sym.getName(strtab), name));
+            input.globals[i] = &global;
+            bool weak = sym.getBinding() == ELF::STB_WEAK;
+
+            if (sym.st_shndx == ELF::SHN_UNDEF) {
+                global.referenced = true;
+                global.required |= !weak;
+            } else if (sym.st_shndx == ELF::SHN_COMMON) {
+                global.commonSize = std::max<uint64_t>(global.commonSize, sym.st_size);
+                global.commonAlign = std::max<uint64_t>(global.commonAlign, sym.st_value);
+            } else if (sym.st_shndx >= ELF::SHN_LORESERVE && sym.st_shndx != ELF::SHN_ABS) {
+                unsupported(name.str() + " has symbols in extended sections");
+            } else if (global.section == ELF::SHN_UNDEF || (global.weak && !weak)) {
+                global.file = file;
+                global.section = sym.st_shndx;
+                global.value = sym.st_value;
+                global.weak = weak;
+            } else if (!global.weak && !weak) {
+                throw std::runtime_error("Linker: Duplicate definition of '" + global.name + "' in " + name.str());
+            }
+        }
+    }
+
+    // Whether an archive member defines a symbol that is referenced but not yet defined
+    static bool definesNeeded(MemoryBufferRef member, const std::map<std::string, bool> &needed)
+    {
+        object::ELF64LEFile elf = check(object::ELF64LEFile::create(member.getBuffer()),
+                                        member.getBufferIdentifier());
+        for (const auto &header : check(elf.sections(), member.getBufferIdentifier())) {
+            if (header.sh_type != ELF::SHT_SYMTAB)
+                continue;
+            StringRef strtab = check(elf.getStringTableForSymtab(header), member.getBufferIdentifier());
+            for (const auto &sym : check(elf.symbols(&header), member.getBufferIdentifier())) {
+                if (sym.getBinding() == ELF::STB_LOCAL || sym.st_shndx == ELF::SHN_UNDEF ||
+                    sym.st_shndx == ELF::SHN_COMMON)
+                    continue;
+                if (needed.count(check(sym.getName(strtab), member.getBufferIdentifier()).str()))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    void Linker::resolveShared()
+    {
+#ifdef __linux__
+        std::vector<void *> handles;
+        for (const auto &library : libraries) {
+            void *handle = dlopen(library.c_str(), RTLD_LAZY | RTLD_LOCAL);
+            if (!handle) {
+                unsupported("can't load " + library);
+                return;
+            }
+            handles.push_back(handle);
+        }
+
+        for (auto &entry : symbols) {
+            Symbol &sym = entry.second;
+            if (!sym.referenced || sym.section != ELF::SHN_UNDEF || sym.commonSize)
+                continue;
+            for (void *handle : handles) {
+                if (dlsym(handle, sym.name.c_str())) {
+                    sym.shared = true;
+                    sym.dynamic = static_cast<unsigned>(imports.size() + 1);
+                    imports.push_back(&sym);
+                    break;
+                }
+            }
+            if (!sym.shared && sym.required)
+                throw std::runtime_error("Linker: Undefined reference to '" + sym.name + "'");
+        }
+#else
+        unsupported("shared libraries can only be found on Linux");
+#endif
+    }
+
+    bool Linker::scanRelocations()
+    {
+        for (auto &input : inputs) {
+            for (const auto &header : check(input.elf.sections(), input.name)) {
+                if (header.sh_type == ELF::SHT_REL && input.sections[header.sh_info] >= 0)
+                    return unsupported(input.name + " has REL relocations");
+                if (header.sh_type != ELF::SHT_RELA || input.sections[header.sh_info] < 0)
+                    continue;
+
+                for (const auto &rela : check(input.elf.relas(header), input.name)) {
+                    Symbol *sym = input.globals.empty() ? nullptr : input.globals[rela.getSymbol(false)];
+                    switch (rela.getType(false)) {
+                        case ELF::R_X86_64_NONE:
+                            break;
+                        case ELF::R_X86_64_64:
+                        case ELF::R_X86_64_32:
+                        case ELF::R_X86_64_32S:
+                        case ELF::R_X86_64_PC32:
+                        case ELF::R_X86_64_PC64:
+                            // Shared data would need copying into the executable, and its address isn't known
+                            if (sym && sym->shared)
+                                return unsupported("direct reference to shared symbol " + sym->name);
+                            break;
+                        case ELF::R_X86_64_PLT32:
+                            if (sym && sym->shared && sym->plt < 0) {
+                                sym->plt = static_cast<int>(plt.size());
+                                plt.push_back(sym);
+                            }
+                            break;
+                        case ELF::R_X86_64_GOTPCREL:
+                        case ELF::R_X86_64_GOTPCRELX:
+                        case ELF::R_X86_64_REX_GOTPCRELX:
+                            if (!sym || !sym->shared)
+                                return unsupported("GOT reference to a symbol in the executable in " + input.name);
+                            if (sym->got < 0) {
+                                sym->got = static_cast<int>(got.size());
+                                got.push_back(sym);
+                            }
+                            break;
+                        default:
+                            return unsupported("relocation type " + std::to_string(rela.getType(false)) + " in " +
+                                               input.name);
+                    }
+                }
+            }
+        }
+
+        // Every PLT entry jumps through a GOT entry
+        for (Symbol *sym : plt) {
+            if (sym->got < 0) {
+                sym->got = static_cast<int>(got.size());
+                got.push_back(sym);
+            }
+        }
+        return true;
+    }
+
+    uint64_t Linker::symbolAddress(const Input &input, uint32_t index)
+    {
+        if (const Symbol *global = input.globals[index])
+            return global->address;
+        const auto &sym = check(input.elf.symbols(input.symtab), input.name)[index];
+        if (sym.st_shndx == ELF::SHN_ABS)
+            return sym.st_value;
+        if (sym.st_shndx >= input.sections.size() || input.sections[sym.st_shndx] < 0)
+            return 0;
+        return sections[input.sections[sym.st_shndx]].address + sym.st_value;
+    }
+
+    bool Linker::relocate(std::vector<char> &image, uint64_t gotAddress)
+    {
+        for (auto &input : inputs) {
+            for (const auto &header : check(input.elf.sections(), input.name)) {
+                if (header.sh_type != ELF::SHT_RELA || input.sections[header.sh_info] < 0)
+                    continue;
+                const Section &target = sections[input.sections[header.sh_info]];
+
+                for (const auto &rela : check(input.elf.relas(header), input.name)) {
+                    uint32_t index = rela.getSymbol(false);
+                    const Symbol *sym = input.globals.empty() ? nullptr : input.globals[index];
+                    uint64_t place = target.address + rela.r_offset;
+                    uint64_t offset = place - imageBase;
+                    int64_t addend = rela.r_addend;
+                    uint64_t value = symbolAddress(input, index);
+                    if (sym && sym->shared)
+                        value = sym->address;
+
+                    int64_t relative;
+                    switch (rela.getType(false)) {
+                        case ELF::R_X86_64_NONE:
+                            break;
+                        case ELF::R_X86_64_64:
+                            write(image, offset, value + addend);
+                            break;
+                        case ELF::R_X86_64_PC64:
+                            write(image, offset, value + addend - place);
+                            break;
+                        case ELF::R_X86_64_32:
+                            if (value + addend > UINT32_MAX)
+                                return unsupported("relocation out of range in " + input.name);
+                            write(image, offset, static_cast<uint32_t>(value + addend));
+                            break;
+                        case ELF::R_X86_64_32S:
+                            relative = static_cast<int64_t>(value + addend);
+                            if (relative != static_cast<int32_t>(relative))
+                                return unsupported("relocation out of range in " + input.name);
+                            write(image, offset, static_cast<int32_t>(relative));
+                            break;
+                        case ELF::R_X86_64_GOTPCREL:
+                        case ELF::R_X86_64_GOTPCRELX:
+                        case ELF::R_X86_64_REX_GOTPCRELX:
+                            value = gotAddress + 8 * sym->got;
+                            // Fall through
+                        default:
+                            relative = static_cast<int64_t>(value + addend - place);
+                            if (relative != static_cast<int32_t>(relative))
+                                return unsupported("relocation out of range in " + input.name);
+                            write(image, offset, static_cast<int32_t>(relative));
+                            break;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    bool Linker::link(const std::string &output)
+    {
+        // The entry point needs these
+        symbol("main").referenced = symbol("main").required = true;
+        symbol("__libc_start_main").referenced = symbol("__libc_start_main").required = true;
+
+        // Keep pulling in archive members while they define something needed, since members can need each other
+        std::vector<bool> loaded(members.size());
+        for (bool changed = true; changed && reason.empty();) {
+            changed = false;
+            std::map<std::string, bool> needed;
+            for (const auto &entry : symbols) {
+                if (entry.second.referenced && entry.second.section == ELF::SHN_UNDEF && !entry.second.commonSize)
+                    needed[entry.first] = true;
+            }
+            for (size_t i = 0; i < members.size() && !needed.empty(); i++) {
+                if (!loaded[i] && definesNeeded(members[i], needed)) {
+                    load(members[i]);
+                    loaded[i] = changed = true;
+                }
+            }
+        }
+        if (!reason.empty())
+            return false;
+
+        // crtbegin.o defines __dso_handle, which glibc's atexit passes on to __cxa_atexit.  In an executable it's null
+        Symbol &dsoHandle = symbol("__dso_handle");
+        if (dsoHandle.referenced && dsoHandle.section == ELF::SHN_UNDEF && !dsoHandle.commonSize)
+            dsoHandle.commonSize = dsoHandle.commonAlign = 8;
+
+        // Common symbols nobody defined get zeroed space of their own
+        for (auto &entry : symbols) {
+            Symbol &sym = entry.second;
+            if (sym.commonSize && sym.section == ELF::SHN_UNDEF) {
+                sym.common = static_cast<int>(sections.size());
+                sections.push_back({0, nullptr, "COMMON", Kind::Bss, sym.commonSize, sym.commonAlign});
+            }
+        }
+
+        // Linkers define the GOT's address, which position independent code can mention
+        Symbol &gotSymbol = symbol("_GLOBAL_OFFSET_TABLE_");
+        bool defineGot = gotSymbol.section == ELF::SHN_UNDEF;
+        if (defineGot)
+            gotSymbol.section = ELF::SHN_ABS;
+
+        resolveShared();
+        if (!reason.empty() || !scanRelocations())
+            return false;
+        Symbol &libcMain = symbol("__libc_start_main");
+        if (!libcMain.shared)
+            return unsupported("__libc_start_main isn't in a shared library");
+        if (libcMain.got < 0) {
+            libcMain.got = static_cast<int>(got.size());
+            got.push_back(&libcMain);
+        }
+
+        // Dynamic string table: library names, then imported symbols
+        std::string dynstr(1, '\0');
+        std::vector<uint32_t> neededNames, importNames;
+        for (const auto &library : libraries) {
+            neededNames.push_back(static_cast<uint32_t>(dynstr.size()));
+            dynstr += library + '\0';
+        }
+        for (const Symbol *sym : imports) {
+            importNames.push_back(static_cast<uint32_t>(dynstr.size()));
+            dynstr += sym->name + '\0';
+        }
+        size_t dynsymCount = imports.size() + 1;
+
+        auto sectionsOf = [&](Kind kind) {
+            std::vector<Section *> result;
+            for (auto &section : sections) {
+                if (section.kind == kind)
+                    result.push_back(&section);
+            }
+            return result;
+        };
+        auto place = [&](uint64_t &address, Kind kind) {
+            for (Section *section : sectionsOf(kind)) {
+                address = alignTo(address, section->align);
+                section->address = address;
+                address += section->size;
+            }
+        };
+
+        // Read-only segment: headers, dynamic linking tables and constants.  Every segment starts on a new page, and
+        // file offsets are addresses less the image base
+        uint64_t address = imageBase + sizeof(ELF::Elf64_Ehdr) + programHeaders * sizeof(ELF::Elf64_Phdr);
+        uint64_t interpAddress = address;
+        address = alignTo(address + sizeof(interpreter), 8);
+        uint64_t hashAddress = address;
+        address = alignTo(address + 4 * (2 + 1 + dynsymCount), 8);
+        uint64_t dynsymAddress = address;
+        address += sizeof(ELF::Elf64_Sym) * dynsymCount;
+        uint64_t dynstrAddress = address;
+        address = alignTo(address + dynstr.size(), 8);
+        uint64_t relaAddress = address;
+        address += sizeof(ELF::Elf64_Rela) * got.size();
+        place(address, Kind::ReadOnly);
+        uint64_t readOnlyEnd = address;
+
+        // Code segment: the entry point, PLT and code
+        address = alignTo(address, pageSize);
+        uint64_t textStart = address;
+        uint64_t startAddress = address;
+        address = alignTo(address + sizeof(startCode), 16);
+        uint64_t pltAddress = address;
+        address += pltEntrySize * plt.size();
+        place(address, Kind::Text);
+        uint64_t textEnd = address;
+
+        // Data segment: constructors, the dynamic section, GOT, data, then zeroed data which takes no space in the file
+        address = alignTo(address, pageSize);
+        uint64_t dataStart = address;
+        uint64_t initArray = address;
+        place(address, Kind::InitArray);
+        uint64_t initArraySize = address - initArray;
+        address = alignTo(address, 8);
+        uint64_t finiArray = address;
+        place(address, Kind::FiniArray);
+        uint64_t finiArraySize = address - finiArray;
+
+        std::vector<std::pair<int64_t, uint64_t>> dynamic;
+        for (uint32_t name : neededNames)
+            dynamic.push_back({ELF::DT_NEEDED, name});
+        dynamic.push_back({ELF::DT_HASH, hashAddress});
+        dynamic.push_back({ELF::DT_STRTAB, dynstrAddress});
+        dynamic.push_back({ELF::DT_SYMTAB, dynsymAddress});
+        dynamic.push_back({ELF::DT_STRSZ, dynstr.size()});
+        dynamic.push_back({ELF::DT_SYMENT, sizeof(ELF::Elf64_Sym)});
+        dynamic.push_back({ELF::DT_RELA, relaAddress});
+        dynamic.push_back({ELF::DT_RELASZ, sizeof(ELF::Elf64_Rela) * got.size()});
+        dynamic.push_back({ELF::DT_RELAENT, sizeof(ELF::Elf64_Rela)});
+        if (initArraySize) {
+            dynamic.push_back({ELF::DT_INIT_ARRAY, initArray});
+            dynamic.push_back({ELF::DT_INIT_ARRAYSZ, initArraySize});
+        }
+        if (finiArraySize) {
+            dynamic.push_back({ELF::DT_FINI_ARRAY, finiArray});
+            dynamic.push_back({ELF::DT_FINI_ARRAYSZ, finiArraySize});
+        }
+        dynamic.push_back({ELF::DT_DEBUG, 0});
+        dynamic.push_back({ELF::DT_NULL, 0});
+
+        address = alignTo(address, 8);
+        uint64_t dynamicAddress = address;
+        address += sizeof(ELF::Elf64_Dyn) * dynamic.size();
+        uint64_t gotAddress = address;
+        address += 8 * got.size();
+        place(address, Kind::Data);
+        uint64_t fileEnd = address;
+        place(address, Kind::Bss);
+        uint64_t dataEnd = address;
+
+        // Now everything has an address, so symbols do too
+        for (size_t i = 0; i < plt.size(); i++)
+            plt[i]->address = pltAddress + pltEntrySize * i;
+        for (auto &entry : symbols) {
+            Symbol &sym = entry.second;
+            if (sym.common >= 0)
+                sym.address = sections[sym.common].address;
+            else if (sym.section == ELF::SHN_ABS)
+                sym.address = sym.value;
+            else if (sym.section != ELF::SHN_UNDEF && inputs[sym.file].sections[sym.section] >= 0)
+                sym.address = sections[inputs[sym.file].sections[sym.section]].address + sym.value;
+        }
+        if (defineGot)
+            gotSymbol.address = gotAddress;
+        Symbol &main = symbol("main");
+        if (main.section == ELF::SHN_UNDEF)
+            throw std::runtime_error("Linker: Undefined reference to 'main'");
+
+        std::vector<char> image(fileEnd - imageBase);
+        for (const auto &section : sections) {
+            if (section.header && section.kind != Kind::Bss) {
+                auto contents = check(inputs[section.file].elf.getSectionContents(*section.header),
+                                      inputs[section.file].name);
+                std::copy(contents.begin(), contents.end(), image.begin() + (section.address - imageBase));
+            }
+        }
+        if (!relocate(image, gotAddress))
+            return false;
+
+        // .ctors and .dtors run from last to first, unlike the arrays they are merged into
+        for (const auto &section : sections) {
+            if ((section.kind == Kind::InitArray || section.kind == Kind::FiniArray) &&
+                (section.name.startswith(".ctors") || section.name.startswith(".dtors"))) {
+                auto begin = reinterpret_cast<uint64_t *>(image.data() + (section.address - imageBase));
+                std::reverse(begin, begin + section.size / 8);
+            }
+        }
+
+        // ELF and program headers
+        ELF::Elf64_Ehdr ehdr = {};
+        std::memcpy(ehdr.e_ident, ELF::ElfMagic, 4);
+        ehdr.e_ident[ELF::EI_CLASS] = ELF::ELFCLASS64;
+        ehdr.e_ident[ELF::EI_DATA] = ELF::ELFDATA2LSB;
+        ehdr.e_ident[ELF::EI_VERSION] = ELF::EV_CURRENT;
+        ehdr.e_ident[ELF::EI_OSABI] = ELF::ELFOSABI_NONE;
+        ehdr.e_type = ELF::ET_EXEC;
+        ehdr.e_machine = ELF::EM_X86_64;
+        ehdr.e_version = ELF::EV_CURRENT;
+        ehdr.e_entry = startAddress;
+        ehdr.e_phoff = sizeof(ELF::Elf64_Ehdr);
+        ehdr.e_ehsize = sizeof(ELF::Elf64_Ehdr);
+        ehdr.e_phentsize = sizeof(ELF::Elf64_Phdr);
+        ehdr.e_phnum = programHeaders;
+        write(image, 0, ehdr);
+
+        auto segment = [](uint32_t type, uint32_t flags, uint64_t start, uint64_t fileSize, uint64_t memSize,
+                          uint64_t align) {
+            ELF::Elf64_Phdr phdr = {};
+            phdr.p_type = type;
+            phdr.p_flags = flags;
+            phdr.p_offset = start - imageBase;
+            phdr.p_vaddr = phdr.p_paddr = start;
+            phdr.p_filesz = fileSize;
+            phdr.p_memsz = memSize;
+            phdr.p_align = align;
+            return phdr;
+        };
+        uint64_t phdrSize = programHeaders * sizeof(ELF::Elf64_Phdr);
+        uint64_t dynamicSize = sizeof(ELF::Elf64_Dyn) * dynamic.size();
+        ELF::Elf64_Phdr phdrs[programHeaders] = {
+            segment(ELF::PT_PHDR, ELF::PF_R, imageBase + ehdr.e_phoff, phdrSize, phdrSize, 8),
+            segment(ELF::PT_INTERP, ELF::PF_R, interpAddress, sizeof(interpreter), sizeof(interpreter), 1),
+            segment(ELF::PT_LOAD, ELF::PF_R, imageBase, readOnlyEnd - imageBase, readOnlyEnd - imageBase, pageSize),
+            segment(ELF::PT_LOAD, ELF::PF_R | ELF::PF_X, textStart, textEnd - textStart, textEnd - textStart,
+                    pageSize),
+            segment(ELF::PT_LOAD, ELF::PF_R | ELF::PF_W, dataStart, fileEnd - dataStart, dataEnd - dataStart,
+                    pageSize),
+            segment(ELF::PT_DYNAMIC, ELF::PF_R | ELF::PF_W, dynamicAddress, dynamicSize, dynamicSize, 8),
+            segment(ELF::PT_GNU_STACK, ELF::PF_R | ELF::PF_W, imageBase, 0, 0, 16),
+        };
+        phdrs[6].p_offset = phdrs[6].p_vaddr = phdrs[6].p_paddr = 0;
+        write(image, ehdr.e_phoff, phdrs);
+        std::memcpy(image.data() + (interpAddress - imageBase), interpreter, sizeof(interpreter));
+
+        // Hash table with a single bucket chaining every symbol.  Nothing is exported, so it is never really searched
+        std::vector<uint32_t> hash = {1, static_cast<uint32_t>(dynsymCount), static_cast<uint32_t>(dynsymCount - 1)};
+        for (size_t i = 0; i < dynsymCount; i++)
+            hash.push_back(i ? static_cast<uint32_t>(i - 1) : 0);
+        std::memcpy(image.data() + (hashAddress - imageBase), hash.data(), hash.size() * 4);
+
+        // Imports, and the relocations that fill in their GOT entries
+        for (size_t i = 0; i < imports.size(); i++) {
+            ELF::Elf64_Sym sym = {};
+            sym.st_name = importNames[i];
+            sym.setBindingAndType(ELF::STB_GLOBAL, ELF::STT_NOTYPE);
+            write(image, dynsymAddress - imageBase + sizeof(ELF::Elf64_Sym) * (i + 1), sym);
+        }
+        std::memcpy(image.data() + (dynstrAddress - imageBase), dynstr.data(), dynstr.size());
+        for (size_t i = 0; i < got.size(); i++) {
+            ELF::Elf64_Rela rela = {};
+            rela.r_offset = gotAddress + 8 * i;
+            rela.setSymbolAndType(got[i]->dynamic, ELF::R_X86_64_GLOB_DAT);
+            write(image, relaAddress - imageBase + sizeof(ELF::Elf64_Rela) * i, rela);
+        }
+
+        for (size_t i = 0; i < dynamic.size(); i++) {
+            ELF::Elf64_Dyn dyn = {};
+            dyn.d_tag = dynamic[i].first;
+            dyn.d_un.d_val = dynamic[i].second;
+            write(image, dynamicAddress - imageBase + sizeof(ELF::Elf64_Dyn) * i, dyn);
+        }
+
+        // Entry point and PLT
+        std::memcpy(image.data() + (startAddress - imageBase), startCode, sizeof(startCode));
+        write(image, startAddress - imageBase + startMain,
+              static_cast<int32_t>(main.address - (startAddress + startMain + 4)));
+        write(image, startAddress - imageBase + startLibcMain,
+              static_cast<int32_t>(gotAddress + 8 * libcMain.got - (startAddress + startLibcMain + 4)));
+        for (size_t i = 0; i < plt.size(); i++) {
+            uint64_t entry = pltAddress + pltEntrySize * i;
+            std::memcpy(image.data() + (entry - imageBase), pltCode, sizeof(pltCode));
+            write(image, entry - imageBase + 2, static_cast<int32_t>(gotAddress + 8 * plt[i]->got - (entry + 6)));
+        }
+
+        int fd;
+        if (std::error_code ec = sys::fs::openFileForWrite(output, fd, sys::fs::CD_CreateAlways, sys::fs::OF_None,
+                                                           0777))
+            throw std::runtime_error("Linker: Could not open " + output + ": " + ec.message());
+        raw_fd_ostream out(fd, true);
+        out.write(image.data(), image.size());
+        out.close();
+        if (out.has_error())
+            throw std::runtime_error("Linker: Could not write " + output + ": " + out.error().message());
+        return true;
+    }
+}  // namespace Compiler
@@ -0,0 +1,97 @@
+#pragma once
+#ifndef COMPILER_LINKER_H
+#define COMPILER_LINKER_H
+
+#include "llvm/Object/ELF.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Compiler {
+    using namespace llvm;
+
+    // A static linker for x86-64 Linux, just big enough for SIMPLE programs, so -l doesn't have to start the system C
+    // compiler.  Objects and archive members are laid out in a non-PIE executable that is dynamically linked against
+    // shared libraries like libc and libm, with every import bound when the program loads.
+    // Inputs can need things it doesn't handle, like thread locals or copy relocations.  Then link() returns false
+    // and the caller should use the system linker instead
+    class Linker {
+        using ELFFile = object::ELF64LEFile;
+        using Shdr = ELFFile::Elf_Shdr;
+
+        enum class Kind { Text, ReadOnly, Data, Bss, InitArray, FiniArray };
+
+        // An allocated section of an input, and where it ends up
+        struct Section {
+            size_t file;
+            const Shdr *header;
+            StringRef name;
+            Kind kind;
+            uint64_t size, align;
+            uint64_t address = 0;
+        };
+
+        // A global symbol, defined by an input or imported from a shared library
+        struct Symbol {
+            std::string name;
+            // Section index and file of the definition.  SHN_UNDEF until something defines it
+            size_t file = 0;
+            unsigned section = 0;
+            uint64_t value = 0;
+            bool weak = false;
+            // Referenced at all, and by anything other than a weak reference
+            bool referenced = false, required = false;
+            // Common symbols are allocated in .bss unless something defines them properly
+            uint64_t commonSize = 0, commonAlign = 0;
+            int common = -1;
+            bool shared = false;
+            // Indexes into the GOT and PLT, or -1 for none
+            int got = -1, plt = -1;
+            unsigned dynamic = 0;
+            uint64_t address = 0;
+        };
+
+        struct Input {
+            std::string name;
+            ELFFile elf;
+            const Shdr *symtab = nullptr;
+            // The global symbol for each symbol table entry, or nullptr for locals
+            std::vector<Symbol *> globals;
+            // Where each section index went, or -1 for sections that aren't linked
+            std::vector<int> sections;
+        };
+
+        std::vector<Input> inputs;
+        std::vector<MemoryBufferRef> members;
+        std::vector<std::string> libraries;
+        std::map<std::string, Symbol> symbols;
+        std::vector<Section> sections;
+        std::vector<Symbol *> got, plt, imports;
+        // Why link() gave up
+        std::string reason;
+
+        void load(MemoryBufferRef object);
+        Symbol &symbol(StringRef name);
+        void resolveShared();
+        bool scanRelocations();
+        bool relocate(std::vector<char> &image, uint64_t base);
+        uint64_t symbolAddress(const Input &input, uint32_t index);
+        bool unsupported(const std::string &why);
+
+    public:
+        // Objects are always linked.  Archive members only when they define something that is still undefined
+        void addObject(MemoryBufferRef object);
+        void addArchive(MemoryBufferRef archive);
+        // A shared library to link against, by its soname, like "libm.so.6"
+        void addLibrary(const std::string &soname);
+
+        // Write the executable.  Link errors, like undefined symbols, throw.  Returns false if an input needs
+        // something this linker can't do, with the reason in unsupportedReason()
+        bool link(const std::string &output);
+        const std::string &unsupportedReason() const { return reason; }
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_LINKER_H
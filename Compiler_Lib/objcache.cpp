@@ -0,0 +1,195 @@
+#include "objcache.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace Compiler {
+
+    // Temporary files older than this were left behind by a compiler that died mid-write
+    static const auto staleTempAge = std::chrono::hours(1);
+
+    ObjCache::ObjCache(std::string dir, uint64_t maxSize)
+        : dir(std::move(dir)), maxSize(maxSize)
+    {
+        sys::fs::create_directories(this->dir);
+    }
+
+    std::string ObjCache::compilerVersion()
+    {
+        // Like ccache, identify the compiler binary by its size and modification time
+        static int anchor;
+        std::string exe = sys::fs::getMainExecutable(nullptr, &anchor);
+        sys::fs::file_status status;
+        std::string version = "simple-0.1";
+        if (!sys::fs::status(exe, status)) {
+            version += ";" + std::to_string(status.getSize()) + ";" +
+                       std::to_string(status.getLastModificationTime().time_since_epoch().count());
+        }
+        return version;
+    }
+
+    // Hash a list of fields.  They are separated with a NUL so they can't run into each other
+    static std::string hashFields(std::initializer_list<StringRef> fields)
+    {
+        SHA1 hasher;
+        for (StringRef field : fields) {
+            hasher.update(field);
+            hasher.update(StringRef("\0", 1));
+        }
+        return toHex(hasher.final(), true);
+    }
+
+    std::string ObjCache::sourceKey(StringRef source, const CodegenOptions &options)
+    {
+        // With full LTO the runtime is part of the object too
+        std::string runtime;
+        if (options.lto == CodegenOptions::LTOFull) {
+            if (auto bitcode = MemoryBuffer::getFile(options.runtimeBitcode))
+                runtime = (*bitcode)->getBuffer().str();
+        }
+        return hashFields({compilerVersion(), sys::getDefaultTargetTriple(), options.describe(), source, runtime});
+    }
+
+    std::string ObjCache::fragmentKey(StringRef function, const CodegenOptions &options)
+    {
+        return hashFields({"fragment", compilerVersion(), sys::getDefaultTargetTriple(), options.describe(),
+                           function});
+    }
+
+    std::string ObjCache::moduleKey(const Module &mod)
+    {
+        SmallVector<char, 0> bitcode;
+        raw_svector_ostream out(bitcode);
+        WriteBitcodeToFile(mod, out);
+
+        return hashFields({compilerVersion(), mod.getTargetTriple(), StringRef(bitcode.data(), bitcode.size())});
+    }
+
+    std::string ObjCache::entryPath(const std::string &key)
+    {
+        SmallString<128> path(dir);
+        sys::path::append(path, key + ".o");
+        return std::string(path.str());
+    }
+
+    std::unique_ptr<MemoryBuffer> ObjCache::lookup(const std::string &key)
+    {
+        std::string path = entryPath(key);
+        auto buffer = MemoryBuffer::getFile(path, false, false);
+        if (!buffer) {
+            misses++;
+            return nullptr;
+        }
+
+        // Touch the entry so eviction sees it as recently used
+        int fd;
+        if (!sys::fs::openFileForRead(path, fd)) {
+            sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+            sys::Process::SafelyCloseFileDescriptor(fd);
+        }
+
+        hits++;
+        return std::move(*buffer);
+    }
+
+    void ObjCache::store(const std::string &key, StringRef object)
+    {
+        // Write to a unique temporary file then rename over the entry.  Rename is atomic, so concurrent
+        // readers see either no entry or a complete one
+        int fd;
+        SmallString<128> tempPath;
+        SmallString<128> model(dir);
+        sys::path::append(model, "tmp-%%%%%%%%%%%%.part");
+        if (sys::fs::createUniqueFile(model, fd, tempPath))
+            return;
+
+        {
+            raw_fd_ostream out(fd, true);
+            out << object;
+            out.close();
+            if (out.has_error()) {
+                out.clear_error();
+                sys::fs::remove(tempPath);
+                return;
+            }
+        }
+
+        if (sys::fs::rename(tempPath, entryPath(key))) {
+            sys::fs::remove(tempPath);
+            return;
+        }
+
+        knownSize += object.size();
+        if (!scanned || knownSize > maxSize)
+            evict();
+    }
+
+    void ObjCache::evict()
+    {
+        struct Entry {
+            std::string path;
+            uint64_t size;
+            sys::TimePoint<> used;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        auto now = std::chrono::system_clock::now();
+
+        std::error_code ec;
+        for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec)) {
+            sys::fs::file_status status;
+            if (sys::fs::status(it->path(), status))
+                continue;
+            StringRef name = sys::path::filename(it->path());
+            if (name.startswith("tmp-")) {
+                if (now - status.getLastModificationTime() > staleTempAge)
+                    sys::fs::remove(it->path());
+                continue;
+            }
+            if (!name.endswith(".o"))
+                continue;
+            entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+            total += status.getSize();
+        }
+
+        scanned = true;
+        knownSize = total;
+        if (total <= maxSize)
+            return;
+
+        // Oldest first.  Another compiler may be evicting at the same time, so failed removals are ignored
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+        for (const auto &entry : entries) {
+            if (total <= maxSize)
+                break;
+            if (!sys::fs::remove(entry.path))
+                evictions++;
+            total -= entry.size;
+        }
+        knownSize = total;
+    }
+
+    void ObjCache::printStats(raw_ostream &os)
+    {
+        os << "Object cache: " << hits << " hits, " << misses << " misses, " << evictions << " evictions\n";
+    }
+
+    void ObjCache::notifyObjectCompiled(const Module *mod, MemoryBufferRef object)
+    {
+        store(moduleKey(*mod), object.getBuffer());
+    }
+
+    std::unique_ptr<MemoryBuffer> ObjCache::getObject(const Module *mod)
+    {
+        return lookup(moduleKey(*mod));
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef COMPILER_OBJCACHE_H
+#define COMPILER_OBJCACHE_H
+
+#include "codegen.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+
+namespace Compiler {
+    using namespace llvm;
+
+    // On disk cache of object files, addressed by a hash of everything that went into them.
+    // Entries are written to a temporary file and renamed into place, so any number of compilers can share a
+    // directory.  When the directory grows past its size limit the least recently used entries are removed.
+    class ObjCache : public ObjectCache {
+        // Directory holding the entries
+        std::string dir;
+        // Size limit of the directory in bytes
+        uint64_t maxSize;
+        // Counters for printStats
+        unsigned hits = 0, misses = 0, evictions = 0;
+        // Size of the directory as of the last scan plus what has been stored since.  Scanning after every store would
+        // make incremental builds quadratic in the number of functions
+        uint64_t knownSize = 0;
+        bool scanned = false;
+
+        std::string entryPath(const std::string &key);
+        // Remove least recently used entries until the cache fits in maxSize
+        void evict();
+
+    public:
+        ObjCache(std::string dir, uint64_t maxSize);
+
+        // Identifies the compiler build, so a rebuilt compiler never reuses stale objects
+        static std::string compilerVersion();
+        // Key for an object compiled from source with the given options for the host
+        static std::string sourceKey(StringRef source, const CodegenOptions &options);
+        // Key for the object fragment of a single function, from its fingerprint, for incremental compilation
+        static std::string fragmentKey(StringRef function, const CodegenOptions &options);
+        // Key for an object compiled from an IR module, used by the JIT
+        static std::string moduleKey(const Module &mod);
+
+        // Returns the entry for key, or nullptr on a miss.  Hits mark the entry as recently used
+        std::unique_ptr<MemoryBuffer> lookup(const std::string &key);
+        // Atomically add an entry, then evict if the cache is over its size limit
+        void store(const std::string &key, StringRef object);
+
+        void printStats(raw_ostream &os);
+
+        // ORC/MCJIT hooks so the JIT shares the same cache
+        void notifyObjectCompiled(const Module *mod, MemoryBufferRef object) override;
+        std::unique_ptr<MemoryBuffer> getObject(const Module *mod) override;
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_OBJCACHE_H
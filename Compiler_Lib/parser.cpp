@@ -31,13 +31,29 @@ namespace Compiler {
 	/*		Function definition		*/
 	std::unique_ptr<AST> FunctionParser::parse(Parser *parser, const Token &tok)
 	{
-		// DEFINE [EXT] f(a, b, c)
+		// DEFINE [EXT] [FAST] [EXPORT] [MEMO] f(a, b, c)
 		//    ...
 		// ENDDEF
 		// Already consumed DEFINE
 
-		// Check to see if function is extern
-		bool ext = parser->match(EXT);
+		// Modifiers, in any order.  EXT for extern functions, FAST to allow fast-math optimisations in the body, EXPORT
+		// to make a function callable from other object files, MEMO to cache results
+		bool ext = false, fast = false, exported = false, memo = false;
+		while (true) {
+			if (parser->match(EXT))
+				ext = true;
+			else if (parser->match(FAST))
+				fast = true;
+			else if (parser->match(EXPORT))
+				exported = true;
+			else if (parser->match(MEMO))
+				memo = true;
+			else
+				break;
+		}
+		if (ext && memo) {
+			parser->error("EXT functions can't be MEMO.");
+		}
 
 		// get name
 		unique_ptr<AST> name = parser->parseExpression(DEFINITON);
@@ -71,7 +87,8 @@ namespace Compiler {
 		}
 		// For an external definition, there is no block to close, so no ENDDEF
 
-		return std::make_unique<FuncDefAST>(std::move(name), ext, std::move(args), std::move(body));
+		return std::make_unique<FuncDefAST>(std::move(name), ext, std::move(args), std::move(body), fast,
+		                                    exported, memo);
 	}
 
 	/*		PrefixOperator		*/
@@ -131,9 +148,9 @@ namespace Compiler {
 		// Get rhs of expression
 		unique_ptr<AST> right = parser->parseExpression(Precedence::ASSIGNMENT - 1);
 
-		// Check if lhs is of type name
-		if (left->getType() != ASTType::NAME) {
-			parser->error("The left hand side of an assignment must be a name.");
+		// Check if lhs is a name or an array element
+		if (left->getType() != ASTType::NAME && left->getType() != ASTType::ARRAY) {
+			parser->error("The left hand side of an assignment must be a name or an array element.");
 		}
 
 		unique_ptr<AssignmentAST> expr = std::make_unique<AssignmentAST>(std::move(left), std::move(right));
@@ -164,20 +181,17 @@ namespace Compiler {
 	/*		Access array index		*/
 	unique_ptr<AST> Compiler::IndexParser::parse(Parser * parser, unique_ptr<AST> left, const Token & tok)
 	{
-		unique_ptr<AST> right = parser->parseExpression(Precedence::CALL - 1);
-
-		// Check if lhs is of type name
-		if (left->getType() == ASTType::NAME) {
+		// a[i]
+		// Already consumed [
+		if (left->getType() != ASTType::NAME) {
 			parser->error("The left hand side of an array index must be a name.");
 		}
 
-		// Check if rhs is of type number
-		if (left->getType() == ASTType::NUMBER) {
-			parser->error("The left hand side of an array index must be a number.");
-		}
+		std::vector<std::shared_ptr<AST>> index = {};
+		index.push_back(parser->parseExpression());
+		parser->expect(RIGHTSQ);
 
-		// TODO(James): FINISH ME PLEASE
-		return nullptr;
+		return std::make_unique<ArrayAST>(std::move(left), std::move(index));
 	}
 
 
@@ -297,7 +311,7 @@ namespace Compiler {
 	{
 		std::vector<std::shared_ptr<AST>> stmts = {};
 
-		while ((_scanner.lookAhead(0).getType() != END) && (_scanner.lookAhead(0).getType() != ELSE) && (_scanner.lookAhead(0).getType() != ENDIF) && (_scanner.lookAhead(0).getType() != ENDFOR) && (_scanner.lookAhead(0).getType() != ENDDEF)) {
+		while ((_scanner.lookAhead(0).getType() != END) && (_scanner.lookAhead(0).getType() != ELSE) && (_scanner.lookAhead(0).getType() != ENDIF) && (_scanner.lookAhead(0).getType() != ENDFOR) && (_scanner.lookAhead(0).getType() != ENDDEF) && (_scanner.lookAhead(0).getType() != ENDREGION)) {
 			Token tok = _scanner.getCurrentToken();
 			switch (tok.getType()) {
 			case IF:
@@ -306,6 +320,9 @@ namespace Compiler {
 			case FOR:
 				stmts.push_back(forStmt());
 				break;
+			case REGION:
+				stmts.push_back(regionStmt());
+				break;
 			default:
 				stmts.push_back(parseExpression());
 			}
@@ -385,6 +402,18 @@ namespace Compiler {
 			}
 		}
 
+		// Optional hints, in any order.  UNROLL n unrolls the loop n times, VECTORIZE n uses vectors n wide.
+		// A count of 1 stops the optimiser doing it at all
+		unsigned unroll = 0, vectorize = 0;
+		while (true) {
+			if (match(UNROLL))
+				unroll = loopHint("UNROLL");
+			else if (match(VECTORIZE))
+				vectorize = loopHint("VECTORIZE");
+			else
+				break;
+		}
+
 		// Expect in
 		
 		expect(IN);
@@ -396,7 +425,30 @@ namespace Compiler {
 
 		expect(ENDFOR);
 
-		return std::make_unique<ForAST>(ident, std::move(start), std::move(end), std::move(step), std::move(body));
+		return std::make_unique<ForAST>(ident, std::move(start), std::move(end), std::move(step), std::move(body),
+		                                unroll, vectorize);
+	}
+
+	unique_ptr<AST> Parser::regionStmt()
+	{
+		expect(REGION);
+
+		// The statements run like any other block, which gives the region its value
+		unique_ptr<AST> body = block();
+		expect(ENDREGION);
+
+		auto stmts = static_cast<BlockAST *>(body.get())->getChildren();
+		return std::make_unique<BlockAST>(std::move(stmts), true);
+	}
+
+	unsigned Parser::loopHint(const std::string &hint)
+	{
+		std::string count = expect(NUMBER).getValue();
+		double val = std::stod(count);
+		if (val < 1 || val > 1024 || val != (unsigned)val) {
+			error(hint + " expects a whole number from 1 to 1024, not " + count);
+		}
+		return (unsigned)val;
 	}
 
 	// Get the precedence for a given token
@@ -198,6 +198,9 @@ namespace Compiler {
 		// Parse a for statement
 		std::unique_ptr<AST> forStmt();
 
+		// Parse a REGION ... ENDREGION block
+		std::unique_ptr<AST> regionStmt();
+
 		// Math expression - TDOP
 		std::unique_ptr<AST> parseExpression(int precedence = 0);
 
@@ -211,6 +214,8 @@ namespace Compiler {
 		Scanner _scanner;
 		// Get precedence of operator
 		int getPrecedence();
+		// Parse the count after a loop hint
+		unsigned loopHint(const std::string &hint);
 		// Map of prefix parser chunks
 		std::map <TokenType, std::shared_ptr<IPrefixParser>> prefixMap = {};
 		// Map of infix parser chunks
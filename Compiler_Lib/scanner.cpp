@@ -66,6 +66,19 @@ namespace Compiler {
 			else if (identStr == "ENDFOR") {
 				tokQueue.emplace_back( ENDFOR, identStr );
 			}
+			else if (identStr == "UNROLL") {
+				tokQueue.emplace_back( UNROLL, identStr );
+			}
+			else if (identStr == "VECTORIZE") {
+				tokQueue.emplace_back( VECTORIZE, identStr );
+			}
+
+			else if (identStr == "REGION") {
+				tokQueue.emplace_back( REGION, identStr );
+			}
+			else if (identStr == "ENDREGION") {
+				tokQueue.emplace_back( ENDREGION, identStr );
+			}
 
 			// Handle bools
 			else if (identStr == "true" || identStr == "false") {
@@ -92,6 +105,18 @@ namespace Compiler {
 				tokQueue.emplace_back( EXT, identStr );
 			}
 
+			else if (identStr == "FAST") {
+				tokQueue.emplace_back( FAST, identStr );
+			}
+
+			else if (identStr == "EXPORT") {
+				tokQueue.emplace_back( EXPORT, identStr );
+			}
+
+			else if (identStr == "MEMO") {
+				tokQueue.emplace_back( MEMO, identStr );
+			}
+
 			// just an identifier
 			else {
 				tokQueue.emplace_back( IDENTIFIER, identStr );
@@ -175,6 +200,15 @@ namespace Compiler {
 			tokQueue.emplace_back( RIGHTPAREN, ")" );
 		}
 
+		// Array indexing
+		else if (lookChar == '[') {
+			tokQueue.emplace_back( LEFTSQ, "[" );
+		}
+
+		else if (lookChar == ']') {
+			tokQueue.emplace_back( RIGHTSQ, "]" );
+		}
+
 		else if (lookChar == ',') {
 			tokQueue.emplace_back( COMMA, "," );
 		}
@@ -359,7 +393,7 @@ namespace Compiler {
 
 		// make sure only legal separators come after the number
 		char peek{ peekChar() };
-		if (!isWhite(peek) && peek != ')' && peek != ',' && peek != ';' && !isOp(peek)) {
+		if (!isWhite(peek) && peek != ')' && peek != ']' && peek != ',' && peek != ';' && !isOp(peek)) {
 			error("Unexpected " + std::string(1, peek) + " in digit");
 		}
 		skipWhite();
@@ -19,8 +19,9 @@ namespace Compiler {
 		LEFTPAREN, RIGHTPAREN, LEFTSQ, RIGHTSQ, COMMA,
 		NUMBER, STRING, IDENTIFIER, BOOL,
 		BEGIN, IF, ENDIF, ELSE, THEN,
-		FOR, IN, ENDFOR,
-		DEFINE, ENDDEF, EXT,
+		FOR, IN, ENDFOR, UNROLL, VECTORIZE,
+		REGION, ENDREGION,
+		DEFINE, ENDDEF, EXT, FAST, EXPORT, MEMO,
 		NEWLINE, END
 	};
 
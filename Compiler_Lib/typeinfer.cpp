@@ -0,0 +1,680 @@
+#include "typeinfer.h"
+#include "analysis.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace Compiler {
+
+    static const double inf = std::numeric_limits<double>::infinity();
+    // Doubles hold every whole number up to 2^53 exactly.  2^53 itself is also what 2^53 + 1 rounds to, so a result
+    // is only known to be exact if it is strictly smaller
+    static const double exactIntLimit = 9007199254740992.0;
+    // Expressions evaluated per function before loops stop being followed iteration by iteration
+    static const unsigned long maxSteps = 250000;
+    // Joined loop iterations before growing ranges are widened to infinity
+    static const unsigned widenAfter = 2;
+
+    /* ---- NumRange ---- */
+
+    NumRange NumRange::empty()
+    {
+        return {inf, -inf, true, false, false};
+    }
+
+    NumRange NumRange::top()
+    {
+        return {-inf, inf, false, true, true};
+    }
+
+    NumRange NumRange::constant(double val)
+    {
+        if (std::isnan(val))
+            return {inf, -inf, true, false, true};
+        return {val, val, std::isfinite(val) && val == std::trunc(val), val == 0 && std::signbit(val), false};
+    }
+
+    NumRange NumRange::boolean()
+    {
+        return {0, 1, true, false, false};
+    }
+
+    bool NumRange::isInt() const
+    {
+        return !isEmpty() && integral && !negZero && !nan && lo > -exactIntLimit && hi < exactIntLimit;
+    }
+
+    bool NumRange::alwaysTrue() const
+    {
+        return !isEmpty() && !nan && !mayBeZero();
+    }
+
+    bool NumRange::alwaysFalse() const
+    {
+        // NaN is false too, since conditions compare not equal to 0.0
+        return !isEmpty() && (lo > hi || (lo == 0 && hi == 0));
+    }
+
+    NumRange NumRange::join(const NumRange &other) const
+    {
+        return {std::min(lo, other.lo), std::max(hi, other.hi), integral && other.integral, negZero || other.negZero,
+                nan || other.nan};
+    }
+
+    bool NumRange::operator==(const NumRange &other) const
+    {
+        return lo == other.lo && hi == other.hi && integral == other.integral && negZero == other.negZero &&
+               nan == other.nan;
+    }
+
+    /* ---- Arithmetic on ranges ---- */
+    // Rounding to nearest is monotonic, so doing the same operation on the bounds gives bounds on the result
+
+    static bool mayBePosInf(const NumRange &val)
+    {
+        return !val.integral && val.hi == inf;
+    }
+
+    static bool mayBeNegInf(const NumRange &val)
+    {
+        return !val.integral && val.lo == -inf;
+    }
+
+    static bool mayBeInf(const NumRange &val)
+    {
+        return mayBePosInf(val) || mayBeNegInf(val);
+    }
+
+    static bool mayBeNeg(const NumRange &val)
+    {
+        return val.lo < 0 || val.negZero;
+    }
+
+    // Build a range from computed bounds.  Bounds that came out as NaN are from inf - inf or 0 * inf
+    static NumRange bounds(double lo, double hi, bool integral, bool negZero, bool nan)
+    {
+        if (std::isnan(lo)) {
+            lo = -inf;
+            nan = true;
+        }
+        if (std::isnan(hi)) {
+            hi = inf;
+            nan = true;
+        }
+        // Whole numbers that overflow become infinities
+        integral = integral && std::isfinite(lo) && std::isfinite(hi);
+        return {lo, hi, integral, negZero, nan};
+    }
+
+    static NumRange rangeAdd(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        bool nan = a.nan || b.nan || (mayBePosInf(a) && mayBeNegInf(b)) || (mayBeNegInf(a) && mayBePosInf(b));
+        // -0 + -0 is the only way to get -0
+        return bounds(a.lo + b.lo, a.hi + b.hi, a.integral && b.integral, a.negZero && b.negZero, nan);
+    }
+
+    static NumRange rangeSub(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        bool nan = a.nan || b.nan || (mayBePosInf(a) && mayBePosInf(b)) || (mayBeNegInf(a) && mayBeNegInf(b));
+        // -0 - +0 is the only way to get -0
+        return bounds(a.lo - b.hi, a.hi - b.lo, a.integral && b.integral, a.negZero && b.mayBeZero(), nan);
+    }
+
+    static NumRange rangeMul(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        double products[] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+        double lo = inf, hi = -inf;
+        bool nan = a.nan || b.nan || (a.mayBeZero() && mayBeInf(b)) || (b.mayBeZero() && mayBeInf(a));
+        for (double product : products) {
+            if (std::isnan(product)) {
+                lo = -inf;
+                hi = inf;
+            } else {
+                lo = std::min(lo, product);
+                hi = std::max(hi, product);
+            }
+        }
+        bool negZero = a.negZero || b.negZero || (a.mayBeZero() && mayBeNeg(b)) || (b.mayBeZero() && mayBeNeg(a));
+        return bounds(lo, hi, a.integral && b.integral, negZero, nan);
+    }
+
+    static NumRange rangeDiv(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        if (a.isConstant() && b.isConstant())
+            return NumRange::constant(a.lo / b.lo);
+        if (b.mayBeZero() || a.nan || b.nan || (mayBeInf(a) && mayBeInf(b)))
+            return NumRange::top();
+
+        // The divisor doesn't cross zero, so the extremes are at the corners.  Results aren't whole in general and
+        // can underflow to -0
+        double quotients[] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+        double lo = *std::min_element(std::begin(quotients), std::end(quotients));
+        double hi = *std::max_element(std::begin(quotients), std::end(quotients));
+        return bounds(lo, hi, false, true, false);
+    }
+
+    static NumRange rangeRem(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        if (a.isConstant() && b.isConstant())
+            return NumRange::constant(std::fmod(a.lo, b.lo));
+
+        // The result has the sign of the dividend and is smaller than the divisor.  A negative dividend that divides
+        // exactly gives -0
+        double divisor = std::max(std::fabs(b.lo), std::fabs(b.hi));
+        double lo = a.lo >= 0 ? 0 : std::max(a.lo, -divisor);
+        double hi = a.hi <= 0 ? 0 : std::min(a.hi, divisor);
+        bool nan = a.nan || b.nan || b.mayBeZero() || mayBeInf(a);
+        return bounds(lo, hi, a.integral && b.integral, a.negZero || a.lo < 0, nan);
+    }
+
+    static NumRange truth(const NumRange &val)
+    {
+        if (val.alwaysTrue())
+            return NumRange::constant(1);
+        if (val.alwaysFalse())
+            return NumRange::constant(0);
+        return NumRange::boolean();
+    }
+
+    // Comparisons are unordered, so NaN makes all of them true.  Only decide them when there are no NaNs
+    static NumRange rangeCompare(TokenType op, const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        if (a.nan || b.nan)
+            return NumRange::boolean();
+
+        bool alwaysTrue = false, alwaysFalse = false;
+        switch (op) {
+            case LESS:
+                alwaysTrue = a.hi < b.lo;
+                alwaysFalse = a.lo >= b.hi;
+                break;
+            case GREATER:
+                alwaysTrue = a.lo > b.hi;
+                alwaysFalse = a.hi <= b.lo;
+                break;
+            case LEQ:
+                alwaysTrue = a.hi <= b.lo;
+                alwaysFalse = a.lo > b.hi;
+                break;
+            case GREQ:
+                alwaysTrue = a.lo >= b.hi;
+                alwaysFalse = a.hi < b.lo;
+                break;
+            case EQ:
+                alwaysTrue = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+                alwaysFalse = a.hi < b.lo || b.hi < a.lo;
+                break;
+            case NEQ:
+                alwaysTrue = a.hi < b.lo || b.hi < a.lo;
+                alwaysFalse = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+                break;
+            default:
+                break;
+        }
+        if (alwaysTrue)
+            return NumRange::constant(1);
+        if (alwaysFalse)
+            return NumRange::constant(0);
+        return NumRange::boolean();
+    }
+
+    // Same as the ^ lowering: repeated squaring for small whole exponents, pow otherwise
+    static NumRange rangePow(const NumRange &a, const NumRange &b)
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return NumRange::empty();
+        if (!b.isConstant() || !b.integral || std::fabs(b.lo) > 32)
+            return NumRange::top();
+
+        int n = (int)b.lo;
+        if (n == 0)
+            return NumRange::constant(1);
+        NumRange result = NumRange::empty();
+        bool first = true;
+        NumRange square = a;
+        for (unsigned bits = std::abs(n); bits; bits >>= 1) {
+            if (bits & 1) {
+                result = first ? square : rangeMul(result, square);
+                first = false;
+            }
+            if (bits > 1)
+                square = rangeMul(square, square);
+        }
+        if (n < 0)
+            result = rangeDiv(NumRange::constant(1), result);
+        return result;
+    }
+
+    /* ---- Name resolution ---- */
+
+    // Decides which alloca every variable reference uses.  This has to follow the order codegen visits the tree in,
+    // since that is what decides which assignment creates a variable, rather than the order the program runs in
+    class SlotResolver : public Visitor {
+        std::map<std::string, AST *> scope;
+        std::map<AST *, AST *> &slotOf;
+
+        void child(AST *node) { if (node) node->accept(this); };
+        static std::string nameOf(AST *node) {
+            return node->getType() == ASTType::NAME ? static_cast<NameAST *>(node)->toString() : "";
+        };
+    public:
+        explicit SlotResolver(std::map<AST *, AST *> &slotOf) : slotOf(slotOf) {}
+
+        void resolve(FuncDefAST *func) {
+            for (const auto &arg : func->getArgs())
+                scope[nameOf(arg.get())] = arg.get();
+            child(func->getBod());
+        };
+
+        void visit(BlockAST* node) override { for (const auto &stmt : node->getChildren()) child(stmt.get()); };
+        void visit(NumberAST* node) override { };
+        void visit(NameAST* node) override {
+            auto it = scope.find(node->toString());
+            slotOf[node] = it == scope.end() ? nullptr : it->second;
+        };
+        void visit(ArrayAST* node) override { child(node->getName()); for (const auto &val : node->values) child(val.get()); };
+        void visit(AssignmentAST* node) override {
+            child(node->getRhs());
+            // Storing to an element reads the array variable rather than assigning it
+            if (node->getName()->getType() == ASTType::ARRAY) {
+                child(node->getName());
+                return;
+            }
+            std::string name = nameOf(node->getName());
+            if (!scope.count(name))
+                scope[name] = node;
+            slotOf[node] = scope[name];
+        };
+        void visit(FuncCallAST* node) override { for (const auto &arg : node->getArgs()) child(arg.get()); };
+        void visit(BinaryOpAST* node) override { child(node->getLhs()); child(node->getRhs()); };
+        void visit(UnaryOpAST* node) override { child(node->getOperand()); };
+        void visit(TernaryOpAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(IfAST* node) override { child(node->getCond()); child(node->getThen()); child(node->getElse()); };
+        void visit(ForAST* node) override {
+            child(node->getStart());
+            // The loop variable shadows anything with the same name until the loop ends
+            auto old = scope.find(node->getVarName());
+            AST *shadowed = old == scope.end() ? nullptr : old->second;
+            scope[node->getVarName()] = node;
+            child(node->getBody());
+            child(node->getStep());
+            child(node->getEnd());
+            if (shadowed)
+                scope[node->getVarName()] = shadowed;
+            else
+                scope.erase(node->getVarName());
+        };
+        void visit(FuncDefAST* node) override { };
+    };
+
+    /* ---- TypeInference ---- */
+
+    void TypeInference::analyse(FuncDefAST *func, bool fast)
+    {
+        slotOf.clear();
+        state.clear();
+        exprs.clear();
+        slots.clear();
+        fastMath = fast;
+        steps = 0;
+
+        SlotResolver resolver(slotOf);
+        resolver.resolve(func);
+
+        // Arguments can be anything
+        for (const auto &arg : func->getArgs())
+            assign(arg.get(), NumRange::top());
+        eval(func->getBod());
+    }
+
+    bool TypeInference::isInt(AST *node)
+    {
+        auto it = exprs.find(node);
+        return it != exprs.end() && it->second.isInt();
+    }
+
+    bool TypeInference::isIntVar(AST *node)
+    {
+        auto it = slots.find(node);
+        return it != slots.end() && it->second.isInt();
+    }
+
+    NumRange TypeInference::getRange(AST *node)
+    {
+        auto it = exprs.find(node);
+        return it == exprs.end() ? NumRange::top() : it->second;
+    }
+
+    NumRange TypeInference::eval(AST *node)
+    {
+        if (!node)
+            return NumRange::empty();
+        steps++;
+        node->accept(this);
+        auto it = exprs.find(node);
+        if (it == exprs.end())
+            exprs[node] = result;
+        else
+            it->second = it->second.join(result);
+        return result;
+    }
+
+    void TypeInference::assign(Slot slot, const NumRange &val)
+    {
+        state[slot] = val;
+        auto it = slots.find(slot);
+        if (it == slots.end())
+            slots[slot] = val;
+        else
+            it->second = it->second.join(val);
+    }
+
+    TypeInference::State TypeInference::joinStates(const State &a, const State &b)
+    {
+        State joined = a;
+        for (const auto &entry : b) {
+            auto it = joined.find(entry.first);
+            if (it == joined.end())
+                joined.insert(entry);
+            else
+                it->second = it->second.join(entry.second);
+        }
+        return joined;
+    }
+
+    void TypeInference::visit(BlockAST *node)
+    {
+        result = NumRange::empty();
+        for (const auto &stmt : node->getChildren())
+            eval(stmt.get());
+    }
+
+    void TypeInference::visit(NumberAST *node)
+    {
+        result = NumRange::constant(node->getVal());
+    }
+
+    void TypeInference::visit(NameAST *node)
+    {
+        Slot slot = slotOf[node];
+        if (!slot) {
+            result = NumRange::top();
+            return;
+        }
+        // A variable that hasn't been assigned on this path holds whatever was in memory
+        auto it = state.find(slot);
+        result = it == state.end() ? NumRange::empty() : it->second;
+    }
+
+    void TypeInference::visit(ArrayAST *node)
+    {
+        for (const auto &val : node->values)
+            eval(val.get());
+        result = NumRange::top();
+    }
+
+    void TypeInference::visit(AssignmentAST *node)
+    {
+        NumRange val = eval(node->getRhs());
+        if (node->getName()->getType() == ASTType::ARRAY)
+            eval(node->getName());
+        else
+            assign(slotOf[node], val);
+        result = val;
+    }
+
+    void TypeInference::addKnownCall(const std::string &name, size_t args, const NumRange &range)
+    {
+        if (range == NumRange::top())
+            knownCalls.erase({name, args});
+        else
+            knownCalls[{name, args}] = range;
+    }
+
+    void TypeInference::visit(FuncCallAST *node)
+    {
+        for (const auto &arg : node->getArgs())
+            eval(arg.get());
+        auto known = node->getName()->getType() == ASTType::NAME
+                     ? knownCalls.find({static_cast<NameAST *>(node->getName())->toString(), node->getArgs().size()})
+                     : knownCalls.end();
+        result = known != knownCalls.end() ? known->second : NumRange::top();
+    }
+
+    void TypeInference::visit(BinaryOpAST *node)
+    {
+        NumRange lhs = eval(node->getLhs());
+
+        // The rhs of && and || only runs if the lhs doesn't decide the result
+        if (node->getOp() == AND || node->getOp() == OR) {
+            // The value that decides the result on its own: false for &&, true for ||
+            double decider = node->getOp() == AND ? 0 : 1;
+            if (truth(lhs) == NumRange::constant(decider)) {
+                result = NumRange::constant(decider);
+                return;
+            }
+            NumRange rhs = truth(eval(node->getRhs()));
+            if (truth(lhs).isConstant() || rhs == NumRange::constant(decider))
+                result = rhs;
+            else
+                result = NumRange::boolean();
+            return;
+        }
+
+        NumRange rhs = eval(node->getRhs());
+        bool arithmetic = true;
+        switch (node->getOp()) {
+            case PLUS:
+                result = rangeAdd(lhs, rhs);
+                break;
+            case MINUS:
+                result = rangeSub(lhs, rhs);
+                break;
+            case STAR:
+                result = rangeMul(lhs, rhs);
+                break;
+            case SLASH:
+                result = rangeDiv(lhs, rhs);
+                break;
+            case MOD:
+                result = rangeRem(lhs, rhs);
+                break;
+            case HAT:
+                result = rangePow(lhs, rhs);
+                break;
+            case LESS:
+            case GREATER:
+            case EQ:
+            case NEQ:
+            case GREQ:
+            case LEQ:
+                result = rangeCompare(node->getOp(), lhs, rhs);
+                arithmetic = false;
+                break;
+            default:
+                result = NumRange::top();
+                break;
+        }
+        // Fast-math can reassociate, which changes how fractions round.  Exact integers come out the same whichever
+        // way they are added up, so those are the only results we still trust
+        if (fastMath && arithmetic && !result.isEmpty() && !result.isInt())
+            result = NumRange::top();
+    }
+
+    void TypeInference::visit(UnaryOpAST *node)
+    {
+        NumRange operand = eval(node->getOperand());
+        switch (node->getOp()) {
+            case INC:
+                result = rangeAdd(operand, NumRange::constant(1));
+                break;
+            case DEC:
+                result = rangeSub(operand, NumRange::constant(1));
+                break;
+            case MINUS:
+                // Generated as 0 - x, which is never -0.  Fast-math turns that into a negation though
+                result = rangeSub(NumRange::constant(0), operand);
+                if (fastMath)
+                    result.negZero = true;
+                break;
+            case NOT:
+                result = truth(operand);
+                if (result.isConstant())
+                    result = NumRange::constant(1 - result.lo);
+                break;
+            default:
+                result = NumRange::top();
+                break;
+        }
+    }
+
+    void TypeInference::visit(TernaryOpAST *node)
+    {
+        NumRange cond = eval(node->getCond());
+        NumRange val = NumRange::empty();
+        if (!cond.alwaysFalse())
+            val = val.join(eval(node->getThen()));
+        if (!cond.alwaysTrue())
+            val = val.join(eval(node->getElse()));
+        result = val;
+    }
+
+    void TypeInference::visit(IfAST *node)
+    {
+        NumRange cond = eval(node->getCond());
+        State before = state;
+        NumRange val = NumRange::empty();
+        State after;
+        bool reached = false;
+
+        if (!cond.alwaysFalse()) {
+            val = val.join(eval(node->getThen()));
+            after = state;
+            reached = true;
+        }
+        if (!cond.alwaysTrue()) {
+            state = before;
+            // No ELSE evaluates to 0.0
+            val = val.join(node->getElse() ? eval(node->getElse()) : NumRange::constant(0));
+            after = reached ? joinStates(after, state) : state;
+        }
+        state = after;
+        result = val;
+    }
+
+    NumRange TypeInference::iterate(ForAST *node)
+    {
+        eval(node->getBody());
+        NumRange step = node->getStep() ? eval(node->getStep()) : NumRange::constant(1);
+        auto current = state.find(node);
+        assign(node, rangeAdd(current == state.end() ? NumRange::empty() : current->second, step));
+        return eval(node->getEnd());
+    }
+
+    void TypeInference::visit(ForAST *node)
+    {
+        assign(node, eval(node->getStart()));
+
+        // States where the loop can exit, after the condition is tested
+        State exits;
+        bool exited = false;
+        // Record an exit if the condition can be false.  Returns whether the loop can go round again
+        auto test = [&](const NumRange &cond) {
+            if (!cond.alwaysTrue()) {
+                exits = exited ? joinStates(exits, state) : state;
+                exited = true;
+            }
+            return !cond.alwaysFalse();
+        };
+
+        // The body always runs once.  Follow iterations one at a time while the budget lasts, so loops with constant
+        // bounds are tracked exactly
+        bool finished = false;
+        while (steps < maxSteps) {
+            State before = state;
+            if (!test(iterate(node)) || state == before) {
+                finished = true;
+                break;
+            }
+        }
+
+        // A counted loop only goes round again while its variable passes the test against the bound
+        CountedLoop counted;
+        std::set<std::string> pureCalls;
+        for (const auto &known : knownCalls)
+            pureCalls.insert(known.first.first);
+        bool isCounted = CountedLoop::match(node, counted, pureCalls);
+        auto narrow = [&](NumRange var) {
+            NumRange bound = getRange(counted.bound);
+            // Unordered comparisons with a NaN bound are always true
+            if (var.isEmpty() || bound.isEmpty() || bound.nan)
+                return var;
+            switch (counted.varOp()) {
+                case LESS: case LEQ:
+                    var.hi = std::min(var.hi, bound.hi);
+                    break;
+                case GREATER: case GREQ:
+                    var.lo = std::max(var.lo, bound.lo);
+                    break;
+                default:
+                    break;
+            }
+            return var;
+        };
+
+        // Otherwise join the states at the top of the loop until they stop changing
+        if (!finished) {
+            State head = state;
+            NumRange entryVar = state[node];
+            for (unsigned round = 0;; round++) {
+                state = head;
+                if (!test(iterate(node)))
+                    break;
+                if (isCounted)
+                    state[node] = narrow(state[node]);
+                State next = joinStates(head, state);
+                if (next == head)
+                    break;
+                if (round >= widenAfter) {
+                    for (auto &entry : next) {
+                        auto old = head.find(entry.first);
+                        if (old == head.end())
+                            continue;
+                        if (entry.second.lo < old->second.lo)
+                            entry.second.lo = -inf;
+                        if (entry.second.hi > old->second.hi)
+                            entry.second.hi = inf;
+                        if (isCounted && entry.first == node)
+                            entry.second = entryVar.join(narrow(entry.second));
+                        entry.second.integral = entry.second.integral && std::isfinite(entry.second.lo) &&
+                                                std::isfinite(entry.second.hi);
+                    }
+                }
+                head = next;
+            }
+        }
+
+        // If the loop never exits nothing after it runs
+        state = exited ? exits : State();
+        // FOR is always 0.0
+        result = NumRange::constant(0);
+    }
+
+    void TypeInference::visit(FuncDefAST *node)
+    {
+        result = NumRange::top();
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,101 @@
+#pragma once
+#ifndef COMPILER_TYPEINFER_H
+#define COMPILER_TYPEINFER_H
+
+#include <map>
+#include <string>
+#include "AST.h"
+
+namespace Compiler {
+
+    // The set of doubles a value might hold.  An interval, plus flags for the things an interval can't describe.
+    // -0.0 counts as 0 for the interval
+    struct NumRange {
+        double lo, hi;
+        // Every value is a finite whole number.  The bounds can still be infinite if we don't know how big it gets
+        bool integral;
+        // Might be -0.0
+        bool negZero;
+        // Might be NaN
+        bool nan;
+
+        // No values, for code that never runs
+        static NumRange empty();
+        // Any double at all
+        static NumRange top();
+        static NumRange constant(double val);
+        static NumRange boolean();
+
+        bool isEmpty() const { return lo > hi && !nan; };
+        bool isConstant() const { return lo == hi && !nan && !negZero; };
+        bool mayBeZero() const { return negZero || (lo <= 0 && hi >= 0); };
+        // Whether every value is a whole number an i64 holds exactly, and integer arithmetic gives the same result
+        bool isInt() const;
+        // Whether a condition is true or false on every path
+        bool alwaysTrue() const;
+        bool alwaysFalse() const;
+
+        NumRange join(const NumRange &other) const;
+        bool operator==(const NumRange &other) const;
+        bool operator!=(const NumRange &other) const { return !(*this == other); };
+    };
+
+    // Works out which variables and expressions in a function only ever hold whole numbers small enough to be exact,
+    // so code generation can use i64 for them.
+    // This is an abstract interpreter over the tree.  Loops are run iteration by iteration while the values stay
+    // precise enough to decide the loop condition, so counted loops with constant bounds are followed exactly.  Once a
+    // step budget runs out the remaining iterations are joined, and ranges that keep growing are widened to infinity.
+    class TypeInference : public Visitor {
+    public:
+        // Variables are named after the node that creates their alloca in codegen: the assignment that first
+        // defines them, the FOR loop for its variable, or the argument
+        using Slot = AST *;
+        using State = std::map<Slot, NumRange>;
+
+        // Analyse a function, replacing the results for the last one
+        void analyse(FuncDefAST *func, bool fastMath);
+        // Calls to a function with this name and number of arguments only compute a value in range, like len giving
+        // a length.  A top range forgets the function
+        void addKnownCall(const std::string &name, size_t args, const NumRange &range);
+        // Every value the expression produced is an exact integer
+        bool isInt(AST *node);
+        // Every value stored in the variable created by node is an exact integer
+        bool isIntVar(AST *node);
+        NumRange getRange(AST *node);
+
+        void visit(BlockAST* node) override;
+        void visit(NumberAST* node) override;
+        void visit(NameAST* node) override;
+        void visit(ArrayAST* node) override;
+        void visit(AssignmentAST* node) override;
+        void visit(FuncCallAST* node) override;
+        void visit(BinaryOpAST* node) override;
+        void visit(UnaryOpAST* node) override;
+        void visit(TernaryOpAST* node) override;
+        void visit(IfAST* node) override;
+        void visit(ForAST* node) override;
+        void visit(FuncDefAST* node) override;
+
+    private:
+        // Slot each variable reference and assignment refers to
+        std::map<AST *, Slot> slotOf;
+        // Values at the current point of the function.  Missing slots haven't been assigned on this path
+        State state;
+        // Every value each expression and slot has had
+        std::map<AST *, NumRange> exprs, slots;
+        // Value of the last expression visited
+        NumRange result;
+        bool fastMath = false;
+        std::map<std::pair<std::string, size_t>, NumRange> knownCalls;
+        // Expressions evaluated so far, against the budget
+        unsigned long steps = 0;
+
+        NumRange eval(AST *node);
+        void assign(Slot slot, const NumRange &val);
+        static State joinStates(const State &a, const State &b);
+        // Run a loop body then its step and condition.  Returns the value of the condition
+        NumRange iterate(ForAST *node);
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_TYPEINFER_H
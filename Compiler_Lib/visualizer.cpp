@@ -30,7 +30,7 @@ namespace Compiler {
 
 	void Visualizer::visit(BlockAST* node)
 	{
-		printText("BLOCK:");
+		printText(node->isRegion() ? "REGION:" : "BLOCK:");
 		tabs += 1;
 		for (const auto &i : node->getChildren()) {
 			i->accept(this);
@@ -51,6 +51,11 @@ namespace Compiler {
 
 	void Visualizer::visit(ArrayAST* node)
 	{
+		node->getName()->accept(this);
+		printText("[", false, false);
+		for (const auto &val : node->values)
+			val->accept(this);
+		printText("]", false, false);
 	}
 
 	void Visualizer::visit(AssignmentAST* node)
@@ -0,0 +1,280 @@
+#include "vm.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#ifdef __linux__
+#include <dlfcn.h>
+#endif
+
+// Labels as values let every instruction jump straight to the next one's handler, instead of going back through a
+// switch.  Each handler ends in its own indirect branch, which branch predictors handle far better
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+namespace Compiler {
+
+    #define RUNTIME_MATH1(fn) {#fn, 1, true, reinterpret_cast<NativeFunction>(+[](double x) { return std::fn(x); })}
+    #define RUNTIME_MATH2(fn) \
+        {#fn, 2, true, reinterpret_cast<NativeFunction>(+[](double x, double y) { return std::fn(x, y); })}
+
+    static const RuntimeFunction runtimeFunctions[] = {
+        RUNTIME_MATH1(sqrt), RUNTIME_MATH1(sin), RUNTIME_MATH1(cos), RUNTIME_MATH1(exp), RUNTIME_MATH1(exp2),
+        RUNTIME_MATH1(log), RUNTIME_MATH1(log2), RUNTIME_MATH1(log10), RUNTIME_MATH1(fabs), RUNTIME_MATH1(floor),
+        RUNTIME_MATH1(ceil), RUNTIME_MATH1(trunc), RUNTIME_MATH1(round), RUNTIME_MATH1(rint),
+        RUNTIME_MATH1(nearbyint), RUNTIME_MATH2(pow), RUNTIME_MATH2(copysign), RUNTIME_MATH2(fmin),
+        RUNTIME_MATH2(fmax),
+        {"fma", 3, true, reinterpret_cast<NativeFunction>(+[](double x, double y, double z) {
+            return std::fma(x, y, z);
+        })},
+        // The same builtins linked programs get
+        {"printd", 1, false, reinterpret_cast<NativeFunction>(printd)},
+        {"putchard", 1, false, reinterpret_cast<NativeFunction>(putchard)},
+        {"readd", 0, false, reinterpret_cast<NativeFunction>(readd)},
+        {"eof", 0, false, reinterpret_cast<NativeFunction>(eof)},
+        {"mapin", 1, false, reinterpret_cast<NativeFunction>(mapin)},
+        {"mapout", 2, false, reinterpret_cast<NativeFunction>(mapout)},
+        {"array", 1, false, reinterpret_cast<NativeFunction>(array)},
+        {"len", 1, false, reinterpret_cast<NativeFunction>(len)},
+    };
+
+    #undef RUNTIME_MATH1
+    #undef RUNTIME_MATH2
+
+    const RuntimeFunction *lookupRuntimeFunction(const std::string &name, size_t args)
+    {
+        for (const auto &function : runtimeFunctions) {
+            if (name == function.name && args == function.args)
+                return &function;
+        }
+        return nullptr;
+    }
+
+    // Registers hold at most 512MB.  Deeper recursion than that is a stack overflow
+    static const size_t maxStack = size_t(1) << 26;
+
+    // Comparisons are unordered, so they are true if either side is NaN
+    static inline bool lt(double l, double r) { return !(l >= r); }
+    static inline bool gt(double l, double r) { return !(l <= r); }
+    static inline bool eq(double l, double r) { return !(l < r || l > r); }
+    static inline bool ne(double l, double r) { return l != r; }
+    static inline bool ge(double l, double r) { return !(l < r); }
+    static inline bool le(double l, double r) { return !(l > r); }
+
+    // Conditions are an ordered comparison with zero, so NaN is false
+    static inline bool isTrue(double val) { return val < 0 || val > 0; }
+
+    // Address of an array element.  A bad index stops the program the same way it does in generated code
+    static inline double *element(double array, double index)
+    {
+        auto header = reinterpret_cast<const SimpleArray *>(static_cast<uintptr_t>(array));
+        if (!(index >= 0 && index < static_cast<double>(header->length) &&
+              index == static_cast<double>(static_cast<int64_t>(index))))
+            simple_index_error(index, static_cast<double>(header->length));
+        return header->data + static_cast<int64_t>(index);
+    }
+
+    // fmod is exact, so whole numbers can use an integer remainder, which is far quicker.  The result has the sign of
+    // the dividend either way, including -0
+    static inline double mod(double l, double r)
+    {
+        const double limit = 9007199254740992.0;
+        if (std::fabs(l) < limit && std::fabs(r) < limit && r != 0) {
+            auto li = static_cast<int64_t>(l), ri = static_cast<int64_t>(r);
+            if (static_cast<double>(li) == l && static_cast<double>(ri) == r) {
+                int64_t rem = li % ri;
+                return rem ? static_cast<double>(rem) : std::copysign(0.0, l);
+            }
+        }
+        return std::fmod(l, r);
+    }
+
+    VM::VM(const BytecodeProgram &program) : program(program)
+    {
+        natives.resize(program.functions.size());
+        memos.resize(program.functions.size());
+        for (size_t i = 0; i < program.functions.size(); i++) {
+            const BytecodeFunction &func = program.functions[i];
+            if (func.defined)
+                continue;
+            if (const RuntimeFunction *runtime = lookupRuntimeFunction(func.name, func.params)) {
+                natives[i] = runtime->address;
+                continue;
+            }
+#ifdef __linux__
+            // Anything else the compiler itself links against, like the rest of libm
+            natives[i] = reinterpret_cast<NativeFunction>(dlsym(RTLD_DEFAULT, func.name.c_str()));
+#endif
+            if (!natives[i])
+                throw std::runtime_error("VM: Unknown external function " + func.name);
+        }
+    }
+
+    size_t VM::KeyHash::operator()(const std::vector<uint64_t> &key) const
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t bits : key)
+            hash = (hash ^ bits) * 0x9e3779b97f4a7c15ULL;
+        return hash ^ (hash >> 33);
+    }
+
+    void VM::reserve(size_t base, const BytecodeFunction *func)
+    {
+        size_t needed = base + func->frameSize;
+        if (needed <= stack.size())
+            return;
+        if (needed > maxStack)
+            throw std::runtime_error("VM: Stack overflow in " + func->name);
+        stack.resize(std::min(std::max(needed, stack.size() * 2), maxStack));
+    }
+
+    double VM::callNative(NativeFunction native, unsigned args, const double *regs)
+    {
+        switch (args) {
+            case 0:
+                return reinterpret_cast<double (*)()>(native)();
+            case 1:
+                return reinterpret_cast<double (*)(double)>(native)(regs[0]);
+            case 2:
+                return reinterpret_cast<double (*)(double, double)>(native)(regs[0], regs[1]);
+            case 3:
+                return reinterpret_cast<double (*)(double, double, double)>(native)(regs[0], regs[1], regs[2]);
+            case 4:
+                return reinterpret_cast<double (*)(double, double, double, double)>(native)(
+                        regs[0], regs[1], regs[2], regs[3]);
+            case 5:
+                return reinterpret_cast<double (*)(double, double, double, double, double)>(native)(
+                        regs[0], regs[1], regs[2], regs[3], regs[4]);
+            default:
+                return reinterpret_cast<double (*)(double, double, double, double, double, double)>(native)(
+                        regs[0], regs[1], regs[2], regs[3], regs[4], regs[5]);
+        }
+    }
+
+    double VM::run()
+    {
+        if (program.main < 0)
+            throw std::runtime_error("VM: No main function");
+
+        const BytecodeFunction *func = &program.functions[program.main];
+        size_t base = 0;
+        stack.assign(std::max<size_t>(func->frameSize, 1 << 16), 0.0);
+        frames.clear();
+        double *R = stack.data();
+        std::copy(func->constants.begin(), func->constants.end(), R + func->params);
+        const Instruction *pc = func->code.data();
+        std::vector<uint64_t> key;
+        double value;
+
+    #ifdef VM_COMPUTED_GOTO
+        static void *const dispatchTable[] = {
+        #define BYTECODE_LABEL(name) &&op_##name,
+            BYTECODE_OPS(BYTECODE_LABEL)
+        #undef BYTECODE_LABEL
+        };
+        #define CASE(name) op_##name
+        #define DISPATCH() goto *dispatchTable[static_cast<uint8_t>(pc->op)]
+    #else
+        #define CASE(name) case Op::name
+        #define DISPATCH() goto dispatch
+    #endif
+        #define NEXT() do { ++pc; DISPATCH(); } while (false)
+        #define JUMP() do { pc = func->code.data() + pc->target; DISPATCH(); } while (false)
+        // A comparison giving 1 or 0, the compare-and-branch instructions, and the end of a counted loop
+        #define COMPARE(name, test) \
+            CASE(name): R[pc->a] = test(R[pc->b], R[pc->c]) ? 1.0 : 0.0; NEXT(); \
+            CASE(Jump##name): if (test(R[pc->a], R[pc->b])) JUMP(); NEXT(); \
+            CASE(JumpNot##name): if (!test(R[pc->a], R[pc->b])) JUMP(); NEXT(); \
+            CASE(For##name): R[pc->a] += R[pc->b]; if (test(R[pc->a], R[pc->c])) JUMP(); NEXT();
+
+    #ifdef VM_COMPUTED_GOTO
+        DISPATCH();
+        {
+    #else
+    dispatch:
+        switch (pc->op) {
+    #endif
+            CASE(Move): R[pc->a] = R[pc->b]; NEXT();
+            CASE(Add): R[pc->a] = R[pc->b] + R[pc->c]; NEXT();
+            CASE(Sub): R[pc->a] = R[pc->b] - R[pc->c]; NEXT();
+            CASE(Mul): R[pc->a] = R[pc->b] * R[pc->c]; NEXT();
+            CASE(Div): R[pc->a] = R[pc->b] / R[pc->c]; NEXT();
+            CASE(Mod): R[pc->a] = mod(R[pc->b], R[pc->c]); NEXT();
+            CASE(Pow): R[pc->a] = std::pow(R[pc->b], R[pc->c]); NEXT();
+            CASE(PowHalf): R[pc->a] = R[pc->b] == -INFINITY ? INFINITY : std::fabs(std::sqrt(R[pc->b])); NEXT();
+            COMPARE(Lt, lt)
+            COMPARE(Gt, gt)
+            COMPARE(Eq, eq)
+            COMPARE(Ne, ne)
+            COMPARE(Ge, ge)
+            COMPARE(Le, le)
+            CASE(Not): R[pc->a] = isTrue(R[pc->b]) ? 0.0 : 1.0; NEXT();
+            CASE(Bool): R[pc->a] = isTrue(R[pc->b]) ? 1.0 : 0.0; NEXT();
+            CASE(Jump): JUMP();
+            CASE(JumpIf): if (isTrue(R[pc->a])) JUMP(); NEXT();
+            CASE(JumpIfNot): if (!isTrue(R[pc->a])) JUMP(); NEXT();
+
+            CASE(Load): R[pc->a] = *element(R[pc->b], R[pc->c]); NEXT();
+            CASE(Store): *element(R[pc->a], R[pc->b]) = R[pc->c]; NEXT();
+
+            CASE(Call): {
+                // The callee's frame starts at the first argument, which is also where the result goes
+                const BytecodeFunction *callee = &program.functions[pc->b];
+                frames.push_back({func, pc + 1, base});
+                base += pc->a;
+                reserve(base, callee);
+                func = callee;
+                R = stack.data() + base;
+                std::copy(func->constants.begin(), func->constants.end(), R + func->params);
+                pc = func->code.data();
+                DISPATCH();
+            }
+            CASE(CallExt):
+                R[pc->a] = callNative(natives[pc->b], pc->c, R + pc->a);
+                NEXT();
+            CASE(Return):
+                value = R[pc->a];
+                goto ret;
+
+            CASE(MemoGet): {
+                // Keep the arguments the function was called with, since tail calls change the parameters
+                key.resize(func->params);
+                std::memcpy(R + pc->a, R, func->params * sizeof(double));
+                std::memcpy(key.data(), R, func->params * sizeof(double));
+                auto &memo = memos[func - program.functions.data()];
+                auto cached = memo.find(key);
+                if (cached != memo.end()) {
+                    value = cached->second;
+                    goto ret;
+                }
+                NEXT();
+            }
+            CASE(MemoPut):
+                key.resize(func->params);
+                std::memcpy(key.data(), R + pc->b, func->params * sizeof(double));
+                memos[func - program.functions.data()][key] = R[pc->a];
+                NEXT();
+        }
+
+    ret:
+        if (frames.empty())
+            return value;
+        stack[base] = value;
+        func = frames.back().func;
+        pc = frames.back().returnTo;
+        base = frames.back().base;
+        frames.pop_back();
+        R = stack.data() + base;
+        DISPATCH();
+
+        #undef CASE
+        #undef DISPATCH
+        #undef NEXT
+        #undef JUMP
+        #undef COMPARE
+    }
+
+}  // namespace Compiler
@@ -0,0 +1,67 @@
+#pragma once
+#ifndef COMPILER_VM_H
+#define COMPILER_VM_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bytecode.h"
+
+namespace Compiler {
+
+    // A C function EXT declarations can call
+    using NativeFunction = void (*)();
+
+    // Functions the VM provides itself: the math functions code generation turns into intrinsics, and the standard
+    // library programs are linked with
+    struct RuntimeFunction {
+        const char *name;
+        unsigned args;
+        // Only computes on its arguments
+        bool pure;
+        NativeFunction address;
+    };
+    // Find a runtime function by name and number of arguments, or nullptr
+    const RuntimeFunction *lookupRuntimeFunction(const std::string &name, size_t args);
+
+    // Runs bytecode.  Registers are unboxed doubles on a stack shared by every call, and a call's frame starts at
+    // the caller's register holding its first argument, so arguments are never copied.  Instructions are dispatched
+    // with computed gotos where the compiler supports them
+    class VM {
+    public:
+        // Bind the program's EXT functions.  Throws if one can't be found
+        explicit VM(const BytecodeProgram &program);
+
+        // Run main and return its value
+        double run();
+
+        // EXT functions can take at most this many arguments
+        static const unsigned maxNativeArgs = 6;
+
+    private:
+        const BytecodeProgram &program;
+        // Address of each EXT function, by function index
+        std::vector<NativeFunction> natives;
+
+        struct KeyHash {
+            size_t operator()(const std::vector<uint64_t> &key) const;
+        };
+        // Cached results of each MEMO function, keyed on the bits of the arguments
+        std::vector<std::unordered_map<std::vector<uint64_t>, double, KeyHash>> memos;
+
+        struct Frame {
+            const BytecodeFunction *func;
+            const Instruction *returnTo;
+            size_t base;
+        };
+        std::vector<double> stack;
+        std::vector<Frame> frames;
+
+        // Make room for a frame starting at base
+        void reserve(size_t base, const BytecodeFunction *func);
+        static double callNative(NativeFunction native, unsigned args, const double *regs);
+    };
+}  // namespace Compiler
+
+#endif //COMPILER_VM_H
@@ -0,0 +1,191 @@
+#include "runtime.h"
+#include "format.h"
+#include "internal.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Arrays made by array live until the program exits, so their headers are never freed
+static double newArray(double *data, int64_t length)
+{
+    struct SimpleArray *array = malloc(sizeof(*array));
+    if (!array)
+        runtimeError("Out of memory for an array");
+    array->data = data;
+    array->length = length;
+    return (double)(uintptr_t)array;
+}
+
+// Error messages are built up from pieces, since the runtime doesn't use printf.  Pieces that don't fit in the size
+// byte buffer are cut short
+static void append(char *message, size_t size, const char *text)
+{
+    strncat(message, text, size - 1 - strlen(message));
+}
+
+static void appendNumber(char *message, size_t size, double x)
+{
+    char text[FORMAT_MAX + 1];
+    text[formatShortest(x, text)] = '\0';
+    append(message, size, text);
+}
+
+// The path the environment variable <prefix><k> holds, like SIMPLE_MAPIN0 for mapin(0)
+static const char *mappedPath(const char *prefix, double k)
+{
+    char variable[64] = "", message[512] = "";
+    if (!(k >= 0 && k <= 999 && k == (double)(int)k)) {
+        append(message, sizeof(message), prefix);
+        append(message, sizeof(message), ": the file number must be a whole number from 0 to 999, not ");
+        appendNumber(message, sizeof(message), k);
+        runtimeError(message);
+    }
+    append(variable, sizeof(variable), prefix);
+    appendNumber(variable, sizeof(variable), k);
+    const char *path = getenv(variable);
+    if (!path || !*path) {
+        append(message, sizeof(message), variable);
+        append(message, sizeof(message), " isn't set to a file name");
+        runtimeError(message);
+    }
+    return path;
+}
+
+// Lengths are whole numbers of doubles that fit in memory
+static void checkLength(const char *function, double n)
+{
+    if (n >= 0 && n <= (double)SIMPLE_MAX_LENGTH && n == (double)(int64_t)n)
+        return;
+    char message[512] = "";
+    append(message, sizeof(message), function);
+    append(message, sizeof(message), ": the length must be a whole number from 0 to 2^52, not ");
+    appendNumber(message, sizeof(message), n);
+    runtimeError(message);
+}
+
+static void fileError(const char *path, const char *problem)
+{
+    char message[512] = "";
+    append(message, sizeof(message), path);
+    append(message, sizeof(message), problem);
+    runtimeError(message);
+}
+
+#ifdef _WIN32
+
+double mapin(double k)
+{
+    mappedPath("SIMPLE_MAPIN", k);
+    runtimeError("mapin needs mmap, which this platform doesn't have");
+}
+
+double mapout(double k, double n)
+{
+    mappedPath("SIMPLE_MAPOUT", k);
+    runtimeError("mapout needs mmap, which this platform doesn't have");
+}
+
+#else
+
+// Map size bytes of fd.  Nothing is mapped for an empty file, since there is nothing to index
+static double *mapFile(const char *path, int fd, size_t size, int flags)
+{
+    if (!size)
+        return NULL;
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (data == MAP_FAILED)
+        fileError(path, ": unable to map file");
+    return data;
+}
+
+double mapin(double k)
+{
+    const char *path = mappedPath("SIMPLE_MAPIN", k);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        fileError(path, ": unable to open file");
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+        fileError(path, ": unable to read file size");
+    if (info.st_size % sizeof(double))
+        fileError(path, ": file size isn't a whole number of doubles");
+    if ((uint64_t)info.st_size / sizeof(double) > (uint64_t)SIMPLE_MAX_LENGTH)
+        fileError(path, ": file is too large");
+
+    // A private mapping, so the program can write to the array without changing the file
+    size_t size = (size_t)info.st_size;
+    double *data = mapFile(path, fd, size, MAP_PRIVATE);
+    close(fd);
+    // Programs mostly read data like this front to back, so the kernel can read ahead further
+    if (data)
+        madvise(data, size, MADV_SEQUENTIAL);
+    return newArray(data, (int64_t)(size / sizeof(double)));
+}
+
+double mapout(double k, double n)
+{
+    const char *path = mappedPath("SIMPLE_MAPOUT", k);
+    checkLength("mapout", n);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        fileError(path, ": unable to create file");
+    // The file starts out as n zeros, without writing them
+    size_t size = (size_t)n * sizeof(double);
+    if (ftruncate(fd, (off_t)size) < 0)
+        fileError(path, ": unable to set file size");
+
+    // A shared mapping, so what the program stores ends up in the file
+    double *data = mapFile(path, fd, size, MAP_SHARED);
+    close(fd);
+    return newArray(data, (int64_t)n);
+}
+
+#endif
+
+double array(double n)
+{
+    checkLength("array", n);
+    // calloc gets fresh pages from the kernel for large arrays, which are already zero
+    double *data = n ? calloc((size_t)n, sizeof(double)) : NULL;
+    if (n && !data)
+        runtimeError("Out of memory for an array");
+    return newArray(data, (int64_t)n);
+}
+
+double simple_region_array(double n)
+{
+    checkLength("array", n);
+    // The header and the elements are allocated together
+    size_t count = (size_t)n;
+    if (count > (SIZE_MAX - sizeof(struct SimpleArray)) / sizeof(double))
+        runtimeError("Out of memory for an array");
+    struct SimpleArray *array = regionAllocate(sizeof(*array) + count * sizeof(double));
+    array->data = (double *)(array + 1);
+    array->length = (int64_t)count;
+    return (double)(uintptr_t)array;
+}
+
+double len(double array)
+{
+    return (double)((struct SimpleArray *)(uintptr_t)array)->length;
+}
+
+void simple_index_error(double index, double length)
+{
+    char message[512] = "";
+    append(message, sizeof(message), "Index ");
+    appendNumber(message, sizeof(message), index);
+    if (index >= -9e18 && index <= 9e18 && index == (double)(int64_t)index) {
+        append(message, sizeof(message), " is out of bounds for an array of length ");
+        appendNumber(message, sizeof(message), length);
+    } else {
+        append(message, sizeof(message), " isn't a whole number");
+    }
+    runtimeError(message);
+}
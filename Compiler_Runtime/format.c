@@ -0,0 +1,373 @@
+#include "format.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A double is mantissa * 2^exponent, with the implicit leading bit included in the mantissa
+struct Decomposed {
+    int negative;
+    // Infinity or NaN
+    int special;
+    uint64_t mantissa;
+    int exponent;
+};
+
+static struct Decomposed decompose(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    struct Decomposed d;
+    d.negative = (int)(bits >> 63);
+    int biased = (int)((bits >> 52) & 0x7ff);
+    d.mantissa = bits & ((UINT64_C(1) << 52) - 1);
+    d.special = biased == 0x7ff;
+    if (biased == 0 || d.special) {
+        // Subnormals have no implicit bit, and infinities are told apart from NaNs by a fraction of 0
+        d.exponent = -1074;
+    } else {
+        d.mantissa |= UINT64_C(1) << 52;
+        d.exponent = biased - 1075;
+    }
+    return d;
+}
+
+static size_t formatSpecial(struct Decomposed d, char *out)
+{
+    size_t len = 0;
+    if (d.negative)
+        out[len++] = '-';
+    memcpy(out + len, d.mantissa ? "nan" : "inf", 3);
+    return len + 3;
+}
+
+// Write n in decimal
+static size_t writeUnsigned(uint64_t n, char *out)
+{
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    for (size_t i = 0; i < len; i++)
+        out[i] = digits[len - 1 - i];
+    return len;
+}
+
+// Write n in decimal, padded with zeros to width digits
+static void writePadded(uint32_t n, int width, char *out)
+{
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = (char)('0' + n % 10);
+        n /= 10;
+    }
+}
+
+// Unsigned integers big enough for any double scaled by a power of ten, for exact conversions.  Digits are base 2^32,
+// least significant first, and only the first size are used
+#define BIG_DIGITS 40
+
+struct Big {
+    int size;
+    uint32_t digits[BIG_DIGITS];
+};
+
+static void bigSet(struct Big *big, uint64_t value)
+{
+    big->digits[0] = (uint32_t)value;
+    big->digits[1] = (uint32_t)(value >> 32);
+    big->size = value >> 32 ? 2 : value ? 1 : 0;
+}
+
+static void bigMultiply(struct Big *big, uint32_t factor)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < big->size; i++) {
+        uint64_t product = (uint64_t)big->digits[i] * factor + carry;
+        big->digits[i] = (uint32_t)product;
+        carry = product >> 32;
+    }
+    if (carry)
+        big->digits[big->size++] = (uint32_t)carry;
+}
+
+static void bigMultiplyPow10(struct Big *big, int power)
+{
+    for (; power >= 9; power -= 9)
+        bigMultiply(big, 1000000000);
+    static const uint32_t small[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+    bigMultiply(big, small[power]);
+}
+
+static void bigShiftLeft(struct Big *big, int shift)
+{
+    if (!big->size)
+        return;
+    int words = shift / 32, bits = shift % 32;
+    big->digits[big->size] = 0;
+    for (int i = big->size; i >= 0; i--) {
+        uint32_t high = bits ? big->digits[i] << bits : big->digits[i];
+        uint32_t low = bits && i > 0 ? big->digits[i - 1] >> (32 - bits) : 0;
+        big->digits[i + words] = high | low;
+    }
+    for (int i = 0; i < words; i++)
+        big->digits[i] = 0;
+    big->size += words + 1;
+    while (big->size && !big->digits[big->size - 1])
+        big->size--;
+}
+
+static int bigCompare(const struct Big *a, const struct Big *b)
+{
+    if (a->size != b->size)
+        return a->size < b->size ? -1 : 1;
+    for (int i = a->size - 1; i >= 0; i--) {
+        if (a->digits[i] != b->digits[i])
+            return a->digits[i] < b->digits[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void bigAdd(struct Big *sum, const struct Big *a, const struct Big *b)
+{
+    int size = a->size > b->size ? a->size : b->size;
+    uint64_t carry = 0;
+    for (int i = 0; i < size; i++) {
+        carry += (i < a->size ? a->digits[i] : 0) + (uint64_t)(i < b->size ? b->digits[i] : 0);
+        sum->digits[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    sum->size = size;
+    if (carry)
+        sum->digits[sum->size++] = (uint32_t)carry;
+}
+
+// a -= b, where a >= b
+static void bigSubtract(struct Big *a, const struct Big *b)
+{
+    int64_t borrow = 0;
+    for (int i = 0; i < a->size; i++) {
+        borrow += (int64_t)a->digits[i] - (i < b->size ? b->digits[i] : 0);
+        a->digits[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    while (a->size && !a->digits[a->size - 1])
+        a->size--;
+}
+
+// Divide by 10^9 in place, returning the remainder
+static uint32_t bigDivideBillion(struct Big *big)
+{
+    uint64_t remainder = 0;
+    for (int i = big->size - 1; i >= 0; i--) {
+        uint64_t current = (remainder << 32) | big->digits[i];
+        big->digits[i] = (uint32_t)(current / 1000000000);
+        remainder = current % 1000000000;
+    }
+    while (big->size && !big->digits[big->size - 1])
+        big->size--;
+    return (uint32_t)remainder;
+}
+
+static const char fixedZeros[] = ".000000";
+
+size_t formatFixed(double x, char *out)
+{
+    struct Decomposed d = decompose(x);
+    if (d.special)
+        return formatSpecial(d, out);
+    size_t len = 0;
+    if (d.negative)
+        out[len++] = '-';
+
+    if (d.exponent >= 0) {
+        // Whole numbers need no rounding.  Small ones fit in 64 bits
+        if (d.exponent <= 11) {
+            len += writeUnsigned(d.mantissa << d.exponent, out + len);
+        } else {
+            struct Big big;
+            bigSet(&big, d.mantissa);
+            bigShiftLeft(&big, d.exponent);
+            uint32_t groups[36];
+            int count = 0;
+            while (big.size)
+                groups[count++] = bigDivideBillion(&big);
+            len += writeUnsigned(groups[--count], out + len);
+            while (count) {
+                writePadded(groups[--count], 9, out + len);
+                len += 9;
+            }
+        }
+        memcpy(out + len, fixedZeros, 7);
+        return len + 7;
+    }
+
+#ifdef __SIZEOF_INT128__
+    // The fraction's six decimals are fraction * 10^6 / 2^shift, which needs at most 73 bits.  Round that half to even,
+    // like printf, carrying into the whole part.  Only shifts, so there's no call into the compiler's 128 bit division
+    int shift = -d.exponent;
+    uint64_t whole = shift < 64 ? d.mantissa >> shift : 0;
+    uint64_t fraction = shift < 64 ? d.mantissa & ((UINT64_C(1) << shift) - 1) : d.mantissa;
+    uint64_t decimals = 0;
+    if (shift < 128) {
+        unsigned __int128 scaled = (unsigned __int128)fraction * 1000000;
+        decimals = (uint64_t)(scaled >> shift);
+        unsigned __int128 remainder = scaled & (((unsigned __int128)1 << shift) - 1);
+        unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+        if (remainder > half || (remainder == half && (decimals & 1)))
+            decimals++;
+    }
+    if (decimals == 1000000) {
+        whole++;
+        decimals = 0;
+    }
+    len += writeUnsigned(whole, out + len);
+    out[len++] = '.';
+    writePadded((uint32_t)decimals, 6, out + len);
+    return len + 6;
+#else
+    return (size_t)snprintf(out, FORMAT_MAX, "%f", x);
+#endif
+}
+
+// Scientific and fixed notation switch over at these decimal exponents
+static const int minFixedExponent = -5, maxFixedExponent = 17;
+
+// Digits are 0.digits * 10^point
+static size_t layoutDigits(const char *digits, int count, int point, char *out)
+{
+    size_t len = 0;
+    int exponent = point - 1;
+    if (exponent < minFixedExponent || exponent >= maxFixedExponent) {
+        out[len++] = digits[0];
+        if (count > 1) {
+            out[len++] = '.';
+            memcpy(out + len, digits + 1, count - 1);
+            len += count - 1;
+        }
+        out[len++] = 'e';
+        out[len++] = exponent < 0 ? '-' : '+';
+        unsigned magnitude = exponent < 0 ? -exponent : exponent;
+        if (magnitude < 10)
+            out[len++] = '0';
+        return len + writeUnsigned(magnitude, out + len);
+    }
+
+    if (point <= 0) {
+        out[len++] = '0';
+        out[len++] = '.';
+        memset(out + len, '0', -point);
+        len += -point;
+        memcpy(out + len, digits, count);
+        return len + count;
+    }
+    if (point >= count) {
+        memcpy(out + len, digits, count);
+        len += count;
+        memset(out + len, '0', point - count);
+        return len + point - count;
+    }
+    memcpy(out + len, digits, point);
+    len += point;
+    out[len++] = '.';
+    memcpy(out + len, digits + point, count - point);
+    return len + count - point;
+}
+
+size_t formatShortest(double x, char *out)
+{
+    struct Decomposed d = decompose(x);
+    if (d.special)
+        return formatSpecial(d, out);
+    size_t len = 0;
+    if (d.negative)
+        out[len++] = '-';
+    if (!d.mantissa) {
+        out[len++] = '0';
+        return len;
+    }
+
+    // Whole numbers a double holds exactly are their own shortest form
+    if (d.exponent <= 0 && d.exponent > -53 && !(d.mantissa & ((UINT64_C(1) << -d.exponent) - 1))) {
+        uint64_t whole = d.mantissa >> -d.exponent;
+        char digits[20];
+        int count = (int)writeUnsigned(whole, digits);
+        int point = count;
+        while (digits[count - 1] == '0')
+            count--;
+        return len + layoutDigits(digits, count, point, out + len);
+    }
+
+    // Burger and Dybvig's free-format algorithm.  The value is r/s, and anything within the rounding interval from
+    // r - mMinus to r + mPlus reads back as x.  When the mantissa is even, the interval's ends round to x too
+    struct Big r, s, mPlus, mMinus, sum;
+    int even = !(d.mantissa & 1);
+    // The gap to the next double down is half as wide at powers of two
+    int unequal = d.mantissa == UINT64_C(1) << 52 && d.exponent > -1074;
+    bigSet(&r, d.mantissa << (unequal ? 2 : 1));
+    bigSet(&mPlus, unequal ? 2 : 1);
+    bigSet(&mMinus, 1);
+    if (d.exponent >= 0) {
+        bigShiftLeft(&r, d.exponent);
+        bigShiftLeft(&mPlus, d.exponent);
+        bigShiftLeft(&mMinus, d.exponent);
+        bigSet(&s, unequal ? 4 : 2);
+    } else {
+        bigSet(&s, 1);
+        bigShiftLeft(&s, -d.exponent + (unequal ? 2 : 1));
+    }
+
+    // Estimate the decimal exponent from the binary one.  It can be one too small, which the check below fixes
+    int bits = 64;
+    while (!(d.mantissa >> (bits - 1)))
+        bits--;
+    double estimate = (d.exponent + bits - 1) * 0.30102999566398114 - 1e-10;
+    int point = (int)estimate + (estimate > (int)estimate ? 1 : 0);
+    if (point >= 0) {
+        bigMultiplyPow10(&s, point);
+    } else {
+        bigMultiplyPow10(&r, -point);
+        bigMultiplyPow10(&mPlus, -point);
+        bigMultiplyPow10(&mMinus, -point);
+    }
+    bigAdd(&sum, &r, &mPlus);
+    int high = bigCompare(&sum, &s);
+    if (even ? high >= 0 : high > 0) {
+        bigMultiply(&s, 10);
+        point++;
+    }
+
+    char digits[20];
+    int count = 0;
+    for (;;) {
+        bigMultiply(&r, 10);
+        bigMultiply(&mPlus, 10);
+        bigMultiply(&mMinus, 10);
+        int digit = 0;
+        while (bigCompare(&r, &s) >= 0) {
+            bigSubtract(&r, &s);
+            digit++;
+        }
+        // Stop once the digits so far, or one more than them, are inside the interval
+        int low = bigCompare(&r, &mMinus);
+        bigAdd(&sum, &r, &mPlus);
+        high = bigCompare(&sum, &s);
+        int lowOk = even ? low <= 0 : low < 0;
+        int highOk = even ? high >= 0 : high > 0;
+        if (!lowOk && !highOk) {
+            digits[count++] = (char)('0' + digit);
+            continue;
+        }
+        if (lowOk && highOk) {
+            // Both fit, so take the closer one
+            bigAdd(&sum, &r, &r);
+            if (bigCompare(&sum, &s) >= 0)
+                digit++;
+        } else if (highOk) {
+            digit++;
+        }
+        digits[count++] = (char)('0' + digit);
+        break;
+    }
+    return len + layoutDigits(digits, count, point, out + len);
+}
@@ -0,0 +1,25 @@
+#ifndef SIMPLE_FORMAT_H
+#define SIMPLE_FORMAT_H
+
+#include <stddef.h>
+
+// Locale independent double formatting that never allocates.  Both write at most FORMAT_MAX characters to out, without
+// a terminating NUL, and return how many they wrote
+
+// Longest output: a sign, 309 integer digits, a point and 6 decimals
+#define FORMAT_MAX 320
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Exactly what printf("%f") writes: the value correctly rounded to 6 decimal places
+size_t formatFixed(double x, char *out);
+// The fewest significant digits that read back as x.  Scientific notation for exponents below -5 or from 17 up
+size_t formatShortest(double x, char *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIMPLE_FORMAT_H
@@ -0,0 +1,196 @@
+#include "runtime.h"
+#include "internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#define open _open
+#define read _read
+#else
+#include <unistd.h>
+#endif
+
+// Input is read a large block at a time, and numbers are parsed straight out of the buffer.  A number that runs off
+// the end of the buffer is moved to the front before the next read, so it never has to be copied anywhere else
+#define INPUT_BUFFER (1 << 20)
+
+static struct {
+    int fd;
+    int opened, ended;
+    // The unread input is data[start, end)
+    size_t start, end;
+    // One spare byte, so a number can be NUL terminated where it is for strtod
+    char data[INPUT_BUFFER + 1];
+} in;
+
+// SIMPLE_INPUT names a file to read instead of stdin
+static void openInput(void)
+{
+    in.opened = 1;
+    const char *path = getenv("SIMPLE_INPUT");
+    if (!path || !*path)
+        return;
+    in.fd = open(path, O_RDONLY);
+    if (in.fd < 0)
+        runtimeError("SIMPLE_INPUT: Unable to open file");
+}
+
+// Read more input after what is left in the buffer.  Returns 0 at the end of the input, or when the buffer is full
+static int fill(void)
+{
+    if (!in.opened)
+        openInput();
+    if (in.ended)
+        return 0;
+    if (in.start) {
+        memmove(in.data, in.data + in.start, in.end - in.start);
+        in.end -= in.start;
+        in.start = 0;
+    }
+    while (in.end < INPUT_BUFFER) {
+        long result = (long)read(in.fd, in.data + in.end, (unsigned)(INPUT_BUFFER - in.end));
+        if (result < 0 && errno == EINTR)
+            continue;
+        // Errors end the input like the end of a file does
+        if (result <= 0) {
+            in.ended = 1;
+            return 0;
+        }
+        in.end += (size_t)result;
+        return 1;
+    }
+    return 0;
+}
+
+static int isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// The length of the number at the start of the buffer, or 0 if there isn't one.  Numbers are an optional sign, digits
+// with an optional decimal point, and an optional exponent
+static size_t numberLength(void)
+{
+    for (;;) {
+        const char *text = in.data + in.start;
+        size_t available = in.end - in.start, len = 0, digits = 0;
+        if (len < available && (text[len] == '-' || text[len] == '+'))
+            len++;
+        for (; len < available && isDigit(text[len]); len++)
+            digits++;
+        if (len < available && text[len] == '.') {
+            for (len++; len < available && isDigit(text[len]); len++)
+                digits++;
+        }
+        if (digits && len < available && (text[len] == 'e' || text[len] == 'E')) {
+            size_t exponent = len + 1;
+            if (exponent < available && (text[exponent] == '-' || text[exponent] == '+'))
+                exponent++;
+            if (exponent < available && isDigit(text[exponent])) {
+                for (len = exponent; len < available && isDigit(text[len]); len++)
+                    ;
+            } else if (exponent == available && fill()) {
+                continue;
+            }
+        }
+        // The number might carry on past what has been read so far
+        if (len == available && fill())
+            continue;
+        return digits ? len : 0;
+    }
+}
+
+// Skip to the next number.  Anything that can't be part of one, like spaces, commas and letters, separates numbers
+static size_t nextNumber(void)
+{
+    for (;;) {
+        while (in.start < in.end) {
+            char c = in.data[in.start];
+            if (isDigit(c) || c == '-' || c == '+' || c == '.') {
+                // A sign or point on its own is skipped like anything else
+                size_t len = numberLength();
+                if (len)
+                    return len;
+            }
+            in.start++;
+        }
+        if (!fill())
+            return 0;
+    }
+}
+
+// Powers of ten that doubles hold exactly
+static const double exactPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static double parseNumber(char *text, size_t len)
+{
+    size_t i = 0;
+    int negative = text[0] == '-';
+    if (text[0] == '-' || text[0] == '+')
+        i++;
+
+    // Up to 19 significant digits fit in 64 bits
+    uint64_t mantissa = 0;
+    int significant = 0, scale = 0, exact = 1;
+    for (int fraction = 0; i < len && (isDigit(text[i]) || text[i] == '.'); i++) {
+        if (text[i] == '.') {
+            fraction = 1;
+            continue;
+        }
+        if (significant == 19) {
+            exact = 0;
+            break;
+        }
+        if (mantissa || text[i] != '0')
+            significant++;
+        mantissa = mantissa * 10 + (uint64_t)(text[i] - '0');
+        scale -= fraction;
+    }
+    if (exact && i < len) {
+        i++;
+        int exponentNegative = text[i] == '-';
+        if (text[i] == '-' || text[i] == '+')
+            i++;
+        int exponent = 0;
+        for (; i < len; i++) {
+            if (exponent < 100000)
+                exponent = exponent * 10 + (text[i] - '0');
+        }
+        scale += exponentNegative ? -exponent : exponent;
+    }
+
+    // When the digits and the power of ten are both exact, one multiplication or division rounds correctly
+    if (exact && mantissa <= (UINT64_C(1) << 53) && scale >= -22 && scale <= 22) {
+        double value = (double)mantissa;
+        value = scale < 0 ? value / exactPowers[-scale] : value * exactPowers[scale];
+        return negative ? -value : value;
+    }
+    if (exact && !mantissa)
+        return negative ? -0.0 : 0.0;
+
+    char after = text[len];
+    text[len] = '\0';
+    double value = strtod(text, NULL);
+    text[len] = after;
+    return value;
+}
+
+double readd(void)
+{
+    size_t len = nextNumber();
+    if (!len)
+        return NAN;
+    char *text = in.data + in.start;
+    in.start += len;
+    return parseNumber(text, len);
+}
+
+double eof(void)
+{
+    return nextNumber() ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#ifndef SIMPLE_RUNTIME_INTERNAL_H
+#define SIMPLE_RUNTIME_INTERNAL_H
+
+#include "runtime.h"
+#include <stddef.h>
+
+// Shared between the runtime's source files, but not something programs can call
+
+// Write message and a newline to stderr after anything already printed, then exit with a failure status
+SIMPLE_NORETURN void runtimeError(const char *message);
+
+// size bytes of zeros from the innermost region, 16 byte aligned.  Freed when the region is left
+void *regionAllocate(size_t size);
+
+#endif // SIMPLE_RUNTIME_INTERNAL_H
@@ -0,0 +1,105 @@
+#include "runtime.h"
+#include "internal.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Regions hand out memory by bumping a pointer through large blocks.  They nest like the calls and REGION blocks that
+// enter them, so they all share one chain of blocks: a mark is just where the pointer was, and leaving a region moves
+// the pointer back there, freeing any blocks started since
+#define REGION_BLOCK (1 << 20)
+// Allocations bigger than this get a block to themselves from calloc, which gets fresh pages from the kernel that are
+// already zero, so pages the program never touches are never backed by memory
+#define REGION_LARGE (128 << 10)
+// The biggest block kept for reuse once it is freed
+#define REGION_SPARE (16 << 20)
+
+struct Block {
+    struct Block *previous;
+    // The end of the block's memory, which starts straight after this header
+    char *end;
+};
+
+static struct {
+    // The block being allocated from, and the next free byte in it
+    struct Block *block;
+    char *next;
+    // The biggest block freed, kept so a region entered on every trip round a loop doesn't call malloc every time
+    struct Block *spare;
+} region;
+
+static char *blockData(struct Block *block)
+{
+    return (char *)(block + 1);
+}
+
+static size_t blockSize(struct Block *block)
+{
+    return (size_t)(block->end - blockData(block));
+}
+
+static int inBlock(struct Block *block, char *mark)
+{
+    return (uintptr_t)mark >= (uintptr_t)blockData(block) && (uintptr_t)mark <= (uintptr_t)block->end;
+}
+
+// Start a block with room for size bytes.  Returns whether it is already zero
+static int newBlock(size_t size)
+{
+    struct Block *block;
+    int large = size > REGION_LARGE, zeroed = 0;
+    if (!large)
+        size = REGION_BLOCK;
+    if (region.spare && blockSize(region.spare) >= size) {
+        block = region.spare;
+        region.spare = NULL;
+    } else {
+        if (size > SIZE_MAX - sizeof(struct Block))
+            runtimeError("Out of memory for an array");
+        block = large ? calloc(1, sizeof(struct Block) + size) : malloc(sizeof(struct Block) + size);
+        if (!block)
+            runtimeError("Out of memory for an array");
+        block->end = blockData(block) + size;
+        zeroed = large;
+    }
+    block->previous = region.block;
+    region.block = block;
+    region.next = blockData(block);
+    return zeroed;
+}
+
+void *regionAllocate(size_t size)
+{
+    // Keeping every size a multiple of 16 keeps every allocation aligned like malloc's
+    if (size > SIZE_MAX - 15)
+        runtimeError("Out of memory for an array");
+    size = (size + 15) & ~(size_t)15;
+    int zeroed = 0;
+    if (size > REGION_LARGE || !region.block || (size_t)(region.block->end - region.next) < size)
+        zeroed = newBlock(size);
+    void *memory = region.next;
+    region.next += size;
+    if (!zeroed)
+        memset(memory, 0, size);
+    return memory;
+}
+
+void *simple_region_enter(void)
+{
+    return region.next;
+}
+
+void simple_region_leave(void *mark)
+{
+    while (region.block && !inBlock(region.block, mark)) {
+        struct Block *block = region.block;
+        region.block = block->previous;
+        if (blockSize(block) <= REGION_SPARE && (!region.spare || blockSize(region.spare) < blockSize(block))) {
+            free(region.spare);
+            region.spare = block;
+        } else {
+            free(block);
+        }
+    }
+    region.next = region.block ? mark : NULL;
+}
@@ -0,0 +1,105 @@
+#include "runtime.h"
+#include "format.h"
+#include "internal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#define isatty _isatty
+#else
+#include <unistd.h>
+#endif
+
+// Output goes through a large buffer per stream, written out when it fills and when the program exits, so printing in
+// a loop costs a memcpy rather than a system call.  Terminals are flushed after every line, like stdio does
+#define STREAM_BUFFER (1 << 16)
+
+struct Stream {
+    int fd;
+    int lineBuffered;
+    size_t used;
+    char data[STREAM_BUFFER];
+};
+
+static struct Stream out = {1}, err = {2};
+static int initialised;
+// SIMPLE_PRINTD=shortest makes printd write the shortest digits that read back exactly, instead of printf's %f
+static int shortest;
+
+static void flushStream(struct Stream *stream)
+{
+    size_t written = 0;
+    while (written < stream->used) {
+        long result = (long)write(stream->fd, stream->data + written, (unsigned)(stream->used - written));
+        if (result < 0 && errno == EINTR)
+            continue;
+        // Nothing sensible can be done about a closed or full output
+        if (result <= 0)
+            break;
+        written += (size_t)result;
+    }
+    stream->used = 0;
+}
+
+static void flushAll(void)
+{
+    flushStream(&out);
+    flushStream(&err);
+}
+
+static void initialise(void)
+{
+    initialised = 1;
+    out.lineBuffered = isatty(out.fd);
+    err.lineBuffered = isatty(err.fd);
+    const char *format = getenv("SIMPLE_PRINTD");
+    shortest = format && strcmp(format, "shortest") == 0;
+    atexit(flushAll);
+}
+
+// Make room for len more characters
+static char *reserve(struct Stream *stream, size_t len)
+{
+    if (!initialised)
+        initialise();
+    if (stream->used + len > STREAM_BUFFER)
+        flushStream(stream);
+    return stream->data + stream->used;
+}
+
+static void commit(struct Stream *stream, size_t len, int endsLine)
+{
+    stream->used += len;
+    if (endsLine && stream->lineBuffered)
+        flushStream(stream);
+}
+
+double putchard(double x)
+{
+    char c = (char)x;
+    *reserve(&err, 1) = c;
+    commit(&err, 1, c == '\n');
+    return 0;
+}
+
+double printd(double x)
+{
+    char *text = reserve(&out, FORMAT_MAX + 1);
+    size_t len = shortest ? formatShortest(x, text) : formatFixed(x, text);
+    text[len++] = '\n';
+    commit(&out, len, 1);
+    return 0;
+}
+
+void runtimeError(const char *message)
+{
+    size_t len = strlen(message);
+    char *text = reserve(&err, len + 1);
+    memcpy(text, message, len);
+    text[len++] = '\n';
+    commit(&err, len, 1);
+    flushAll();
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,61 @@
+#ifndef SIMPLE_RUNTIME_H
+#define SIMPLE_RUNTIME_H
+
+// The builtins SIMPLE programs can declare with DEFINE EXT.  Everything takes and returns doubles, since that's the
+// only type SIMPLE has
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_MSC_VER)
+#define SIMPLE_NORETURN __declspec(noreturn)
+#else
+#define SIMPLE_NORETURN __attribute__((noreturn))
+#endif
+
+// Arrays are passed around as the address of one of these, which a double holds exactly.  Neither field changes while
+// the array is alive, but a region can reuse its memory for another array once it has gone
+struct SimpleArray {
+    double *data;
+    int64_t length;
+};
+
+// No array is longer than 2^52 elements, far more than fits in memory, so the compiler knows that adding one to an
+// index below the length gives a whole number a double holds exactly
+#define SIMPLE_MAX_LENGTH (INT64_C(1) << 52)
+
+// Write the character with code x to stderr
+double putchard(double x);
+// Write x to stdout on its own line
+double printd(double x);
+// The next number from stdin, or from the file SIMPLE_INPUT names.  NaN once there are none left
+double readd(void);
+// 1 when the input has no more numbers, otherwise 0
+double eof(void);
+// The file of raw doubles the environment variable SIMPLE_MAPIN<k> names, like SIMPLE_MAPIN0 for mapin(0), mapped as
+// an array.  Stores change the array but not the file
+double mapin(double k);
+// Create the file SIMPLE_MAPOUT<k> names with room for n doubles, all 0, and map it as an array.  Whatever the program
+// stores is in the file once it exits
+double mapout(double k, double n);
+// A new array of n doubles, all 0.  It lives until the program exits
+double array(double n);
+// The number of elements in an array
+double len(double array);
+// Generated code calls this when an index isn't a whole number in range.  It doesn't return
+SIMPLE_NORETURN void simple_index_error(double index, double length);
+// Generated code makes arrays that can't outlive the function or REGION block making them in a region.  Entering one
+// returns a mark, and leaving it with that mark frees everything made since, all at once
+void *simple_region_enter(void);
+void simple_region_leave(void *mark);
+// array(n), made in the innermost region
+double simple_region_array(double n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIMPLE_RUNTIME_H
@@ -1,3 +1,4 @@
+#include <climits>
 #include <memory>
 #include <fstream>
 #include <string>
@@ -14,15 +15,29 @@
 #include "../Compiler_Lib/parser.h"
 #include "../Compiler_Lib/visualizer.h"
 #include "../Compiler_Lib/codegen.h"
+#include "../Compiler_Lib/objcache.h"
+#include "../Compiler_Lib/bytecode.h"
+#include "../Compiler_Lib/vm.h"
+#include "../Compiler_Lib/linker.h"
 
 
 using namespace Compiler;
 
+// Native compiles to an object file.  The VM compiles to bytecode and runs it straight away
+enum class Backend { Native, VM };
+
 // Structure to hold command line arguments
 struct Config {
     std::string code;
     std::string outName = "out";
     bool link = false;
+    CodegenOptions codegen;
+    // Object cache directory.  Caching is off when empty
+    std::string cacheDir;
+    uint64_t cacheSize = 512;
+    bool cacheStats = false;
+    bool incremental = false;
+    Backend backend = Backend::Native;
 };
 
 // Read input file
@@ -39,21 +54,70 @@ std::string getInpFile(const std::string &path) {
 	}
 }
 
-// This is awful
-int linkSTL(Config config) {
-    // First write stl source
-    std::string stlSrc = "#include <stdio.h>\n"
-                         "extern double putchard(double X){fputc((char)X,stderr);return 0;}\n"
-                         "extern double printd(double X){fprintf(stdout,\"%f\\n\",X);return 0;}";
-    std::ofstream outfile("stl.c");
-    outfile << stlSrc << std::endl;
-    outfile.close();
-
-    // cc: system c compiler.  stl.c: my baby standard library : -lm link libm containing floating point maths routines -no-pie
-    std::string cmd = "cc " + config.outName + ".o stl.c -lm -no-pie";
-    int res = system(cmd.c_str());
-    remove("stl.c");
-    return res;
+// The directory holding the prebuilt runtime.  It is installed next to the compiler, but copies of the compiler fall
+// back to where it was built
+std::string runtimeDir() {
+#ifdef __linux__
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) {
+        std::string dir(path, len);
+        dir.erase(dir.rfind('/'));
+        if (std::ifstream(dir + "/libsimple_rt.a").good())
+            return dir;
+    }
+#endif
+    return SIMPLE_RT_DIR;
+}
+
+// Link the object file with the runtime library and libm, using the system C compiler for anything the built in linker
+// can't handle
+int linkRuntime(Config config) {
+    std::string runtime = runtimeDir() + "/libsimple_rt.a";
+    if (!std::ifstream(runtime).good()) {
+        std::cerr << "Unable to find the SIMPLE runtime '" << runtime << "'" << std::endl;
+        return 1;
+    }
+
+#if defined(__linux__) && defined(__x86_64__)
+    // Link in process when the built in linker can, which saves starting the C compiler driver and system linker
+    auto object = MemoryBuffer::getFile(config.outName + ".o");
+    auto archive = MemoryBuffer::getFile(runtime);
+    if (object && archive) {
+        Linker linker;
+        linker.addObject(**object);
+        linker.addArchive(**archive);
+        linker.addLibrary("libm.so.6");
+        if (config.codegen.vecLib == TargetLibraryInfoImpl::LIBMVEC_X86)
+            linker.addLibrary("libmvec.so.1");
+        else if (config.codegen.vecLib == TargetLibraryInfoImpl::SVML)
+            linker.addLibrary("libsvml.so");
+        linker.addLibrary("libc.so.6");
+#ifdef LIBC_NONSHARED
+        // glibc's libc.so is a linker script that also links this, for the few functions like atexit that are only
+        // in the static library
+        auto nonShared = MemoryBuffer::getFile(LIBC_NONSHARED);
+        if (nonShared)
+            linker.addArchive(**nonShared);
+#endif
+        try {
+            if (linker.link("a.out"))
+                return 0;
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+#endif
+
+    // cc: system c compiler.  -lm link libm containing floating point maths routines -no-pie
+    std::string cmd = "cc " + config.outName + ".o '" + runtime + "' -lm -no-pie";
+    // Vectorised loops call into the vector math library
+    if (config.codegen.vecLib == TargetLibraryInfoImpl::LIBMVEC_X86)
+        cmd += " -lmvec";
+    else if (config.codegen.vecLib == TargetLibraryInfoImpl::SVML)
+        cmd += " -lsvml";
+    return system(cmd.c_str());
 }
 
 // Run compiler
@@ -70,6 +134,7 @@ int run(Config config) {
     // Parens
     myParser.registerPrefixTok(LEFTPAREN, std::make_unique<GroupParser>(PREFIX));
     myParser.registerInfixTok(LEFTPAREN, std::make_unique<CallParser>(CALL));
+    myParser.registerInfixTok(LEFTSQ, std::make_unique<IndexParser>(CALL));
 
     // a ? b : c
     myParser.registerInfixTok(CONDITIONAL, std::make_unique<TernaryOperatorParser>(TERNARY));
@@ -103,36 +168,209 @@ int run(Config config) {
     myParser.infixLeft(LEQ, RELATIONAL);
     myParser.infixLeft(GREQ, RELATIONAL);
 
-    // Parse program
-    std::shared_ptr<AST> tree;
+    // Small programs finish long before LLVM would have been set up, so the VM skips it and the linker entirely
+    if (config.backend == Backend::VM) {
+        try {
+            std::shared_ptr<AST> tree = myParser.parse();
+            auto program = dynamic_cast<BlockAST *>(tree.get());
+            if (!program)
+                throw std::runtime_error("Expected a program");
+            BytecodeCompiler compiler;
+            BytecodeProgram bytecode = compiler.compile(program);
+            VM vm(bytecode);
+            vm.run();
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    // ThinLTO bitcode is linked by another toolchain, so there's no object to cache or link
+    if (config.codegen.lto == CodegenOptions::LTOThin) {
+        try {
+            std::shared_ptr<AST> tree = myParser.parse();
+            Codegen generator(config.codegen);
+            tree->accept(&generator);
+            return generator.emitBitcode(config.outName);
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Reuse the object from an earlier compilation of the same source with the same options
+    std::unique_ptr<ObjCache> cache;
+    std::string key;
+    if (!config.cacheDir.empty()) {
+        cache = std::make_unique<ObjCache>(config.cacheDir, config.cacheSize * 1024 * 1024);
+        key = ObjCache::sourceKey(config.code, config.codegen);
+    }
+
     int res;
-    try {
-        tree = myParser.parse();
-        // Generate object code
-        Codegen generator;
+    std::unique_ptr<MemoryBuffer> cached = cache ? cache->lookup(key) : nullptr;
+    if (cached) {
+        std::ofstream out(config.outName + ".o", std::ios::binary);
+        out << cached->getBuffer().str();
+        res = out.good() ? 0 : 1;
+    } else {
+        // Parse program
+        std::shared_ptr<AST> tree;
+        try {
+            tree = myParser.parse();
+            // Generate object code
+            Codegen generator(config.codegen);
+            if (config.incremental)
+                generator.enableIncremental(cache.get());
 
-        tree->accept(&generator);
+            tree->accept(&generator);
 
-        res = generator.emitObjCode(config.outName);
+            res = generator.emitObjCode(config.outName);
 
-    } catch (std::runtime_error& e) {
-        std::cerr << e.what() << std::endl;
-        exit(EXIT_FAILURE);
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if (cache && res == 0) {
+            auto object = MemoryBuffer::getFile(config.outName + ".o");
+            if (object)
+                cache->store(key, (*object)->getBuffer());
+        }
     }
 
+    if (cache && config.cacheStats)
+        cache->printStats(outs());
+
 
     // Link if option is present
     if (config.link)
-        return linkSTL(config);
+        return linkRuntime(config);
 
     return res;
 }
 
+// Parse the whole number given to an option.  Returns false if it isn't one or is larger than max
+bool parseNumber(const std::string &arg, unsigned long max, unsigned long &value) {
+    if (arg.empty() || arg.find_first_not_of("0123456789") != std::string::npos || arg.size() > 9)
+        return false;
+    value = std::stoul(arg);
+    return value <= max;
+}
+
+// Parse a -f<flag> option.  Returns false if the flag isn't recognised
+bool parseFlag(Config &config, const std::string &flag) {
+    if (flag.compare(0, 7, "veclib=") == 0) {
+        std::string lib = flag.substr(7);
+        if (lib == "none")
+            config.codegen.vecLib = TargetLibraryInfoImpl::NoLibrary;
+        else if (lib == "libmvec")
+            config.codegen.vecLib = TargetLibraryInfoImpl::LIBMVEC_X86;
+        else if (lib == "svml")
+            config.codegen.vecLib = TargetLibraryInfoImpl::SVML;
+        else
+            return false;
+        return true;
+    }
+    if (flag.compare(0, 10, "memo-size=") == 0) {
+        std::string size = flag.substr(10);
+        if (size.empty() || size.find_first_not_of("0123456789") != std::string::npos || size.size() > 9 ||
+            std::stoul(size) == 0)
+            return false;
+        config.codegen.memoSize = std::stoul(size);
+        return true;
+    }
+    if (flag.compare(0, 17, "const-eval-steps=") == 0) {
+        std::string steps = flag.substr(17);
+        if (steps.empty() || steps.find_first_not_of("0123456789") != std::string::npos || steps.size() > 12)
+            return false;
+        config.codegen.constEvalSteps = std::stoul(steps);
+        return true;
+    }
+    if (flag.compare(0, 11, "memo-evict=") == 0) {
+        std::string policy = flag.substr(11);
+        if (policy == "replace")
+            config.codegen.memoEvict = CodegenOptions::EvictReplace;
+        else if (policy == "keep")
+            config.codegen.memoEvict = CodegenOptions::EvictKeep;
+        else
+            return false;
+        return true;
+    }
+    if (flag.compare(0, 12, "fp-contract=") == 0) {
+        std::string mode = flag.substr(12);
+        if (mode == "off")
+            config.codegen.fpContract = CodegenOptions::ContractOff;
+        else if (mode == "on")
+            config.codegen.fpContract = CodegenOptions::ContractOn;
+        else if (mode == "fast")
+            config.codegen.fpContract = CodegenOptions::ContractFast;
+        else
+            return false;
+        return true;
+    }
+    if (flag == "lto" || flag == "lto=full") {
+        config.codegen.lto = CodegenOptions::LTOFull;
+        return true;
+    }
+    if (flag == "lto=thin") {
+        config.codegen.lto = CodegenOptions::LTOThin;
+        return true;
+    }
+    if (flag == "no-lto") {
+        config.codegen.lto = CodegenOptions::LTONone;
+        return true;
+    }
+    // Like C compilers, fast-math implies no-math-errno
+    if (flag == "fast-math") {
+        config.codegen.fastMath = true;
+        config.codegen.mathErrno = false;
+    } else if (flag == "no-fast-math") {
+        config.codegen.fastMath = false;
+    } else if (flag == "math-errno") {
+        config.codegen.mathErrno = true;
+    } else if (flag == "no-math-errno") {
+        config.codegen.mathErrno = false;
+    } else if (flag == "memoize") {
+        config.codegen.memoize = true;
+    } else if (flag == "no-memoize") {
+        config.codegen.memoize = false;
+    } else if (flag == "memo-stats") {
+        config.codegen.memoStats = true;
+    } else if (flag == "const-eval") {
+        config.codegen.constEval = true;
+    } else if (flag == "no-const-eval") {
+        config.codegen.constEval = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void printHelp(char *argv[]) {
     std::cout << "Usage: " << argv[0] << " [options] <input>" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -o <file>\tWrite output to <file>." << std::endl;
-    std::cout << "  -l\t\tLink the object file with the system C compiler and SIMPLE standard library." << std::endl;
+    std::cout << "  -b <backend>\tnative (default) compiles to an object file, vm runs the program in the bytecode VM." << std::endl;
+    std::cout << "  -l\t\tLink the object file with the SIMPLE runtime library into a.out." << std::endl;
+    std::cout << "  -j <n>\t\tOptimise and emit partitions on <n> threads (0 uses every hardware thread)." << std::endl;
+    std::cout << "  -p <n>\t\tSplit the module into <n> partitions for parallel code generation." << std::endl;
+    std::cout << "  -c <dir>\tCache object files in <dir> and reuse them for identical compilations." << std::endl;
+    std::cout << "  -m <mb>\tLimit the object cache to <mb> megabytes (default 512)." << std::endl;
+    std::cout << "  -s\t\tPrint object cache hit, miss and eviction counts." << std::endl;
+    std::cout << "  -i\t\tCompile incrementally, reusing cached objects for functions that haven't changed. Needs -c." << std::endl;
+    std::cout << "  -ffast-math\tAllow optimisations that ignore NaNs, infinities, signed zeros and rounding." << std::endl;
+    std::cout << "  -fmath-errno\tKeep math functions that can set errno as library calls. -fno-math-errno is the default." << std::endl;
+    std::cout << "  -ffp-contract=<mode>\tFuse multiplies and adds: off (default), on (within an expression) or fast." << std::endl;
+    std::cout << "  -fveclib=<lib>\tVectorise math functions with <lib>: none, libmvec or svml." << std::endl;
+    std::cout << "  -fmemoize\tCache the results of pure recursive functions, as if they were defined with MEMO." << std::endl;
+    std::cout << "  -fmemo-size=<n>\tCache up to <n> results per MEMO function (default 4096)." << std::endl;
+    std::cout << "  -fmemo-evict=<policy>\tWhen a cache is full, replace an old result (replace, default) or keep it." << std::endl;
+    std::cout << "  -fmemo-stats\tPrint cache hit rates to stderr when the program exits." << std::endl;
+    std::cout << "  -flto[=full|thin]\tfull optimises the runtime library together with the program, thin writes <file>.bc with a ThinLTO summary." << std::endl;
+    std::cout << "  -fno-const-eval\tDon't run calls to pure functions with constant arguments at compile time." << std::endl;
+    std::cout << "  -fconst-eval-steps=<n>\tGive up evaluating a call after <n> expressions, and a function's calls after 4 times that (default 1000000)." << std::endl;
+    std::cout << "  -Wrecursion\tWarn about recursive calls that can't be turned into loops." << std::endl;
 }
 
 // Collect arguments and run
@@ -141,7 +379,8 @@ int main(int argc, char *argv[])
     Config config = Config();
 
     int c;
-    while((c = getopt (argc, argv, "hlo:")) != -1) {
+    unsigned long number;
+    while((c = getopt (argc, argv, "hlo:j:p:c:m:sif:W:b:")) != -1) {
     	switch (c) {
     		case 'o':
     			config.outName = optarg;
@@ -149,6 +388,61 @@ int main(int argc, char *argv[])
     	    case 'l':
     	        config.link = true;
     	        break;
+    	    case 'j':
+    	        if (!parseNumber(optarg, 65536, number)) {
+    	            std::cout << argv[0] << ": error: invalid number of threads " << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        config.codegen.threads = number;
+    	        break;
+    	    case 'p':
+    	        if (!parseNumber(optarg, UINT_MAX, number)) {
+    	            std::cout << argv[0] << ": error: invalid number of partitions " << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        config.codegen.partitions = number;
+    	        break;
+    	    case 'c':
+    	        config.cacheDir = optarg;
+    	        break;
+    	    case 'm':
+    	        // Up to 16 TiB, so the size in bytes can't overflow
+    	        if (!parseNumber(optarg, 1ul << 24, number) || number == 0) {
+    	            std::cout << argv[0] << ": error: invalid cache size " << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        config.cacheSize = number;
+    	        break;
+    	    case 's':
+    	        config.cacheStats = true;
+    	        break;
+    	    case 'i':
+    	        config.incremental = true;
+    	        break;
+    	    case 'f':
+    	        if (!parseFlag(config, optarg)) {
+    	            std::cout << argv[0] << ": error: unknown option -f" << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        break;
+    	    case 'b':
+    	        if (std::string(optarg) == "native") {
+    	            config.backend = Backend::Native;
+    	        } else if (std::string(optarg) == "vm") {
+    	            config.backend = Backend::VM;
+    	        } else {
+    	            std::cout << argv[0] << ": error: unknown backend " << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        break;
+    	    case 'W':
+    	        if (std::string(optarg) == "recursion") {
+    	            config.codegen.warnRecursion = true;
+    	        } else {
+    	            std::cout << argv[0] << ": error: unknown warning -W" << optarg << std::endl;
+    	            exit(EXIT_FAILURE);
+    	        }
+    	        break;
     	    case 'h':
     	        printHelp(argv);
     	        exit(EXIT_SUCCESS);
@@ -167,6 +461,34 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (config.incremental && config.cacheDir.empty()) {
+        std::cout << argv[0] << ": error: -i needs a cache directory (-c <dir>)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Hit counts are printed by a destructor in the main module, which incremental builds don't emit
+    if (config.incremental && config.codegen.memoStats) {
+        std::cout << argv[0] << ": error: -fmemo-stats can't be used with -i" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.codegen.lto != CodegenOptions::LTONone && config.incremental) {
+        std::cout << argv[0] << ": error: -flto can't be used with -i" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (config.codegen.lto == CodegenOptions::LTOThin && config.link) {
+        std::cout << argv[0] << ": error: -flto=thin writes bitcode, which -l can't link" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (config.codegen.lto == CodegenOptions::LTOFull && config.backend == Backend::Native) {
+        config.codegen.runtimeBitcode = runtimeDir() + "/simple_rt.bc";
+        if (!std::ifstream(config.codegen.runtimeBitcode).good()) {
+            std::cout << argv[0] << ": error: -flto needs the runtime bitcode '" << config.codegen.runtimeBitcode
+                      << "', which is only built when clang is available" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
     int res = run(config);
 	
 	return res;
@@ -0,0 +1,185 @@
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+# Compares the native backend with the bytecode VM.  Startup is the time from source to finished program: compiling,
+# linking and running for native, and just running the compiler for the VM.  Throughput programs do enough work for
+# execution to dominate.  Build the compiler in `build/` first, then run this from the `test/` directory
+
+# Programs that do almost nothing, so the time is all startup
+STARTUP = [
+    "Test programs/main.simple",
+    "Test programs/math/add.simple",
+    "Test programs/control flow/for.simple",
+]
+
+# Programs that do real work
+THROUGHPUT = {
+    "fib": """BEGIN
+    DEFINE EXT printd(x)
+    DEFINE fib(n)
+        n < 2 ? n : fib(n - 1) + fib(n - 2)
+    ENDDEF
+    DEFINE main()
+        printd(fib(27))
+    ENDDEF
+END""",
+    "loops": """BEGIN
+    DEFINE EXT printd(x)
+    DEFINE main()
+        total = 0
+        FOR i = 0, i < 2000 IN
+            FOR j = 0, j < 2000 IN
+                total = total + (i * j % 7 < 3 ? 1 : 0.5)
+            ENDFOR
+        ENDFOR
+        printd(total)
+    ENDDEF
+END""",
+    "mandelbrot": "Test programs/complex programs/mandelbrot.simple",
+}
+
+# Programs that are mostly printing, measured in characters written per second
+OUTPUT = {
+    "printd": """BEGIN
+    DEFINE EXT printd(x)
+    DEFINE main()
+        FOR i = 0, i < 200000 IN
+            printd(i / 7)
+        ENDFOR
+    ENDDEF
+END""",
+    "putchard": """BEGIN
+    DEFINE EXT putchard(x)
+    DEFINE main()
+        FOR i = 0, i < 1000000 IN
+            putchard(i % 64 == 63 ? 10 : 42)
+        ENDFOR
+    ENDDEF
+END""",
+    "mandelbrot": "Test programs/complex programs/mandelbrot.simple",
+}
+
+# Programs that read numbers, measured in characters read per second
+INPUT = {
+    "readd": """BEGIN
+    DEFINE EXT printd(x)
+    DEFINE EXT readd()
+    DEFINE EXT eof()
+    DEFINE main()
+        total = 0
+        FOR i = 0, eof() == 0 IN
+            total = total + readd()
+        ENDFOR
+        printd(total)
+    ENDDEF
+END""",
+}
+
+# How many numbers the input programs read
+INPUT_NUMBERS = 2000000
+
+RUNS = 5
+
+
+# Fastest of several runs of a command, in milliseconds.  main returns a double, so exit codes mean nothing
+def timecommand(cmd, cwd, env=None):
+    best = None
+    for _ in range(RUNS):
+        start = time.perf_counter()
+        subprocess.run(cmd, cwd=cwd, env=env, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        elapsed = (time.perf_counter() - start) * 1000
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+# Time a program with both backends
+def bench(name, path, compiler, workdir):
+    compile_ms = timecommand([compiler, path, "-l", "-o", "out"], workdir)
+    run_ms = timecommand(["./a.out"], workdir)
+    vm_ms = timecommand([compiler, path, "-b", "vm"], workdir)
+    native_ms = compile_ms + run_ms
+    print("{:<28} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>8.1f}x".format(
+        name, compile_ms, run_ms, native_ms, vm_ms, native_ms / vm_ms))
+
+
+# Characters per second written by each backend, with the output redirected rather than going to a terminal
+def benchoutput(name, path, compiler, workdir):
+    subprocess.run([compiler, path, "-l", "-o", "out"], cwd=workdir, stdout=subprocess.DEVNULL)
+    with tempfile.TemporaryFile() as output:
+        subprocess.run(["./a.out"], cwd=workdir, stdout=output, stderr=output)
+        chars = output.tell()
+    run_ms = timecommand(["./a.out"], workdir)
+    vm_ms = timecommand([compiler, path, "-b", "vm"], workdir)
+    print("{:<28} {:>10} {:>10.1f} {:>10.1f} {:>12.0f} {:>12.0f}".format(
+        name, chars, run_ms, vm_ms, chars / run_ms * 1000, chars / vm_ms * 1000))
+
+
+# Characters per second read by each backend from a file of whole numbers, decimals and exponents
+def benchinput(name, path, compiler, workdir):
+    data = os.path.join(workdir, "input.txt")
+    rng = random.Random(1)
+    with open(data, "w") as f:
+        for i in range(INPUT_NUMBERS):
+            kind = i % 3
+            if kind == 0:
+                f.write("{} ".format(rng.randint(-100000, 100000)))
+            elif kind == 1:
+                f.write("{:.6f}\n".format(rng.uniform(-1000, 1000)))
+            else:
+                f.write("{:.15e}, ".format(rng.uniform(-1, 1)))
+    chars = os.path.getsize(data)
+    env = dict(os.environ, SIMPLE_INPUT=data)
+    subprocess.run([compiler, path, "-l", "-o", "out"], cwd=workdir, stdout=subprocess.DEVNULL)
+    run_ms = timecommand(["./a.out"], workdir, env)
+    vm_ms = timecommand([compiler, path, "-b", "vm"], workdir, env)
+    print("{:<28} {:>10} {:>10.1f} {:>10.1f} {:>12.0f} {:>12.0f}".format(
+        name, chars, run_ms, vm_ms, chars / run_ms * 1000, chars / vm_ms * 1000))
+
+
+# Write a program given as source to the work directory
+def sourcepath(name, source, workdir):
+    if not source.startswith("BEGIN"):
+        return os.path.abspath(source)
+    path = os.path.join(workdir, name + ".simple")
+    with open(path, "w") as f:
+        f.write(source)
+    return path
+
+
+def main():
+    compiler = os.path.abspath("../build/Compiler_exe/compiler_exe")
+    if not os.path.exists(compiler):
+        print("No compiler binary found in '../build/Compiler_exe/compiler_exe'.\nPlease build before benchmarking")
+        sys.exit(1)
+
+    workdir = tempfile.mkdtemp()
+    try:
+        print("Times in ms, best of {}".format(RUNS))
+        print("{:<28} {:>10} {:>10} {:>10} {:>10} {:>9}".format(
+            "program", "compile", "run", "native", "vm", "vm speed"))
+        print("Startup")
+        for path in STARTUP:
+            bench(os.path.basename(path), os.path.abspath(path), compiler, workdir)
+        print("Throughput")
+        for name, source in THROUGHPUT.items():
+            bench(name, sourcepath(name, source, workdir), compiler, workdir)
+        print("Output")
+        print("{:<28} {:>10} {:>10} {:>10} {:>12} {:>12}".format(
+            "program", "chars", "native", "vm", "native ch/s", "vm ch/s"))
+        for name, source in OUTPUT.items():
+            benchoutput(name, sourcepath(name, source, workdir), compiler, workdir)
+        print("Input")
+        for name, source in INPUT.items():
+            benchinput(name, sourcepath(name, source, workdir), compiler, workdir)
+    finally:
+        shutil.rmtree(workdir)
+
+
+if __name__ == "__main__":
+    main()
@@ -24,7 +24,7 @@ def log(message, ok):
 
 
 # Parse expected value from source file
-# Format #EXPECT:n
+# Format #EXPECT:n, where \n separates lines of output
 # This format is mainly for clarity when reading
 def getexpectedoutput(path):
     exp = ""
@@ -32,22 +32,32 @@ def getexpectedoutput(path):
         top = f.readline()
         spl = top.split(':')
         if spl[0] == "#EXPECT":
-            exp = spl[1].rstrip()
+            exp = spl[1].rstrip().replace("\\n", "\n")
     # If no #EXPECT, return a blank string
     return exp
 
 
-# Call program and see if the output value was what was expected
-def testrun(path):
-    process = subprocess.Popen(["./a.out"], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+# Call program and see if the output value was what was expected.  Programs that read input get the file next to them
+# with the extension .in.  mapin(0) and mapout(0, n) both map the same scratch file, so a program can read back what
+# it wrote.  The command is either the linked program or the compiler running it in the VM
+def testrun(path, command):
+    input = os.path.splitext(path)[0] + ".in"
+    stdin = open(input, "rb") if os.path.exists(input) else subprocess.DEVNULL
+    env = dict(os.environ, SIMPLE_MAPIN0="mapped.bin", SIMPLE_MAPOUT0="mapped.bin")
+    process = subprocess.Popen(command, stdin=stdin, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=env)
     stdout, stderr = process.communicate()
+    if stdin != subprocess.DEVNULL:
+        stdin.close()
+    if os.path.exists("mapped.bin"):
+        os.remove("mapped.bin")
 
     exp = getexpectedoutput(path)
     stdout = stdout.decode("utf-8").rstrip()
+    backend = "VM output" if "vm" in command else "Output"
     if stdout.startswith(exp):
-        log("Output '" + stdout + "' was expected", True)
+        log(backend + " '" + stdout + "' was expected", True)
     else:
-        log("Expected '" + exp + "' but got '" + stdout + "'", False)
+        log(backend + ": expected '" + exp + "' but got '" + stdout + "'", False)
     print("")
 
 
@@ -70,7 +80,9 @@ def testcompile(path):
             log("'" + path + "' did not compile: " + stderr.decode("utf-8"), False)
         else:
             log("'" + path + "' compiled successfully", True)
-            testrun(path)
+            testrun(path, ["./a.out"])
+            # The bytecode VM has to give the same output
+            testrun(path, ["./simple", "-b", "vm", path])
 
 
 def main():